@@ -0,0 +1,421 @@
+/**
+  ******************************************************************************
+  * @encoding  utf-8
+  * @file      cbtree.c
+  * @author    ZYX
+  * @brief     None
+  ******************************************************************************
+  */
+
+#include <stddef.h>
+#include <string.h>
+#include "cbtree.h"
+
+// 和clist一样，分配器的函数指针不能存入共享内存，这里直接使用文件系统的分配器
+void* alloc_memory(size_t size);
+void free_memory(void* mem);
+
+/* B树的最小度数，除根节点外每个节点至少有CBTREE_MIN_DEGREE - 1个元素 */
+constexpr size_t CBTREE_MIN_DEGREE = 8;
+constexpr size_t CBTREE_MAX_ITEMS = 2 * CBTREE_MIN_DEGREE - 1;
+
+typedef struct CBTreeNode CBTreeNode;
+
+struct CBTreeNode
+{
+    size_t count; /* 当前元素个数 */
+    bool leaf; /* 是否是叶子节点 */
+    void* items[CBTREE_MAX_ITEMS];
+    CBTreeNode* children[CBTREE_MAX_ITEMS + 1];
+};
+
+struct CBTree
+{
+    size_t size;
+    CBTreeNode* root;
+};
+
+static CBTreeNode* _node_create(bool leaf)
+{
+    auto node = (CBTreeNode*)alloc_memory(sizeof(CBTreeNode));
+    if (node == nullptr)
+        return nullptr;
+    node->count = 0;
+    node->leaf = leaf;
+    return node;
+}
+
+/**
+ * 从预先分配的节点中取出一个，预留的节点通过children[0]串成链表
+ */
+static CBTreeNode* _node_take(CBTreeNode** spare, bool leaf)
+{
+    auto node = *spare;
+    *spare = node->children[0];
+    node->count = 0;
+    node->leaf = leaf;
+    return node;
+}
+
+static void _spare_destroy(CBTreeNode* spare)
+{
+    while (spare != nullptr) {
+        auto next = spare->children[0];
+        free_memory(spare);
+        spare = next;
+    }
+}
+
+static void _node_destroy(CBTreeNode* node)
+{
+    if (!node->leaf) {
+        for (size_t i = 0; i <= node->count; ++i) {
+            _node_destroy(node->children[i]);
+        }
+    }
+    free_memory(node);
+}
+
+/**
+ * 在节点中查找第一个不小于key的元素位置
+ */
+static size_t _node_lower_bound(CBTreeNode* node, const void* key, cbtree_compare compare)
+{
+    size_t lo = 0, hi = node->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (compare(key, node->items[mid]) > 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * 分裂parent的第index个已满的子节点，新节点从spare中取出
+ */
+static void _split_child(CBTreeNode* parent, size_t index, CBTreeNode** spare)
+{
+    auto left = parent->children[index];
+    auto right = _node_take(spare, left->leaf);
+    constexpr size_t t = CBTREE_MIN_DEGREE;
+
+    /* 后t-1个元素移入新节点 */
+    right->count = t - 1;
+    memcpy(right->items, left->items + t, (t - 1) * sizeof(void*));
+    if (!left->leaf) {
+        memcpy(right->children, left->children + t, t * sizeof(CBTreeNode*));
+    }
+    left->count = t - 1;
+
+    /* 中间元素上移到父节点 */
+    memmove(parent->children + index + 2, parent->children + index + 1,
+            (parent->count - index) * sizeof(CBTreeNode*));
+    memmove(parent->items + index + 1, parent->items + index, (parent->count - index) * sizeof(void*));
+    parent->children[index + 1] = right;
+    parent->items[index] = left->items[t - 1];
+    ++parent->count;
+}
+
+/**
+ * 将parent的第index个元素和其左右两个子节点合并为一个子节点
+ */
+static void _merge_children(CBTreeNode* parent, size_t index)
+{
+    auto left = parent->children[index];
+    auto right = parent->children[index + 1];
+
+    left->items[left->count] = parent->items[index];
+    memcpy(left->items + left->count + 1, right->items, right->count * sizeof(void*));
+    if (!left->leaf) {
+        memcpy(left->children + left->count + 1, right->children, (right->count + 1) * sizeof(CBTreeNode*));
+    }
+    left->count += right->count + 1;
+
+    memmove(parent->items + index, parent->items + index + 1, (parent->count - index - 1) * sizeof(void*));
+    memmove(parent->children + index + 1, parent->children + index + 2,
+            (parent->count - index - 1) * sizeof(CBTreeNode*));
+    --parent->count;
+    free_memory(right);
+}
+
+/**
+ * 保证parent的第index个子节点至少有t个元素，向兄弟节点借或者与兄弟节点合并
+ * @return 调整后原来范围所在的子节点下标
+ */
+static size_t _fix_child(CBTreeNode* parent, size_t index)
+{
+    auto child = parent->children[index];
+    if (child->count >= CBTREE_MIN_DEGREE)
+        return index;
+
+    if (index > 0 && parent->children[index - 1]->count >= CBTREE_MIN_DEGREE) {
+        /* 从左兄弟借一个元素 */
+        auto left = parent->children[index - 1];
+        memmove(child->items + 1, child->items, child->count * sizeof(void*));
+        if (!child->leaf) {
+            memmove(child->children + 1, child->children, (child->count + 1) * sizeof(CBTreeNode*));
+            child->children[0] = left->children[left->count];
+        }
+        child->items[0] = parent->items[index - 1];
+        parent->items[index - 1] = left->items[left->count - 1];
+        --left->count;
+        ++child->count;
+        return index;
+    }
+    if (index < parent->count && parent->children[index + 1]->count >= CBTREE_MIN_DEGREE) {
+        /* 从右兄弟借一个元素 */
+        auto right = parent->children[index + 1];
+        child->items[child->count] = parent->items[index];
+        if (!child->leaf) {
+            child->children[child->count + 1] = right->children[0];
+            memmove(right->children, right->children + 1, right->count * sizeof(CBTreeNode*));
+        }
+        parent->items[index] = right->items[0];
+        memmove(right->items, right->items + 1, (right->count - 1) * sizeof(void*));
+        --right->count;
+        ++child->count;
+        return index;
+    }
+    /* 兄弟节点都不够，只能合并 */
+    if (index < parent->count) {
+        _merge_children(parent, index);
+        return index;
+    }
+    _merge_children(parent, index - 1);
+    return index - 1;
+}
+
+static void* _remove_max(CBTreeNode* node)
+{
+    while (!node->leaf) {
+        auto index = _fix_child(node, node->count);
+        node = node->children[index];
+    }
+    return node->items[--node->count];
+}
+
+static void* _remove_min(CBTreeNode* node)
+{
+    while (!node->leaf) {
+        auto index = _fix_child(node, 0);
+        node = node->children[index];
+    }
+    void* item = node->items[0];
+    memmove(node->items, node->items + 1, (node->count - 1) * sizeof(void*));
+    --node->count;
+    return item;
+}
+
+static void* _remove(CBTreeNode* node, const void* key, cbtree_compare compare)
+{
+    auto index = _node_lower_bound(node, key, compare);
+    if (index < node->count && compare(key, node->items[index]) == 0) {
+        void* item = node->items[index];
+        if (node->leaf) {
+            memmove(node->items + index, node->items + index + 1, (node->count - index - 1) * sizeof(void*));
+            --node->count;
+        } else if (node->children[index]->count >= CBTREE_MIN_DEGREE) {
+            /* 用前驱替换 */
+            node->items[index] = _remove_max(node->children[index]);
+        } else if (node->children[index + 1]->count >= CBTREE_MIN_DEGREE) {
+            /* 用后继替换 */
+            node->items[index] = _remove_min(node->children[index + 1]);
+        } else {
+            /* 合并后在子节点中删除 */
+            _merge_children(node, index);
+            return _remove(node->children[index], key, compare);
+        }
+        return item;
+    }
+    if (node->leaf)
+        return nullptr;
+    index = _fix_child(node, index);
+    return _remove(node->children[index], key, compare);
+}
+
+static bool _foreach_from(CBTreeNode* node, const void* key, cbtree_compare compare, cbtree_visitor visitor,
+                          void* ctx)
+{
+    size_t index = key == nullptr ? 0 : _node_lower_bound(node, key, compare);
+    /* 只有第index个子节点中可能存在小于key的元素 */
+    if (!node->leaf && !_foreach_from(node->children[index], key, compare, visitor, ctx))
+        return false;
+    for (; index < node->count; ++index) {
+        if (!visitor(node->items[index], ctx))
+            return false;
+        if (!node->leaf && !_foreach_from(node->children[index + 1], nullptr, compare, visitor, ctx))
+            return false;
+    }
+    return true;
+}
+
+static void _relocate(CBTreeNode* node, cbtree_relocator node_relocate, cbtree_relocator item_relocate, void* ctx)
+{
+    if (item_relocate != nullptr) {
+        for (size_t i = 0; i < node->count; ++i) {
+            item_relocate(&node->items[i], ctx);
+        }
+    }
+    if (node->leaf)
+        return;
+    /* 先用原来的指针访问子节点，再修正指向子节点的指针 */
+    for (size_t i = 0; i <= node->count; ++i) {
+        _relocate(node->children[i], node_relocate, item_relocate, ctx);
+        node_relocate((void**)&node->children[i], ctx);
+    }
+}
+
+CBTree* cbtree_create()
+{
+    auto cbtree = (CBTree*)alloc_memory(sizeof(CBTree));
+    if (cbtree == nullptr)
+        return nullptr;
+    cbtree->size = 0;
+    cbtree->root = _node_create(true);
+    if (cbtree->root == nullptr) {
+        free_memory(cbtree);
+        return nullptr;
+    }
+    return cbtree;
+}
+
+void cbtree_destroy(CBTree* cbtree)
+{
+    _node_destroy(cbtree->root);
+    cbtree->root = nullptr;
+    free_memory(cbtree);
+}
+
+bool cbtree_insert(CBTree* cbtree, void* item, const void* key, cbtree_compare compare)
+{
+    if (cbtree_find(cbtree, key, compare) != nullptr)
+        return false;
+    /*
+     * 分裂满节点后仍然进入原来的子节点分出的一半，所以需要分裂的节点就是查找路径上的满节点
+     * 先分配好所有新节点，内存不足时树不变
+     */
+    size_t needed = cbtree->root->count == CBTREE_MAX_ITEMS ? 1 : 0;
+    for (auto node = cbtree->root;; node = node->children[_node_lower_bound(node, key, compare)]) {
+        if (node->count == CBTREE_MAX_ITEMS)
+            ++needed;
+        if (node->leaf)
+            break;
+    }
+    CBTreeNode* spare = nullptr;
+    for (size_t i = 0; i < needed; ++i) {
+        auto node = (CBTreeNode*)alloc_memory(sizeof(CBTreeNode));
+        if (node == nullptr) {
+            _spare_destroy(spare);
+            return false;
+        }
+        node->children[0] = spare;
+        spare = node;
+    }
+    /* 根节点已满时先分裂根节点，树高加一 */
+    if (cbtree->root->count == CBTREE_MAX_ITEMS) {
+        auto new_root = _node_take(&spare, false);
+        new_root->children[0] = cbtree->root;
+        cbtree->root = new_root;
+        _split_child(new_root, 0, &spare);
+    }
+    /* 自顶向下，遇到满节点提前分裂，保证插入时叶子节点不满 */
+    auto node = cbtree->root;
+    while (!node->leaf) {
+        auto index = _node_lower_bound(node, key, compare);
+        if (node->children[index]->count == CBTREE_MAX_ITEMS) {
+            _split_child(node, index, &spare);
+            if (compare(key, node->items[index]) > 0)
+                ++index;
+        }
+        node = node->children[index];
+    }
+    auto index = _node_lower_bound(node, key, compare);
+    memmove(node->items + index + 1, node->items + index, (node->count - index) * sizeof(void*));
+    node->items[index] = item;
+    ++node->count;
+    ++cbtree->size;
+    return true;
+}
+
+void* cbtree_remove(CBTree* cbtree, const void* key, cbtree_compare compare)
+{
+    void* item = _remove(cbtree->root, key, compare);
+    if (item != nullptr)
+        --cbtree->size;
+    /* 根节点被合并空后，树高减一 */
+    if (cbtree->root->count == 0 && !cbtree->root->leaf) {
+        auto old_root = cbtree->root;
+        cbtree->root = old_root->children[0];
+        free_memory(old_root);
+    }
+    return item;
+}
+
+void* cbtree_find(CBTree* cbtree, const void* key, cbtree_compare compare)
+{
+    auto node = cbtree->root;
+    while (true) {
+        auto index = _node_lower_bound(node, key, compare);
+        if (index < node->count && compare(key, node->items[index]) == 0)
+            return node->items[index];
+        if (node->leaf)
+            return nullptr;
+        node = node->children[index];
+    }
+}
+
+void cbtree_foreach_from(CBTree* cbtree, const void* key, cbtree_compare compare, cbtree_visitor visitor,
+                         void* ctx)
+{
+    _foreach_from(cbtree->root, key, compare, visitor, ctx);
+}
+
+size_t cbtree_size(CBTree* cbtree)
+{
+    return cbtree->size;
+}
+
+void cbtree_relocate(CBTree* cbtree, cbtree_relocator node_relocate, cbtree_relocator item_relocate, void* ctx)
+{
+    _relocate(cbtree->root, node_relocate, item_relocate, ctx);
+    node_relocate((void**)&cbtree->root, ctx);
+}
+
+void cbtree_relocate_item(CBTree* cbtree, const void* key, cbtree_compare compare, cbtree_relocator item_relocate,
+                          void* ctx)
+{
+    auto node = cbtree->root;
+    while (true) {
+        auto index = _node_lower_bound(node, key, compare);
+        if (index < node->count && compare(key, node->items[index]) == 0) {
+            item_relocate(&node->items[index], ctx);
+            return;
+        }
+        if (node->leaf)
+            return;
+        node = node->children[index];
+    }
+}
+
+void cbtree_relocate_node(CBTree* cbtree, void* node, cbtree_compare item_compare, cbtree_relocator node_relocate,
+                          void* ctx)
+{
+    auto target = (CBTreeNode*)node;
+    if (cbtree->root == target) {
+        node_relocate((void**)&cbtree->root, ctx);
+        return;
+    }
+    /* 非根节点至少有一个元素，用它从根节点向下查找，路径上一定会经过指向target的指针 */
+    auto key = target->items[0];
+    for (auto current = cbtree->root; !current->leaf;) {
+        auto index = _node_lower_bound(current, key, item_compare);
+        if (current->children[index] == target) {
+            node_relocate((void**)&current->children[index], ctx);
+            return;
+        }
+        current = current->children[index];
+    }
+}
@@ -0,0 +1,89 @@
+/**
+  ******************************************************************************
+  * @encoding  utf-8
+  * @file      cbtree.h
+  * @author    ZYX
+  * @brief     None
+  ******************************************************************************
+  */
+
+#ifndef CBTREE_H
+#define CBTREE_H
+
+/**
+ * 实现一个存放在共享内存上的B树，树中只保存元素指针，不会管元素的内存分配与释放
+ * 这里同样使用前向声明，对使用者隐藏具体的实现细节
+ */
+typedef struct CBTree CBTree;
+
+/**
+ * 比较函数，返回key与item的大小关系，语义同strcmp
+ * 函数指针在不同进程中的地址不同，不能存入共享内存，所以每次调用时由调用者传入
+ */
+typedef int (*cbtree_compare)(const void* key, const void* item);
+/**
+ * 遍历时使用的访问函数，返回false时停止遍历
+ */
+typedef bool (*cbtree_visitor)(void* item, void* ctx);
+
+/**
+ * 创建一个空的cbtree对象
+ * @return 内存不足时返回nullptr
+ */
+CBTree* cbtree_create();
+/**
+ * 删除一个cbtree对象，只释放树本身的节点，不释放元素
+ * @param cbtree 需要删除的cbtree对象
+ */
+void cbtree_destroy(CBTree* cbtree);
+
+/**
+ * 插入一个元素
+ * @param cbtree cbtree对象
+ * @param item 需要插入的元素
+ * @param key 元素对应的key
+ * @param compare 比较函数
+ * @return 已有相等的元素或内存不足时不插入并返回false，树不变
+ */
+bool cbtree_insert(CBTree* cbtree, void* item, const void* key, cbtree_compare compare);
+/**
+ * 删除与key相等的元素
+ * @return 被删除的元素，没有找到时返回nullptr
+ */
+void* cbtree_remove(CBTree* cbtree, const void* key, cbtree_compare compare);
+void* cbtree_find(CBTree* cbtree, const void* key, cbtree_compare compare);
+
+/**
+ * 从第一个不小于key的元素开始按升序遍历，复杂度O(log n + k)
+ * @param key 起始key，为nullptr时从最小的元素开始
+ * @param visitor 访问函数，返回false时停止遍历
+ */
+void cbtree_foreach_from(CBTree* cbtree, const void* key, cbtree_compare compare, cbtree_visitor visitor,
+                         void* ctx);
+
+size_t cbtree_size(CBTree* cbtree);
+
+/**
+ * 整理内存时修正指针使用的函数，slot指向一个存放在共享内存中的指针，可以改写为移动后的地址
+ */
+typedef void (*cbtree_relocator)(void** slot, void* ctx);
+/**
+ * 访问树内部的所有指针和所有元素，用于整理内存时标记和修正指针
+ * 只读取原来的指针进行遍历，所有指针修正完成后才能真正移动内存
+ * @param node_relocate 访问树内部指向树节点的指针
+ * @param item_relocate 访问每个元素，可以为nullptr
+ */
+void cbtree_relocate(CBTree* cbtree, cbtree_relocator node_relocate, cbtree_relocator item_relocate, void* ctx);
+/**
+ * 只访问树中保存与key相等的元素的指针，复杂度O(log n)
+ */
+void cbtree_relocate_item(CBTree* cbtree, const void* key, cbtree_compare compare, cbtree_relocator item_relocate,
+                          void* ctx);
+/**
+ * 只访问指向树节点node的指针，node是树中某个节点的地址，复杂度O(log n)
+ * @param item_compare 比较两个元素的函数，key参数传入的也是元素
+ */
+void cbtree_relocate_node(CBTree* cbtree, void* node, cbtree_compare item_compare, cbtree_relocator node_relocate,
+                          void* ctx);
+
+#endif //CBTREE_H
@@ -40,10 +40,16 @@ CList* clist_create()
 {
     /* 分配CList内存 */
     auto clist = (CList*)allocator(sizeof(CList));
+    if (clist == nullptr)
+        return nullptr;
     /* 保存内存分配时和释放器 */
     /* 创建根节点为空节点，方便管理 */
     clist->size = 0;
     clist->root = allocator(sizeof(CListNode));
+    if (clist->root == nullptr) {
+        deallocator(clist);
+        return nullptr;
+    }
     /* 初始化根节点 */
     clist->root->prev = clist->root->next = clist->root;
     clist->root->data = nullptr;
@@ -76,9 +82,11 @@ CListIterator* clist_end(CList* clist)
 
 CListIterator* clist_insert(CList* clist, CListIterator* prev, void* data)
 {
-    ++clist->size;
-    /* 创建新节点 */
+    /* 创建新节点，内存不足时链表不变 */
     auto new_node = (CListNode*)allocator(sizeof(CListNode));
+    if (new_node == nullptr)
+        return nullptr;
+    ++clist->size;
     new_node->next = prev->next;
     new_node->prev = prev;
     new_node->data = data;
@@ -143,6 +151,36 @@ void* clist_back(CList* clist)
     return clist->root->prev->data;
 }
 
+void clist_relocate(CList* clist, clist_relocator node_relocate, clist_relocator data_relocate, void* ctx)
+{
+    auto root = clist->root;
+    auto node = root;
+    do {
+        /* 先取出下一个节点，修正后的指针指向的内存还没有移动 */
+        auto next = node->next;
+        node_relocate((void**)&node->next, ctx);
+        node_relocate((void**)&node->prev, ctx);
+        if (node != root && data_relocate != nullptr)
+            data_relocate(&node->data, ctx);
+        node = next;
+    } while (node != root);
+    node_relocate((void**)&clist->root, ctx);
+}
+
+void clist_relocate_iterator(CList* clist, CListIterator* iter, clist_relocator node_relocate, void* ctx)
+{
+    /* 前后节点相同甚至就是iter自己时，这也是两个不同的指针 */
+    node_relocate((void**)&iter->prev->next, ctx);
+    node_relocate((void**)&iter->next->prev, ctx);
+    if (iter == clist->root)
+        node_relocate((void**)&clist->root, ctx);
+}
+
+void clist_relocate_data(CListIterator* iter, clist_relocator data_relocate, void* ctx)
+{
+    data_relocate(&iter->data, ctx);
+}
+
 CListIterator* clist_iterator_next(CListIterator* iter)
 {
     return iter->next;
@@ -39,6 +39,10 @@ typedef void (*clist_mem_deallocator)(void*);
 //  * @return 初始化后的CList对象指针
 //  */
 // CList* clist_create(clist_mem_allocator allocator, clist_mem_deallocator deallocator, clist_mem_deallocator data_deallocator);
+/**
+ * 创建一个空的CList对象
+ * @return 内存不足时返回nullptr
+ */
 CList* clist_create();
 /**
  * 删除一个clist对象，会尝试使用deallocator删除所有节点的data
@@ -46,6 +50,10 @@ CList* clist_create();
  */
 void clist_destroy(CList* clist);
 
+/**
+ * 在prev之后插入data，clist_push_front和clist_push_back同理
+ * @return 新节点的迭代器，内存不足时返回nullptr，链表不变
+ */
 CListIterator* clist_insert(CList* clist, CListIterator* prev, void* data);
 void clist_pop(CList* clist, CListIterator* iter);
 
@@ -62,6 +70,27 @@ size_t clist_size(CList* clist);
 void* clist_front(CList* clist);
 void* clist_back(CList* clist);
 
+/**
+ * 整理内存时修正指针使用的函数，slot指向一个存放在共享内存中的指针，可以改写为移动后的地址
+ */
+typedef void (*clist_relocator)(void** slot, void* ctx);
+/**
+ * 访问链表内部的所有指针和每个节点的data，用于整理内存时标记和修正指针
+ * 只读取原来的指针进行遍历，所有指针修正完成后才能真正移动内存
+ * @param node_relocate 访问链表内部指向链表节点的指针
+ * @param data_relocate 访问每个节点的data，可以为nullptr
+ */
+void clist_relocate(CList* clist, clist_relocator node_relocate, clist_relocator data_relocate, void* ctx);
+/**
+ * 只访问指向iter的指针(前后节点中的指针，iter为根节点时还有链表中的根节点指针)，复杂度O(1)
+ * 用于整理内存时只修正移动了的链表节点
+ */
+void clist_relocate_iterator(CList* clist, CListIterator* iter, clist_relocator node_relocate, void* ctx);
+/**
+ * 访问iter中的data指针
+ */
+void clist_relocate_data(CListIterator* iter, clist_relocator data_relocate, void* ctx);
+
 // CListIterator迭代器操作
 CListIterator* clist_iterator_next(CListIterator* iter);
 CListIterator* clist_iterator_prev(CListIterator* iter);
@@ -1,7 +1,466 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
 #include "myfilesystem.h"
 
+/* 有序列出目录时每次取出的条目数 */
+constexpr size_t LS_PAGE_SIZE = 256;
+
+static void print_error(const char* command, FileSystemError error, const char* arg)
+{
+    printf("%s error, \"%s\" %s!\n", command, arg, filesystem_strerror(error));
+}
+
+static void print_entries(const FileSystemDirEntry* entries, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        printf("%s  type=%s\n", entries[i].name, filesystem_node_type_name(entries[i].type));
+    }
+}
+
+static void command_ls(FileSystemHandle* handle)
+{
+    /* 缓冲区不足时按返回的条目总数重新分配 */
+    size_t capacity = LS_PAGE_SIZE, count = 0;
+    FileSystemDirEntry* entries = nullptr;
+    FileSystemError error;
+    do {
+        free(entries);
+        capacity = count > capacity ? count : capacity;
+        entries = malloc(capacity * sizeof(FileSystemDirEntry));
+        if (entries == nullptr) {
+            print_error("ls", FS_ERROR_NO_MEMORY, ".");
+            return;
+        }
+        error = filesystem_ls(handle, entries, capacity, &count);
+    } while (error == FS_ERROR_BUFFER_TOO_SMALL);
+    if (error != FS_OK) {
+        print_error("ls", error, ".");
+    } else {
+        print_entries(entries, count);
+    }
+    free(entries);
+}
+
+/**
+ * 有序列出: ls [-s] [<prefix>*] [--after <name>] [--limit <n>]
+ */
+static void command_ls_sorted(FileSystemHandle* handle, int argc, char* argv[])
+{
+    char* prefix = nullptr;
+    FileSystemDirEntry after = {"", FS_NODE_DIRECTORY};
+    bool has_after = false;
+    size_t limit = 0;
+    for (int i = 2; i < argc; ++i) {
+        if (strcmp(argv[i], "-s") == 0) {
+            // 只排序，不过滤
+        } else if (strcmp(argv[i], "--after") == 0 && i + 1 < argc) {
+            // 同名的文件和目录都跳过
+            snprintf(after.name, sizeof(after.name), "%s", argv[++i]);
+            has_after = true;
+        } else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc) {
+            limit = strtoul(argv[++i], nullptr, 10);
+        } else if (argv[i][0] != '\0' && argv[i][strlen(argv[i]) - 1] == '*') {
+            prefix = argv[i];
+            prefix[strlen(prefix) - 1] = '\0';
+        } else {
+            printf("ls: 参数 \"%s\" 错误\n", argv[i]);
+            return;
+        }
+    }
+    /* 分页取出，每页从上一页的最后一个条目之后开始 */
+    FileSystemDirEntry entries[LS_PAGE_SIZE];
+    size_t printed = 0;
+    while (limit == 0 || printed < limit) {
+        size_t capacity = LS_PAGE_SIZE;
+        if (limit != 0 && limit - printed < capacity)
+            capacity = limit - printed;
+        size_t count = 0;
+        auto error = filesystem_ls_sorted(handle, prefix, has_after ? &after : nullptr, entries, capacity, &count);
+        if (error != FS_OK) {
+            print_error("ls", error, ".");
+            return;
+        }
+        print_entries(entries, count);
+        printed += count;
+        if (count < capacity)
+            break;
+        after = entries[count - 1];
+        has_after = true;
+    }
+}
+
+static void command_read_file(FileSystemHandle* handle, const char* name)
+{
+    size_t size = LS_PAGE_SIZE, length = 0;
+    char* buffer = nullptr;
+    FileSystemError error;
+    do {
+        free(buffer);
+        size = length + 1 > size ? length + 1 : size;
+        buffer = malloc(size);
+        if (buffer == nullptr) {
+            print_error("read_file", FS_ERROR_NO_MEMORY, name);
+            return;
+        }
+        error = filesystem_read_file(handle, name, buffer, size, &length);
+    } while (error == FS_ERROR_BUFFER_TOO_SMALL);
+    if (error != FS_OK) {
+        print_error("read_file", error, name);
+    } else {
+        printf("%s\n", buffer);
+    }
+    free(buffer);
+}
+
+/**
+ * 等待节点变化并逐次打印，直到节点被删除或超时: watch <name> [timeout_ms]
+ * 同名的目录优先于文件
+ */
+static void command_watch(FileSystemHandle* handle, const char* name, int timeout_ms)
+{
+    uint32_t seq = 0;
+    auto type = FS_NODE_DIRECTORY;
+    auto error = filesystem_watch(handle, name, type, &seq, 0);
+    if (error == FS_ERROR_NOT_EXIST) {
+        type = FS_NODE_FILE;
+        error = filesystem_watch(handle, name, type, &seq, 0);
+    }
+    if (error != FS_OK && error != FS_ERROR_TIMEOUT) {
+        print_error("watch", error, name);
+        return;
+    }
+    while ((error = filesystem_watch(handle, name, type, &seq, timeout_ms)) == FS_OK) {
+        printf("%s changed, seq=%u\n", name, seq);
+        fflush(stdout);
+    }
+    if (error == FS_ERROR_NOT_EXIST) {
+        printf("%s removed\n", name);
+    } else {
+        print_error("watch", error, name);
+    }
+}
+
+static void command_du(FileSystemHandle* handle, const char* name)
+{
+    FileSystemUsage usage, quota;
+    auto error = filesystem_du(handle, name, &usage, &quota);
+    if (error != FS_OK) {
+        print_error("du", error, name);
+        return;
+    }
+    printf("%s  bytes=%zu entries=%zu", name, usage.bytes, usage.entries);
+    if (quota.bytes != 0)
+        printf(" quota_bytes=%zu", quota.bytes);
+    if (quota.entries != 0)
+        printf(" quota_entries=%zu", quota.entries);
+    printf("\n");
+}
+
+/**
+ * 搜索文件内容: grep <pattern> [<dir>]
+ */
+static void command_grep(FileSystemHandle* handle, const char* pattern, const char* name)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    /* 缓冲区不足时按返回的匹配总数重新分配 */
+    size_t capacity = LS_PAGE_SIZE, count = 0;
+    FileSystemGrepMatch* matches = nullptr;
+    FileSystemGrepStats stats;
+    FileSystemError error;
+    do {
+        free(matches);
+        capacity = count > capacity ? count : capacity;
+        matches = malloc(capacity * sizeof(FileSystemGrepMatch));
+        if (matches == nullptr) {
+            print_error("grep", FS_ERROR_NO_MEMORY, pattern);
+            return;
+        }
+        error = filesystem_grep(handle, name, pattern, matches, capacity, &count, &stats);
+    } while (error == FS_ERROR_BUFFER_TOO_SMALL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (error != FS_OK) {
+        print_error("grep", error, pattern);
+    } else {
+        for (size_t i = 0; i < count; ++i) {
+            printf("%s:%zu\n", matches[i].path, matches[i].offset);
+        }
+        auto elapsed_ms = (double)(end.tv_sec - start.tv_sec) * 1000 + (double)(end.tv_nsec - start.tv_nsec) / 1e6;
+        printf("grep: %zu matches, scanned %zu of %zu files (%zu bytes) in %.3f ms\n", count, stats.scanned,
+               stats.files, stats.bytes, elapsed_ms);
+    }
+    free(matches);
+}
+
+/**
+ * 打印导入导出的统计和速率
+ */
+static void print_transfer_stats(const char* command, const FileSystemTransferStats* stats,
+                                 const struct timespec* start, const struct timespec* end)
+{
+    auto elapsed = (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+    if (elapsed <= 0)
+        elapsed = 1e-9;
+    printf("%s: %zu files, %zu directories, %zu bytes, %zu skipped in %.3f ms (%.0f files/s, %.2f MB/s)\n",
+           command, stats->files, stats->directories, stats->bytes, stats->skipped, elapsed * 1000,
+           (double)stats->files / elapsed, (double)stats->bytes / elapsed / (1024 * 1024));
+}
+
+/**
+ * 导入宿主机目录: import <host_dir> [<name>]，name默认为宿主机目录的最后一级名称
+ */
+static void command_import(FileSystemHandle* handle, const char* host_path, const char* name)
+{
+    char base[FILESYSTEM_NODE_NAME_SIZE];
+    if (name == nullptr) {
+        /* 去掉结尾的'/'后取最后一级名称 */
+        auto end = host_path + strlen(host_path);
+        while (end > host_path + 1 && end[-1] == '/') {
+            --end;
+        }
+        auto begin = end;
+        while (begin > host_path && begin[-1] != '/') {
+            --begin;
+        }
+        snprintf(base, sizeof(base), "%.*s", (int)(end - begin), begin);
+        name = base;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    FileSystemTransferStats stats;
+    auto error = filesystem_import(handle, host_path, name, &stats);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (error == FS_ERROR_SYSTEM) {
+        perror(host_path);
+    } else if (error != FS_OK) {
+        print_error("import", error, name);
+    } else {
+        print_transfer_stats("import", &stats, &start, &end);
+    }
+}
+
+/**
+ * 导出到宿主机目录: export <host_dir> [<name>]，name默认为当前目录
+ */
+static void command_export(FileSystemHandle* handle, const char* host_path, const char* name)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    FileSystemTransferStats stats;
+    auto error = filesystem_export(handle, name, host_path, &stats);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (error == FS_ERROR_SYSTEM) {
+        perror(host_path);
+    } else if (error != FS_OK) {
+        print_error("export", error, name);
+    } else {
+        print_transfer_stats("export", &stats, &start, &end);
+    }
+}
+
+static void command_tier_stats(FileSystemHandle* handle)
+{
+    FileSystemTierStats stats;
+    auto error = filesystem_tier_stats(handle, &stats);
+    if (error != FS_OK) {
+        print_error("tier_stats", error, ".");
+        return;
+    }
+    auto reads = stats.hits + stats.misses;
+    printf("tier: hits=%zu misses=%zu hit_rate=%.2f%% spills=%zu spilled_bytes=%zu backing_bytes=%zu "
+           "allocated=%zu\n", stats.hits, stats.misses, reads == 0 ? 0.0 : 100.0 * (double)stats.hits / (double)reads,
+           stats.spills, stats.spilled_bytes, stats.backing_bytes, stats.allocated);
+}
+
+static void command_defrag(FileSystemHandle* handle)
+{
+    auto before = filesystem_memory_usage(handle);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t reclaimed = 0;
+    auto error = filesystem_defrag(handle, &reclaimed);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (error != FS_OK) {
+        print_error("defrag", error, ".");
+        return;
+    }
+    auto elapsed_ms = (double)(end.tv_sec - start.tv_sec) * 1000 + (double)(end.tv_nsec - start.tv_nsec) / 1e6;
+    printf("defrag: %zu -> %zu bytes, reclaimed %zu bytes in %.3f ms\n", before, filesystem_memory_usage(handle),
+           reclaimed, elapsed_ms);
+}
+
+static volatile bool applier_stop = false;
+
+static void applier_signal_handler(int signal)
+{
+    (void)signal;
+    applier_stop = true;
+}
+
+/**
+ * 作为应用者运行，批量执行所有客户端提交的操作，直到收到SIGINT或SIGTERM
+ */
+static void command_applier(FileSystemHandle* handle)
+{
+    signal(SIGINT, applier_signal_handler);
+    signal(SIGTERM, applier_signal_handler);
+    auto error = filesystem_ring_serve(handle, &applier_stop);
+    if (error != FS_OK)
+        print_error("applier", error, "serve");
+}
+
+static const char* ring_op_names[] = {
+    [FS_RING_OP_NOP] = "nop",
+    [FS_RING_OP_CD] = "cd",
+    [FS_RING_OP_MKDIR] = "mkdir",
+    [FS_RING_OP_RMDIR] = "rmdir",
+    [FS_RING_OP_CREATE_FILE] = "create_file",
+    [FS_RING_OP_ALTER_FILE] = "alter_file",
+    [FS_RING_OP_REMOVE_FILE] = "remove_file",
+};
+
+/**
+ * 解析一行"命令 名称 [内容]"，会修改line
+ * @return 空行返回false，命令错误时op为FS_RING_OP_NOP
+ */
+static bool parse_op_line(char* line, FileSystemRingOp* op, char** name, char** data)
+{
+    line[strcspn(line, "\n")] = '\0';
+    char* save = nullptr;
+    auto command = strtok_r(line, " ", &save);
+    *name = strtok_r(nullptr, " ", &save);
+    *data = strtok_r(nullptr, "", &save);
+    if (command == nullptr || *name == nullptr)
+        return false;
+    *op = FS_RING_OP_NOP;
+    for (size_t i = 0; i < sizeof(ring_op_names) / sizeof(ring_op_names[0]); ++i) {
+        if (strcmp(command, ring_op_names[i]) == 0)
+            *op = (FileSystemRingOp)i;
+    }
+    return true;
+}
+
+/**
+ * 等待并取出一个完成事件，操作失败时打印对应的行号
+ * @return 取出失败时返回false
+ */
+static bool reap_completion(FileSystemRing* ring)
+{
+    FileSystemRingCompletion completion;
+    auto error = filesystem_ring_reap(ring, &completion, true);
+    if (error != FS_OK) {
+        print_error("ring", error, "reap");
+        return false;
+    }
+    if (completion.error != FS_OK)
+        printf("ring: 第%zu行 %s error, %s!\n", completion.user_data, ring_op_names[completion.op],
+               filesystem_strerror(completion.error));
+    return true;
+}
+
+/**
+ * 从标准输入逐行读取"命令 名称 [内容]"，通过队列流水线提交，需要有应用者在运行
+ */
+static void command_ring(FileSystemHandle* handle)
+{
+    FileSystemRing* ring = nullptr;
+    auto error = filesystem_ring_register(handle, &ring);
+    if (error != FS_OK) {
+        print_error("ring", error, "register");
+        return;
+    }
+    /* 用行号作为user_data，出错时可以定位到具体的行 */
+    char line[FILESYSTEM_PWD_SIZE + FILESYSTEM_RING_DATA_SIZE];
+    size_t line_number = 0, in_flight = 0;
+    while (fgets(line, sizeof(line), stdin) != nullptr) {
+        ++line_number;
+        FileSystemRingOp op = FS_RING_OP_NOP;
+        char *name, *data;
+        if (!parse_op_line(line, &op, &name, &data))
+            continue;
+        if (op == FS_RING_OP_NOP) {
+            printf("ring: 第%zu行命令 \"%s\" 错误\n", line_number, line);
+            continue;
+        }
+        /* 提交队列满时先取走一个完成事件 */
+        while ((error = filesystem_ring_submit(ring, op, name, data, line_number)) == FS_ERROR_BUSY) {
+            if (!reap_completion(ring))
+                return;
+            --in_flight;
+        }
+        if (error != FS_OK) {
+            printf("ring: 第%zu行 %s error, %s!\n", line_number, line, filesystem_strerror(error));
+            continue;
+        }
+        ++in_flight;
+    }
+    for (; in_flight > 0; --in_flight) {
+        if (!reap_completion(ring))
+            return;
+    }
+    filesystem_ring_unregister(ring);
+}
+
+/**
+ * 从标准输入逐行读取"命令 名称 [内容]"，全部读完后作为一个事务提交，任何一行出错时都不会生效
+ */
+static void command_txn(FileSystemHandle* handle)
+{
+    FileSystemTxn* txn = nullptr;
+    auto error = filesystem_txn_begin(handle, &txn);
+    if (error != FS_OK) {
+        print_error("txn", error, "begin");
+        return;
+    }
+    char line[FILESYSTEM_PWD_SIZE + FILESYSTEM_RING_DATA_SIZE];
+    size_t line_number = 0;
+    /* 记录每个操作所在的行号，提交失败时可以定位 */
+    size_t* op_lines = nullptr;
+    size_t op_count = 0;
+    while (fgets(line, sizeof(line), stdin) != nullptr) {
+        ++line_number;
+        FileSystemRingOp op = FS_RING_OP_NOP;
+        char *name, *data;
+        if (!parse_op_line(line, &op, &name, &data))
+            continue;
+        if (op == FS_RING_OP_NOP) {
+            printf("txn: 第%zu行命令 \"%s\" 错误，事务已放弃\n", line_number, line);
+            filesystem_txn_abort(txn);
+            free(op_lines);
+            return;
+        }
+        if ((error = filesystem_txn_add(txn, op, name, data)) != FS_OK) {
+            printf("txn: 第%zu行 %s error, %s! 事务已放弃\n", line_number, line, filesystem_strerror(error));
+            filesystem_txn_abort(txn);
+            free(op_lines);
+            return;
+        }
+        auto new_op_lines = (size_t*)realloc(op_lines, (op_count + 1) * sizeof(size_t));
+        if (new_op_lines == nullptr) {
+            printf("txn: 第%zu行 error, %s! 事务已放弃\n", line_number, filesystem_strerror(FS_ERROR_NO_MEMORY));
+            filesystem_txn_abort(txn);
+            free(op_lines);
+            return;
+        }
+        op_lines = new_op_lines;
+        op_lines[op_count++] = line_number;
+    }
+    size_t failed_index = 0;
+    if ((error = filesystem_txn_commit(txn, &failed_index)) != FS_OK) {
+        /* 不是某一个操作失败时(例如空事务分配失败)没有对应的行号 */
+        if (failed_index < op_count) {
+            printf("txn: 第%zu行 error, %s! 事务已回滚\n", op_lines[failed_index], filesystem_strerror(error));
+        } else {
+            printf("txn: error, %s! 事务已回滚\n", filesystem_strerror(error));
+        }
+    } else {
+        printf("txn: %zu ops committed\n", op_count);
+    }
+    free(op_lines);
+}
 
 int main(int argc, char* argv[])
 {
@@ -10,67 +469,157 @@ int main(int argc, char* argv[])
         return 0;
     }
 
-    // 初始化文件系统，或者获取其共享内寸
-    filesystem_init(argv[0]);
+    // 初始化文件系统，或者获取其共享内寸, 命令行的每个命令是一个进程，当前目录需要保存在共享内存中
+    // init <分片数> 只在文件系统不存在时生效，其余命令使用已有的文件系统或创建单分片的文件系统
+    FileSystemHandle* handle = nullptr;
+    size_t shard_count = 1;
+    if (strcmp(argv[1], "init") == 0 && argc >= 3)
+        shard_count = strtoul(argv[2], nullptr, 10);
+    auto error = filesystem_open_sharded(argv[0], FILESYSTEM_OPEN_SHARED_CWD, shard_count, &handle);
+    if (error == FS_ERROR_INVALID_ARGUMENT) {
+        printf("init: 分片数需要在1到%zu之间\n", FILESYSTEM_SHARD_MAX);
+        return 1;
+    }
+    if (error != FS_OK) {
+        perror("filesystem_open failed");
+        return 1;
+    }
 
     // 解析命令行参数，每次只执行一个命令
-    if (strcmp(argv[1], "cd") == 0) {
+    if (strcmp(argv[1], "init") == 0) {
+        printf("shards=%zu\n", filesystem_shard_count(handle));
+    } else if (strcmp(argv[1], "cd") == 0) {
         if (argc < 3) {
             printf("cd: 请输入需要去的路径\n");
-            return 0;
+        } else if ((error = filesystem_cd(handle, argv[2])) != FS_OK) {
+            print_error("cd", error, argv[2]);
         }
-        cd(argv[2]);
     } else if (strcmp(argv[1], "pwd") == 0) {
-        pwd();
+        char pwd[FILESYSTEM_PWD_SIZE];
+        if ((error = filesystem_pwd(handle, pwd, sizeof(pwd))) != FS_OK) {
+            print_error("pwd", error, ".");
+        } else {
+            printf("%s\n", pwd);
+        }
     } else if (strcmp(argv[1], "mkdir") == 0) {
         if (argc < 3) {
             printf("mkdir: 请输入需要创建的目录名\n");
-            return 0;
+        } else if ((error = filesystem_mkdir(handle, argv[2])) != FS_OK) {
+            print_error("mkdir", error, argv[2]);
         }
-        mkdir(argv[2]);
     } else if (strcmp(argv[1], "rmdir") == 0) {
         if (argc < 3) {
-            printf("mkdir: 请输入需要删除的目录名\n");
-            return 0;
+            printf("rmdir: 请输入需要删除的目录名\n");
+        } else if ((error = filesystem_rmdir(handle, argv[2])) != FS_OK) {
+            print_error("rmdir", error, argv[2]);
         }
-        rmdir(argv[2]);
     } else if (strcmp(argv[1], "ls") == 0) {
-        ls();
+        if (argc < 3) {
+            command_ls(handle);
+        } else {
+            command_ls_sorted(handle, argc, argv);
+        }
+    } else if (strcmp(argv[1], "index") == 0) {
+        if (argc < 3) {
+            printf("index: 请输入需要建立索引的目录名\n");
+        } else if ((error = filesystem_index_dir(handle, argv[2])) != FS_OK) {
+            print_error("index", error, argv[2]);
+        }
     } else if (strcmp(argv[1], "create_file") == 0) {
         if (argc < 3) {
             printf("create_file: 请输入需要创建的文件名\n");
-        } else if (argc < 4) {
-            create_file(argv[2], nullptr);
-        } else {
-            create_file(argv[2], argv[3]);
+        } else if ((error = filesystem_create_file(handle, argv[2], argc < 4 ? nullptr : argv[3])) != FS_OK) {
+            print_error("create_file", error, argv[2]);
         }
     } else if (strcmp(argv[1], "alter_file") == 0) {
         if (argc < 3) {
             printf("alert_file: 请输入需要修改的文件名\n");
         } else if (argc < 4) {
             printf("alert_file: 请输入需要修改的文件内容\n");
-        } else {
-            alter_file(argv[2], argv[3]);
+        } else if ((error = filesystem_alter_file(handle, argv[2], argv[3])) != FS_OK) {
+            print_error("alter_file", error, argv[2]);
         }
     } else if (strcmp(argv[1], "read_file") == 0) {
         if (argc < 3) {
             printf("read_file: 请输入需要读取的文件名\n");
         } else {
-            read_file(argv[2]);
+            command_read_file(handle, argv[2]);
         }
     } else if (strcmp(argv[1], "remove_file") == 0) {
         if (argc < 3) {
             printf("remove_file: 请输入需要删除的文件名\n");
+        } else if ((error = filesystem_remove_file(handle, argv[2])) != FS_OK) {
+            print_error("remove_file", error, argv[2]);
+        }
+    } else if (strcmp(argv[1], "watch") == 0) {
+        if (argc < 3) {
+            printf("watch: 请输入需要监视的文件名或目录名\n");
         } else {
-            remove_file(argv[2]);
+            command_watch(handle, argv[2], argc < 4 ? -1 : atoi(argv[3]));
         }
+    } else if (strcmp(argv[1], "du") == 0) {
+        command_du(handle, argc < 3 ? "." : argv[2]);
+    } else if (strcmp(argv[1], "quota") == 0) {
+        if (argc < 4) {
+            printf("quota: 请输入目录名和字节数配额，可选文件和目录数配额，0表示不限制\n");
+        } else {
+            FileSystemUsage quota = {strtoul(argv[3], nullptr, 10), argc < 5 ? 0 : strtoul(argv[4], nullptr, 10)};
+            if ((error = filesystem_set_quota(handle, argv[2], &quota)) != FS_OK)
+                print_error("quota", error, argv[2]);
+        }
+    } else if (strcmp(argv[1], "grep") == 0) {
+        if (argc < 3) {
+            printf("grep: 请输入需要搜索的内容\n");
+        } else {
+            command_grep(handle, argv[2], argc < 4 ? "." : argv[3]);
+        }
+    } else if (strcmp(argv[1], "trigram") == 0) {
+        if (argc < 3) {
+            printf("trigram: 请输入需要启用三元组索引的目录名\n");
+        } else if ((error = filesystem_trigram_index(handle, argv[2])) != FS_OK) {
+            print_error("trigram", error, argv[2]);
+        }
+    } else if (strcmp(argv[1], "import") == 0) {
+        if (argc < 3) {
+            printf("import: 请输入需要导入的宿主机目录\n");
+        } else {
+            command_import(handle, argv[2], argc < 4 ? nullptr : argv[3]);
+        }
+    } else if (strcmp(argv[1], "export") == 0) {
+        if (argc < 3) {
+            printf("export: 请输入导出到的宿主机目录\n");
+        } else {
+            command_export(handle, argv[2], argc < 4 ? "." : argv[3]);
+        }
+    } else if (strcmp(argv[1], "tier") == 0) {
+        if (argc < 4) {
+            printf("tier: 请输入后备文件路径和每个分片的高水位字节数，可选低水位字节数，默认为高水位的3/4\n");
+        } else {
+            auto high_water = strtoul(argv[3], nullptr, 10);
+            auto low_water = argc < 5 ? high_water / 4 * 3 : strtoul(argv[4], nullptr, 10);
+            if ((error = filesystem_tier_enable(handle, argv[2], high_water, low_water)) != FS_OK)
+                print_error("tier", error, argv[2]);
+        }
+    } else if (strcmp(argv[1], "tier_stats") == 0) {
+        command_tier_stats(handle);
+    } else if (strcmp(argv[1], "defrag") == 0) {
+        command_defrag(handle);
+    } else if (strcmp(argv[1], "applier") == 0) {
+        command_applier(handle);
+    } else if (strcmp(argv[1], "ring") == 0) {
+        command_ring(handle);
+    } else if (strcmp(argv[1], "txn") == 0) {
+        command_txn(handle);
     } else if (strcmp(argv[1], "deinit") == 0) {
-        filesystem_deinit();
+        filesystem_destroy(handle, false);
+        return 0;
     } else if (strcmp(argv[1], "force_deinit") == 0) {
-        filesystem_force_deinit();
+        filesystem_destroy(handle, true);
+        return 0;
     } else {
         printf("参数 \"%s\" 错误\n", argv[1]);
     }
 
+    filesystem_close(handle);
     return 0;
 }
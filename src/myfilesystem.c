@@ -7,7 +7,7 @@
   ******************************************************************************
   */
 
-#include "myfilesystem.h"
+#include "myfilesystem_internal.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,86 +16,131 @@
 #include "clist.h"
 #include <sys/ipc.h>
 #include <sys/shm.h>
-#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
-constexpr bool DEBUG = false;
-
-constexpr size_t FILESYSTEM_NODE_NAME_SIZE = 100;
-constexpr size_t FILESYSTEM_PWD_SIZE = FILESYSTEM_NODE_NAME_SIZE * 10;
+constexpr int DEBUG_FORMAT_SIZE = 1024;
 
-typedef struct FileSystemNode FileSystemNode;
+const int SHM_SIZE = 100 * 1024 * 1024;
+const size_t MAGIC_NUMBER_INITED = 0xDEADBEEF, MAGIC_NUMBER_DEINITED = ~MAGIC_NUMBER_INITED;
+const void* SHM_ADDR = (void*)0x0000700000000000;
 
-typedef enum FileSystemNodeType
-{
-    Unknown = -1,
-    File = 0,
-    Directory,
-} FileSystemNodeType;
+thread_local FileSystem* f = nullptr;
+thread_local FileSystemShard* arena = nullptr;
+thread_local void* arena_owner = nullptr;
 
-const char* FileSystemNodeTypeNames[] = {
-    "file",
-    "directory",
-};
+/**
+ * 共享内存只能在固定地址附加一次，同一进程中的所有句柄共用一次附加，由attach_lock保护
+ */
+static pthread_mutex_t attach_lock = PTHREAD_MUTEX_INITIALIZER;
+static FileSystem* attached_fs = nullptr;
+static int attached_shmids[FILESYSTEM_SHARD_MAX];
+static size_t attached_shard_count = 0; /* 已附加的分片数，分片总是按下标顺序附加 */
+static size_t attach_count = 0;
+/* 每次分离共享内存后加一，用于识别已经失效的线程缓存 */
+static _Atomic size_t attach_generation = 0;
 
 /**
- * 存储内存的元数据，包含内存的实际大小信息和内存实际可用的地址
+ * 线程私有的小内存缓存，分配和释放小内存时不需要访问共享的空闲链表
  */
-typedef struct FileSystemMemoryMetadata
+typedef struct FileSystemThreadCache
 {
-    size_t size;
-    void* address;
-} FileSystemMemoryMetadata;
+    FileSystemShard* owner; /* 缓存的内存块所属的分片，为nullptr时缓存为空 */
+    size_t generation; /* 绑定时的attach_generation */
+    size_t epoch; /* 绑定时分片的epoch */
+    size_t counts[FILESYSTEM_SIZE_CLASS_COUNT];
+    void* blocks[FILESYSTEM_SIZE_CLASS_COUNT][FILESYSTEM_TCACHE_COUNT];
+} FileSystemThreadCache;
 
-struct FileSystemNode
-{
-    FileSystemNode* parent; /* 父节点指针 */
-    FileSystemNodeType type; /* 节点类型 */
-    char name[FILESYSTEM_NODE_NAME_SIZE]; /* 文件或路径名 */
-    void* data; /* 对于目录，这个是一个CList, 存储子节点; 对于文件，这里存储文件数据 */
-};
+/* 每个分片一个线程缓存，在分片间切换时不需要归还 */
+static thread_local FileSystemThreadCache tcache[FILESYSTEM_SHARD_MAX];
+/* 线程退出时通过该key的析构函数归还线程缓存 */
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
 
-struct FileSystem
+int debug_printf(const char* format, ...)
 {
-    size_t magic_number; /* 辅助判断该共享内存是不是第一次创建, 只有创建时可以修改，其余时候只读 */
-    pthread_rwlock_t rwlock; /* 读写锁，并行时同步使用，运行同时读，不允许同时写 */
-    size_t shm_offset; /* 记录当前使用的共享内存偏移量 */
-    CList* unused_nodes; /* 分配后被释放的内存 */
-    FileSystemNode* root; /* 根目录 */
-    FileSystemNode* cur_dir; /* 当前目录 */
-    size_t pwd_offset;
-    char pwd[FILESYSTEM_PWD_SIZE]; /* 当前目录路径 */
-};
-
-const int SHM_SIZE = 100 * 1024 * 1024;
-constexpr int DEBUG_FORMAT_SIZE = 1024;
-const size_t MAGIC_NUMBER_INITED = 0xDEADBEEF, MAGIC_NUMBER_DEINITED = ~MAGIC_NUMBER_INITED;
-const void* SHM_ADDR = (void*)0x0000700000000000;
-int shmid = 0;
+    if (!DEBUG)
+        return 0;
+    char debug_format[DEBUG_FORMAT_SIZE];
+    va_list args;
+    va_start(args);
+    // 生成新的格式化字符串, 改变字体颜色
+    snprintf(debug_format, sizeof(debug_format), "\033[34m%s\033[0m", format);
+    int result = vprintf(debug_format, args);
+    va_end(args);
+    return result;
+}
 
-/* 共享内存的首地址存储该结构 */
-FileSystem* f = nullptr;
+const char* filesystem_strerror(FileSystemError error)
+{
+    switch (error) {
+    case FS_OK:
+        return "success";
+    case FS_ERROR_NOT_EXIST:
+        return "not exist";
+    case FS_ERROR_EXIST:
+        return "already exist";
+    case FS_ERROR_INVALID_ARGUMENT:
+        return "invalid argument";
+    case FS_ERROR_NO_MEMORY:
+        return "shared memory exhausted";
+    case FS_ERROR_BUFFER_TOO_SMALL:
+        return "buffer too small";
+    case FS_ERROR_SYSTEM:
+        return "system call failed";
+    case FS_ERROR_BUSY:
+        return "busy, try again";
+    case FS_ERROR_TIMEOUT:
+        return "timed out";
+    case FS_ERROR_QUOTA:
+        return "quota exceeded";
+    }
+    return "unknown error";
+}
 
-int debug_printf(const char* format, ...)
+const char* filesystem_node_type_name(FileSystemNodeType type)
 {
-    if (DEBUG) {
-        static char debug_format[DEBUG_FORMAT_SIZE];
-        va_list args;
-        va_start(args);
-        // 生成新的格式化字符串, 改变字体颜色
-        sprintf(debug_format, "\033[34m%s\033[0m", format);
-        return vprintf(debug_format, args);
+    switch (type) {
+    case FS_NODE_FILE:
+        return "file";
+    case FS_NODE_DIRECTORY:
+        return "directory";
+    default:
+        return "unknown";
     }
 }
 
+int filesystem_node_key_compare(const void* key, const void* item)
+{
+    auto node_key = (const FileSystemNodeKey*)key;
+    auto node = (const FileSystemNode*)item;
+    int result = strcmp(node_key->name, node->name);
+    if (result != 0)
+        return result;
+    return (int)node_key->type - (int)node->type;
+}
+
 FileSystemNode* filesystem_node_get_subnode(FileSystemNode* node, FileSystemNodeType subnode_type,
                                             const char* subnode_name)
 {
+    /* 当前目录已被删除 */
+    if (node == nullptr)
+        return nullptr;
+    /* 启用索引的目录直接在B树中查找 */
+    if (node->index != nullptr) {
+        FileSystemNodeKey key = {subnode_name, subnode_type};
+        return (FileSystemNode*)cbtree_find(node->index, &key, filesystem_node_key_compare);
+    }
     auto subnode_list = (CList*)node->data;
     for (auto it = clist_begin(subnode_list); it != clist_end(subnode_list); it = clist_iterator_next(it)) {
         auto subnode = (FileSystemNode*)clist_iterator_get(it);
-        if (subnode == nullptr)
-            continue;
         if (subnode->type == subnode_type && strcmp(subnode->name, subnode_name) == 0) {
             return subnode;
         }
@@ -103,98 +148,489 @@ FileSystemNode* filesystem_node_get_subnode(FileSystemNode* node, FileSystemNode
     return nullptr;
 }
 
+static size_t _align_size(size_t size)
+{
+    return (size + FILESYSTEM_MEMORY_ALIGN - 1) & ~(FILESYSTEM_MEMORY_ALIGN - 1);
+}
+
 /**
- * 获取当前空内存指针，禁止外部调用
- * @return 当前空内存指针
+ * 获取能容纳size字节的最小内存级别
+ * @return 内存级别，大内存返回FILESYSTEM_SIZE_CLASS_COUNT
  */
-static void* _get_offset_address()
+static size_t _size_class(size_t size)
 {
-    return (char*)f + f->shm_offset;
+    size_t size_class = 0;
+    for (size_t class_size = FILESYSTEM_MEMORY_ALIGN; class_size < size; class_size <<= 1) {
+        ++size_class;
+    }
+    return size_class;
+}
+
+static size_t _size_class_size(size_t size_class)
+{
+    return FILESYSTEM_MEMORY_ALIGN << size_class;
 }
 
 /**
- * 获取最近一块未被分配的内存，并将空内存指针偏移size个字节，不会复用已释放内存，禁止外部调用
- * @param size 需要便宜的内存大小
- * @return 获取的内存地址
+ * 从分片末尾预留size个字节，不会复用已释放内存，禁止外部调用
+ * 使用CAS推进偏移量，不需要持有任何锁
+ * @param size 需要预留的内存大小
+ * @return 预留的内存地址，分片空间不足时返回nullptr
  */
-static void* _get_and_offset_address(size_t size)
+static void* _reserve_memory(FileSystemShard* shard, size_t size)
 {
-    void* address = _get_offset_address();
-    f->shm_offset += size;
-    return address;
+    auto offset = atomic_load(&shard->shm_offset);
+    do {
+        if (offset + size > (size_t)SHM_SIZE)
+            return nullptr;
+    } while (!atomic_compare_exchange_weak(&shard->shm_offset, &offset, offset + size));
+    return (char*)shard + offset;
 }
 
-void* alloc_memory(size_t size)
+/**
+ * 在address处写入元数据，生成一个大小为size(不含元数据)的内存块
+ * @return 内存块实际可用的地址
+ */
+static void* _make_block(void* address, size_t size)
+{
+    auto metadata = (FileSystemMemoryMetadata*)address;
+    metadata->size = size + sizeof(FileSystemMemoryMetadata);
+    metadata->owner = nullptr;
+    return (char*)address + sizeof(FileSystemMemoryMetadata);
+}
+
+/**
+ * 丢弃线程缓存，用于共享内存被销毁后
+ */
+static void _tcache_reset()
+{
+    for (size_t i = 0; i < FILESYSTEM_SHARD_MAX; ++i) {
+        tcache[i].owner = nullptr;
+        memset(tcache[i].counts, 0, sizeof(tcache[i].counts));
+    }
+}
+
+/**
+ * 检查线程缓存中的内存块是否仍然有效，共享内存被分离或者分片被整理后缓存中的指针都不能再访问
+ */
+static bool _tcache_valid(FileSystemThreadCache* cache)
+{
+    /* 先检查附加代数，共享内存已分离时不能再访问分片 */
+    return cache->owner != nullptr && cache->generation == atomic_load(&attach_generation) &&
+        cache->epoch == atomic_load(&cache->owner->epoch);
+}
+
+/**
+ * 将线程缓存中第size_class级的count个内存块批量归还到共享空闲链表
+ */
+static void _tcache_release(FileSystemThreadCache* cache, size_t size_class, size_t count)
+{
+    auto blocks = cache->blocks[size_class];
+    auto cached = cache->counts[size_class];
+    if (count > cached)
+        count = cached;
+    if (count == 0)
+        return;
+    /* 先在锁外串成链表，持锁时只需要接到表头 */
+    for (size_t i = cached - count; i + 1 < cached; ++i) {
+        ((FileSystemFreeBlock*)blocks[i])->next = (FileSystemFreeBlock*)blocks[i + 1];
+    }
+    auto first = (FileSystemFreeBlock*)blocks[cached - count];
+    auto last = (FileSystemFreeBlock*)blocks[cached - 1];
+    auto owner = cache->owner;
+    pthread_mutex_lock(&owner->free_list_lock);
+    last->next = owner->free_lists[size_class];
+    owner->free_lists[size_class] = first;
+    pthread_mutex_unlock(&owner->free_list_lock);
+    cache->counts[size_class] = cached - count;
+}
+
+/**
+ * 将线程缓存全部归还到共享空闲链表，线程或进程退出时调用，否则缓存的内存会丢失
+ */
+static void _tcache_flush()
 {
-    size_t size_with_metadata = size + sizeof(FileSystemMemoryMetadata);
-    /* 检查是否有空闲内存的大小正好可以容纳新分配的内存, 特别的，文件系统未完全初始化时没有unused_nodes */
-    if (f->unused_nodes != nullptr) {
-        for (auto it = clist_begin(f->unused_nodes); it != clist_end(f->unused_nodes); it = clist_iterator_next(it)) {
-            auto unused_mem_metadata = (FileSystemMemoryMetadata*)clist_iterator_get(it);
-            /* 检查这块内存是否满足要求 */
-            if (unused_mem_metadata->size >= size_with_metadata) {
-                /* 移出未使用列表, 注意，这一步会导致迭代器不可用，不能继续迭代 */
-                clist_pop(f->unused_nodes, it);
-                return unused_mem_metadata->address;
+    for (size_t i = 0; i < FILESYSTEM_SHARD_MAX; ++i) {
+        auto cache = &tcache[i];
+        if (_tcache_valid(cache)) {
+            for (size_t size_class = 0; size_class < FILESYSTEM_SIZE_CLASS_COUNT; ++size_class) {
+                _tcache_release(cache, size_class, cache->counts[size_class]);
             }
         }
+        cache->owner = nullptr;
+        memset(cache->counts, 0, sizeof(cache->counts));
     }
+}
+
+static void _tcache_thread_exit(void* arg)
+{
+    (void)arg;
+    _tcache_flush();
+}
+
+/**
+ * 获取分片对应的线程缓存，缓存已失效时先丢弃
+ */
+static FileSystemThreadCache* _tcache_bind(FileSystemShard* shard)
+{
+    auto cache = &tcache[filesystem_shard_index(shard)];
+    if (cache->owner == shard && _tcache_valid(cache))
+        return cache;
+    cache->owner = shard;
+    cache->generation = atomic_load(&attach_generation);
+    cache->epoch = atomic_load(&shard->epoch);
+    memset(cache->counts, 0, sizeof(cache->counts));
+    /* 设置非空值后线程退出时才会调用析构函数归还缓存 */
+    pthread_setspecific(tcache_key, tcache);
+    return cache;
+}
+
+/**
+ * 为第size_class级补充线程缓存，优先从共享空闲链表取，不够时一次预留一批新的内存块
+ * @return 是否补充成功
+ */
+static bool _tcache_refill(FileSystemThreadCache* cache, size_t size_class)
+{
+    auto shard = cache->owner;
+    auto blocks = cache->blocks[size_class];
+    size_t count = 0;
+    pthread_mutex_lock(&shard->free_list_lock);
+    while (count < FILESYSTEM_TCACHE_BATCH && shard->free_lists[size_class] != nullptr) {
+        blocks[count++] = shard->free_lists[size_class];
+        shard->free_lists[size_class] = shard->free_lists[size_class]->next;
+    }
+    pthread_mutex_unlock(&shard->free_list_lock);
+
+    if (count == 0) {
+        /* 一次CAS预留整批内存块，空间不足时退化为只预留一块 */
+        auto block_size = _size_class_size(size_class) + sizeof(FileSystemMemoryMetadata);
+        auto batch = FILESYSTEM_TCACHE_BATCH;
+        auto address = (char*)_reserve_memory(shard, block_size * batch);
+        if (address == nullptr) {
+            batch = 1;
+            address = (char*)_reserve_memory(shard, block_size);
+        }
+        if (address == nullptr)
+            return false;
+        /* 倒序放入，保证先分配低地址的内存块 */
+        for (size_t i = batch; i > 0; --i) {
+            blocks[count++] = _make_block(address + (i - 1) * block_size, _size_class_size(size_class));
+        }
+    }
+    cache->counts[size_class] = count;
+    return true;
+}
 
-    // todo 检测内存移出的问题
-    /* 分配的内存的元数据 */
-    auto metadata = (FileSystemMemoryMetadata*)_get_and_offset_address(sizeof(FileSystemMemoryMetadata));
-    metadata->size = size_with_metadata;
-    /* 分配实际需要的内存 */
-    metadata->address = _get_and_offset_address(size);
-    return metadata->address;
+static void* _large_alloc(FileSystemShard* shard, size_t size)
+{
+    /* 检查是否有空闲内存的大小可以容纳新分配的内存 */
+    pthread_mutex_lock(&shard->free_list_lock);
+    for (auto prev = &shard->unused_nodes; *prev != nullptr; prev = &(*prev)->next) {
+        auto block = *prev;
+        auto metadata = (FileSystemMemoryMetadata*)((char*)block - sizeof(FileSystemMemoryMetadata));
+        if (metadata->size >= size + sizeof(FileSystemMemoryMetadata)) {
+            *prev = block->next;
+            pthread_mutex_unlock(&shard->free_list_lock);
+            return block;
+        }
+    }
+    pthread_mutex_unlock(&shard->free_list_lock);
+
+    auto address = _reserve_memory(shard, size + sizeof(FileSystemMemoryMetadata));
+    if (address == nullptr)
+        return nullptr;
+    return _make_block(address, size);
+}
+
+void* alloc_memory(size_t size)
+{
+    size = _align_size(size == 0 ? 1 : size);
+    void* mem = nullptr;
+    if (size > FILESYSTEM_SIZE_CLASS_MAX) {
+        mem = _large_alloc(arena, size);
+    } else {
+        /* 小内存直接从线程缓存分配 */
+        auto cache = _tcache_bind(arena);
+        auto size_class = _size_class(size);
+        if (cache->counts[size_class] > 0 || _tcache_refill(cache, size_class)) {
+            mem = cache->blocks[size_class][--cache->counts[size_class]];
+        }
+    }
+    /* 分片空间不足时只通过返回值报告，由调用者转换为FS_ERROR_NO_MEMORY */
+    if (mem == nullptr)
+        return nullptr;
+    auto metadata = (FileSystemMemoryMetadata*)((char*)mem - sizeof(FileSystemMemoryMetadata));
+    metadata->owner = arena_owner;
+    atomic_fetch_add_explicit(&arena->allocated, metadata->size, memory_order_relaxed);
+    return mem;
 }
 
 void free_memory(void* mem)
 {
     if (mem == nullptr)
         return;
+    /* 内存块总是还给它所在的分片 */
+    auto shard = filesystem_shard_of(mem);
     /* 获取内存块metadata */
     auto metadata = (FileSystemMemoryMetadata*)((char*)mem - sizeof(FileSystemMemoryMetadata));
-    /* 添加到未使用的内存列表 */
-    clist_push_back(f->unused_nodes, metadata);
+    auto size = metadata->size - sizeof(FileSystemMemoryMetadata);
+    metadata->owner = nullptr;
+    atomic_fetch_sub_explicit(&shard->allocated, metadata->size, memory_order_relaxed);
+    if (size > FILESYSTEM_SIZE_CLASS_MAX) {
+        /* 添加到未使用的大内存列表 */
+        auto block = (FileSystemFreeBlock*)mem;
+        pthread_mutex_lock(&shard->free_list_lock);
+        block->next = shard->unused_nodes;
+        shard->unused_nodes = block;
+        pthread_mutex_unlock(&shard->free_list_lock);
+        return;
+    }
+    /* 小内存放回线程缓存，缓存满时批量归还一半 */
+    auto cache = _tcache_bind(shard);
+    auto size_class = _size_class(size);
+    if (cache->counts[size_class] == FILESYSTEM_TCACHE_COUNT) {
+        _tcache_release(cache, size_class, FILESYSTEM_TCACHE_BATCH);
+    }
+    cache->blocks[size_class][cache->counts[size_class]++] = mem;
+}
+
+FileSystemShard* filesystem_shard_at(size_t index)
+{
+    return (FileSystemShard*)((char*)SHM_ADDR + index * (size_t)SHM_SIZE);
+}
+
+FileSystemShard* filesystem_shard_of(const void* address)
+{
+    return filesystem_shard_at(filesystem_shard_index(address));
+}
+
+size_t filesystem_shard_index(const void* address)
+{
+    return ((const char*)address - (const char*)SHM_ADDR) / (size_t)SHM_SIZE;
+}
+
+void filesystem_use_node(FileSystemNode* node)
+{
+    arena = filesystem_shard_of(node);
+    arena_owner = node;
+}
+
+void filesystem_use_index(CBTree* index)
+{
+    arena = filesystem_shard_of(index);
+    arena_owner = index;
+}
+
+void filesystem_memory_set_owner(void* mem, void* owner)
+{
+    if (mem != nullptr)
+        ((FileSystemMemoryMetadata*)((char*)mem - sizeof(FileSystemMemoryMetadata)))->owner = owner;
 }
 
 void filesystem_node_destroy(FileSystemNode* node)
 {
     if (node == nullptr || node == f->root)
         return;
+    if (node->type != FS_NODE_FILE && node->type != FS_NODE_DIRECTORY) {
+        // 已被清除的节点
+        return;
+    }
+    // 先从parent的索引和子节点列表中移出，整棵子树的用量一次从祖先中减去，已被移出的节点不需要
+    if (node->parent != nullptr)
+        filesystem_node_unlink(node);
     // 清除data
-    if (node->type == File) {
+    if (node->type == FS_NODE_FILE) {
+        filesystem_tier_untrack(node);
+        filesystem_tier_discard(node);
         free_memory(node->data);
-    } else if (node->type == Directory) {
-        // 摧毁所有子节点
+    } else if (node->type == FS_NODE_DIRECTORY) {
+        // 可能是某个句柄的当前目录，通知所有当前目录重新查找
+        atomic_fetch_add(&f->cwd_epoch, 1);
+        // 先释放倒排索引，子节点移出时不需要再逐个从中删除
+        filesystem_trigrams_destroy(node);
+        // 摧毁所有子节点，子节点会把自己从链表中移除
         auto subnode_list = (CList*)node->data;
-        for (auto it = clist_begin(subnode_list); it != clist_end(subnode_list); it = clist_iterator_next(it)) {
-            auto subnode = (FileSystemNode*)clist_iterator_get(it);
-            if (subnode != nullptr) {
-                filesystem_node_destroy(clist_iterator_get(it));
-            }
+        while (clist_size(subnode_list) > 0) {
+            filesystem_node_destroy(clist_front(subnode_list));
         }
-    } else {
-        // 已被清除的节点
-        return;
-    }
-    // 更新parent的指针
-    auto parent_subnode_list = (CList*)node->parent->data;
-    for (auto it = clist_begin(parent_subnode_list); it != clist_end(parent_subnode_list); it =
-         clist_iterator_next(it)) {
-        auto subnode = (FileSystemNode*)clist_iterator_get(it);
-        if (subnode == node) {
-            clist_iterator_set(it, nullptr);
-            break;
+        clist_destroy(subnode_list);
+        // 摧毁目录索引
+        if (node->index != nullptr) {
+            cbtree_destroy(node->index);
+            node->index = nullptr;
         }
     }
-    // 清除node数据并释放内存
-    node->parent = nullptr;
-    node->type = Unknown;
+    // 清除node数据，唤醒等待者后释放内存
+    node->type = FS_NODE_UNKNOWN;
     node->name[0] = '\0';
     node->data = nullptr;
+    filesystem_node_changed(node);
+    /* 还有等待者时先放入分片的僵尸链表，等待者全部离开后再释放 */
+    auto shard = filesystem_shard_of(node);
+    filesystem_zombie_sweep(shard);
+    if (atomic_fetch_or(&node->watchers, FILESYSTEM_NODE_DEAD) == 0) {
+        free_memory(node);
+    } else {
+        node->data = shard->zombies;
+        shard->zombies = node;
+    }
+}
+
+FileSystemNode* filesystem_node_unlink(FileSystemNode* node)
+{
+    auto parent = node->parent;
+    filesystem_trigrams_remove(node);
+    if (parent->index != nullptr) {
+        FileSystemNodeKey key = {node->name, node->type};
+        cbtree_remove(parent->index, &key, filesystem_node_key_compare);
+    }
+    /* 通过节点记录的链表节点直接移出，不需要遍历整个目录 */
+    auto parent_subnode_list = (CList*)parent->data;
+    auto prev_it = clist_iterator_prev(node->link);
+    auto prev = prev_it == clist_end(parent_subnode_list) ? nullptr : (FileSystemNode*)clist_iterator_get(prev_it);
+    /* 先清空数据，防止clist_pop再次摧毁该节点 */
+    clist_iterator_set(node->link, nullptr);
+    clist_pop(parent_subnode_list, node->link);
+    filesystem_usage_sub(parent, filesystem_node_usage(node));
+    node->parent = nullptr;
+    node->link = nullptr;
+    filesystem_node_changed(parent);
+    return prev;
+}
+
+void filesystem_zombie_sweep(FileSystemShard* shard)
+{
+    for (auto prev = &shard->zombies; *prev != nullptr;) {
+        auto node = *prev;
+        if (atomic_load(&node->watchers) == FILESYSTEM_NODE_DEAD) {
+            *prev = (FileSystemNode*)node->data;
+            free_memory(node);
+        } else {
+            prev = (FileSystemNode**)&node->data;
+        }
+    }
+}
+
+FileSystemUsage filesystem_node_usage(const FileSystemNode* node)
+{
+    if (node->type == FS_NODE_DIRECTORY)
+        return (FileSystemUsage){atomic_load(&node->usage_bytes), atomic_load(&node->usage_entries) + 1};
+    if (node->spilled)
+        return (FileSystemUsage){node->spill_length, 1};
+    return (FileSystemUsage){node->data == nullptr ? 0 : strlen(node->data), 1};
+}
+
+/**
+ * 从dir开始沿父节点链减去用量，直到stop为止(不含stop)
+ */
+static void _usage_sub_until(FileSystemNode* dir, const FileSystemNode* stop, FileSystemUsage usage)
+{
+    for (auto node = dir; node != stop; node = node->parent) {
+        atomic_fetch_sub(&node->usage_bytes, usage.bytes);
+        atomic_fetch_sub(&node->usage_entries, usage.entries);
+    }
+}
+
+/**
+ * 增加后的用量是否超过配额，只检查增加的项
+ */
+static bool _usage_over_quota(size_t limit, size_t value, size_t delta)
+{
+    return delta > 0 && limit != 0 && value > limit;
+}
+
+FileSystemError filesystem_usage_add(FileSystemNode* dir, FileSystemUsage usage, bool check)
+{
+    /* 不同分片的写者可能同时更新根目录，先原子地加上再检查，超过配额时撤销，不会因为并发而超过配额 */
+    for (auto node = dir; node != nullptr; node = node->parent) {
+        auto bytes = atomic_fetch_add(&node->usage_bytes, usage.bytes) + usage.bytes;
+        auto entries = atomic_fetch_add(&node->usage_entries, usage.entries) + usage.entries;
+        if (check && (_usage_over_quota(node->quota.bytes, bytes, usage.bytes) ||
+                      _usage_over_quota(node->quota.entries, entries, usage.entries))) {
+            _usage_sub_until(dir, node->parent, usage);
+            return FS_ERROR_QUOTA;
+        }
+    }
+    return FS_OK;
+}
+
+void filesystem_usage_sub(FileSystemNode* dir, FileSystemUsage usage)
+{
+    _usage_sub_until(dir, nullptr, usage);
+}
+
+bool filesystem_usage_fits(const FileSystemNode* dir, FileSystemUsage usage)
+{
+    for (auto node = dir; node != nullptr; node = node->parent) {
+        if (_usage_over_quota(node->quota.bytes, atomic_load(&node->usage_bytes) + usage.bytes, usage.bytes) ||
+            _usage_over_quota(node->quota.entries, atomic_load(&node->usage_entries) + usage.entries,
+                              usage.entries))
+            return false;
+    }
+    return true;
+}
+
+void filesystem_node_changed(FileSystemNode* node)
+{
+    atomic_fetch_add(&node->seq, 1);
+    if ((atomic_load(&node->watchers) & ~FILESYSTEM_NODE_DEAD) != 0)
+        filesystem_futex_wake(&node->seq, INT_MAX);
+}
+
+bool path_is_sep(char c)
+{
+    return c == '/' || c == '\\';
+}
+
+/**
+ * 检查节点名是否合法，不能为空、过长、包含路径分隔符或者是"."和".."
+ */
+static bool _node_name_valid(const char* name)
+{
+    if (name == nullptr || name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return false;
+    size_t size = 0;
+    for (; name[size] != '\0'; ++size) {
+        if (path_is_sep(name[size]) || size + 1 >= FILESYSTEM_NODE_NAME_SIZE)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * FNV-1a哈希，用于将根目录下的目录分配到分片
+ */
+static size_t _name_hash(const char* name)
+{
+    uint32_t hash = 2166136261u;
+    for (; *name != '\0'; ++name) {
+        hash ^= (uint8_t)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+FileSystemShard* filesystem_node_shard(const FileSystemNode* parent, FileSystemNodeType type, const char* name)
+{
+    /* 根目录下的目录按名称哈希分配到分片，其余节点和父节点在同一个分片中 */
+    if (parent == nullptr)
+        return &f->shard;
+    if (parent == f->root && type == FS_NODE_DIRECTORY)
+        return filesystem_shard_at(_name_hash(name) % f->shard_count);
+    return filesystem_shard_of(parent);
+}
+
+/**
+ * 撤销创建到一半的节点，释放节点和目录链表并退回祖先的用量，文件内容由调用者释放
+ */
+static FileSystemError _node_create_undo(FileSystemNode* node, FileSystemNode* parent, FileSystemUsage usage)
+{
+    if (node->type == FS_NODE_DIRECTORY && node->data != nullptr)
+        clist_destroy(node->data);
     free_memory(node);
+    if (parent != nullptr)
+        filesystem_usage_sub(parent, usage);
+    return FS_ERROR_NO_MEMORY;
 }
 
 /**
@@ -203,392 +639,1124 @@ void filesystem_node_destroy(FileSystemNode* node)
  * @param type 节点类型
  * @param name 节点名称
  * @param data 节点数据，如果时目录会忽略此参数
- * @return 创建后的节点指针
+ * @param node 输出创建后的节点指针，可以为nullptr
+ * @return 共享内存不足时返回FS_ERROR_NO_MEMORY，父目录和用量不变
  */
-FileSystemNode* filesystem_node_create(FileSystemNode* parent, FileSystemNodeType type, const char* name, void* data)
+FileSystemError filesystem_node_create(FileSystemNode* parent, FileSystemNodeType type, const char* name,
+                                       void* data, FileSystemNode** node)
 {
-    // todo 检查参数合法性
-    // 检查父节点是否有同名节点
+    if (type != FS_NODE_FILE && type != FS_NODE_DIRECTORY)
+        return FS_ERROR_INVALID_ARGUMENT;
+    // 检查父节点是否有同名节点, 根目录没有父节点
     if (parent != nullptr) {
-        auto subnode = filesystem_node_get_subnode(parent, type, name);
-        if (subnode != nullptr) {
-            printf("已有同名同类型节点 \"%s\"\n", name);
-            return nullptr;
-        }
+        if (!_node_name_valid(name))
+            return FS_ERROR_INVALID_ARGUMENT;
+        if (filesystem_node_get_subnode(parent, type, name) != nullptr)
+            return FS_ERROR_EXIST;
     }
 
-    auto node = (FileSystemNode*)alloc_memory(sizeof(FileSystemNode));
-    node->parent = parent;
-    node->type = type;
-    strcpy(node->name, name);
-    if (node->type == File) {
-        node->data = data;
-    } else if (node->type == Directory) {
-        /* 创建一个空的目录链表 */
-        node->data = clist_create();
+    /* 在分配之前计入祖先的用量，超过配额时不分配 */
+    FileSystemUsage usage = {type == FS_NODE_FILE && data != nullptr ? strlen(data) : 0, 1};
+    if (parent != nullptr) {
+        auto error = filesystem_usage_add(parent, usage, true);
+        if (error != FS_OK)
+            return error;
+    }
+
+    arena = filesystem_node_shard(parent, type, name);
+    auto new_node = (FileSystemNode*)alloc_memory(sizeof(FileSystemNode));
+    if (new_node == nullptr) {
+        if (parent != nullptr)
+            filesystem_usage_sub(parent, usage);
+        return FS_ERROR_NO_MEMORY;
+    }
+    /* 节点和目录链表属于节点自己，调用者预先分配的文件内容也交给节点 */
+    filesystem_use_node(new_node);
+    filesystem_memory_set_owner(new_node, new_node);
+    new_node->parent = parent;
+    new_node->link = nullptr;
+    new_node->type = type;
+    strcpy(new_node->name, name);
+    new_node->index = nullptr;
+    atomic_init(&new_node->seq, 0);
+    atomic_init(&new_node->watchers, 0);
+    atomic_init(&new_node->usage_bytes, 0);
+    atomic_init(&new_node->usage_entries, 0);
+    new_node->quota = (FileSystemUsage){0, 0};
+    new_node->trigram_index = type == FS_NODE_DIRECTORY && parent != nullptr && parent->trigram_index;
+    new_node->postings = nullptr;
+    new_node->trigram_id = FILESYSTEM_TRIGRAM_NONE;
+    atomic_init(&new_node->referenced, false);
+    new_node->spilled = false;
+    new_node->clock_prev = nullptr;
+    new_node->clock_next = nullptr;
+    new_node->spill_offset = 0;
+    new_node->spill_length = 0;
+    if (type == FS_NODE_FILE) {
+        new_node->data = data;
+        filesystem_memory_set_owner(data, new_node);
     } else {
-        // todo 未知类型
-        free_memory(node);
-        return nullptr;
+        /* 创建一个空的目录链表 */
+        new_node->data = clist_create();
+        if (new_node->data == nullptr)
+            return _node_create_undo(new_node, parent, usage);
     }
-    // 更新父节点的子节点列表
+    // 更新父节点的子节点列表，链表和索引节点分配在父节点的分片中
     if (parent != nullptr) {
+        filesystem_use_node(parent);
         auto parent_subnode_list = (CList*)parent->data;
-        clist_push_back(parent_subnode_list, node);
+        auto it = clist_push_back(parent_subnode_list, new_node);
+        if (it == nullptr)
+            return _node_create_undo(new_node, parent, usage);
+        new_node->link = it;
+        if (parent->index != nullptr) {
+            /* 索引内部的树节点属于索引 */
+            filesystem_use_index(parent->index);
+            FileSystemNodeKey key = {new_node->name, new_node->type};
+            if (!cbtree_insert(parent->index, new_node, &key, filesystem_node_key_compare)) {
+                /* 先清空数据，防止clist_pop摧毁该节点 */
+                clist_iterator_set(it, nullptr);
+                clist_pop(parent_subnode_list, it);
+                return _node_create_undo(new_node, parent, usage);
+            }
+        }
+        filesystem_node_changed(parent);
     }
-    return node;
+    filesystem_trigrams_add(new_node);
+    if (node != nullptr)
+        *node = new_node;
+    return FS_OK;
 }
 
-
-void filesystem_init(const char* program_path)
+static void _shard_lock(size_t index, bool write)
 {
-    /* 创建或者获取共享内存 */
-    key_t shm_key = ftok(program_path, 'Z');
-    shmid = shmget(shm_key, SHM_SIZE, 0644 | IPC_CREAT);
-    if (shmid == -1) {
-        perror("shmget failed");
-        exit(1);
-    }
-    /* 附加到内存空间并取出共享内存中的文件系统 */
-    f = (FileSystem*)shmat(shmid, SHM_ADDR, 0);
-    if (f != SHM_ADDR) {
-        perror("shmat failed");
-        exit(1);
+    auto rwlock = &filesystem_shard_at(index)->rwlock;
+    if (write) {
+        pthread_rwlock_wrlock(rwlock);
+    } else {
+        pthread_rwlock_rdlock(rwlock);
     }
-    /* 检查是否是未初始化的文件系统 */
-    if (f->magic_number != MAGIC_NUMBER_INITED) {
-        // todo 创建文件系统时没有做并行的同步
+}
 
-        /* 初始化共享内存 */
-        f->magic_number = MAGIC_NUMBER_INITED;
-        /* 初始化读写锁 */
-        pthread_rwlockattr_t attr;
-        // 初始化读写锁属性
-        if (pthread_rwlockattr_init(&attr) != 0) {
-            perror("pthread_rwlockattr_init");
-            exit(EXIT_FAILURE);
-        }
-        // 设置为进程间共享
-        if (pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0) {
-            perror("pthread_rwlockattr_setpshared");
-            exit(EXIT_FAILURE);
+/**
+ * 当前目录是否需要重新查找，调用者需要持有分片0的锁
+ */
+static bool _cwd_stale(const FileSystemCwd* cwd)
+{
+    return cwd->epoch != atomic_load(&f->cwd_epoch);
+}
+
+void filesystem_cwd_validate(FileSystemCwd* cwd)
+{
+    if (_cwd_stale(cwd))
+        filesystem_cwd_refresh(cwd);
+}
+
+/**
+ * 当前目录所在的分片，已被删除时只需要分片0
+ */
+static size_t _cwd_shard_index(const FileSystemCwd* cwd)
+{
+    return cwd->dir == nullptr ? 0 : filesystem_shard_index(cwd->dir);
+}
+
+FileSystemLocks filesystem_lock_cwd(FileSystemHandle* handle, bool write)
+{
+    f = handle->fs;
+    for (;;) {
+        /* 加锁前读取当前目录不安全，先加分片0的读锁确定当前目录所在的分片 */
+        _shard_lock(0, false);
+        auto index = _cwd_shard_index(handle->cwd);
+        auto exclusive = (index == 0 && write) || _cwd_stale(handle->cwd);
+        if (exclusive) {
+            /* 当前目录在分片0中或者需要重新查找，改为写锁，期间当前目录可能被切换到其他分片 */
+            filesystem_unlock(1);
+            _shard_lock(0, true);
+            filesystem_cwd_validate(handle->cwd);
+            index = _cwd_shard_index(handle->cwd);
         }
-        // 初始化读写锁
-        if (pthread_rwlock_init(&f->rwlock, &attr) != 0) {
-            perror("pthread_rwlock_init");
-            exit(EXIT_FAILURE);
+        FileSystemLocks locks = 1;
+        if (index != 0) {
+            _shard_lock(index, write);
+            locks |= 1u << index;
         }
-        // 销毁属性对象
+        /* 只持有分片0的读锁时，等待分片锁期间当前目录可能被其他句柄删除，重新查找后再加锁 */
+        if (exclusive || !_cwd_stale(handle->cwd))
+            return locks;
+        filesystem_unlock(locks);
+    }
+}
+
+FileSystemLocks filesystem_lock_all(FileSystemHandle* handle, bool write)
+{
+    f = handle->fs;
+    _shard_lock(0, true);
+    for (size_t i = 1; i < f->shard_count; ++i) {
+        _shard_lock(i, write);
+    }
+    filesystem_cwd_validate(handle->cwd);
+    return (1u << f->shard_count) - 1;
+}
+
+void filesystem_lock_node(FileSystemLocks* locks, const FileSystemNode* node)
+{
+    auto index = filesystem_shard_index(node);
+    if (*locks & (1u << index))
+        return;
+    _shard_lock(index, true);
+    *locks |= 1u << index;
+}
+
+void filesystem_lock_subtree(FileSystemLocks* locks, const FileSystemNode* dir)
+{
+    auto first = dir == f->root ? 0 : filesystem_shard_index(dir);
+    auto last = dir == f->root ? f->shard_count - 1 : first;
+    for (auto i = first; i <= last; ++i) {
+        if (*locks & (1u << i))
+            continue;
+        _shard_lock(i, false);
+        *locks |= 1u << i;
+    }
+}
+
+void filesystem_unlock(FileSystemLocks locks)
+{
+    for (size_t i = FILESYSTEM_SHARD_MAX; i > 0; --i) {
+        if (locks & (1u << (i - 1)))
+            pthread_rwlock_unlock(&filesystem_shard_at(i - 1)->rwlock);
+    }
+}
+
+bool filesystem_futex_wait(_Atomic uint32_t* address, uint32_t expected, int timeout_ms)
+{
+    struct timespec timeout = {timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000};
+    /* 共享内存可能被多个进程附加，不能使用FUTEX_PRIVATE_FLAG */
+    long result = syscall(SYS_futex, address, FUTEX_WAIT, expected, timeout_ms < 0 ? nullptr : &timeout, nullptr, 0);
+    return result == 0 || errno != ETIMEDOUT;
+}
+
+void filesystem_futex_wake(_Atomic uint32_t* address, int count)
+{
+    syscall(SYS_futex, address, FUTEX_WAKE, count, nullptr, nullptr, 0);
+}
+
+void filesystem_parallel(void* (*worker)(void*), void* arg, size_t count, size_t per_thread)
+{
+    auto cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t thread_count = cpu_count > 0 ? (size_t)cpu_count : 1;
+    if (thread_count > FILESYSTEM_PARALLEL_MAX)
+        thread_count = FILESYSTEM_PARALLEL_MAX;
+    if (thread_count > count / per_thread)
+        thread_count = count / per_thread;
+
+    /* 当前线程也参与，创建线程失败时由已有的线程完成 */
+    pthread_t threads[FILESYSTEM_PARALLEL_MAX];
+    size_t started = 0;
+    for (; started + 1 < thread_count; ++started) {
+        if (pthread_create(&threads[started], nullptr, worker, arg) != 0)
+            break;
+    }
+    worker(arg);
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], nullptr);
+    }
+}
+
+static void _cwd_reset(FileSystemCwd* cwd, FileSystemNode* root)
+{
+    cwd->dir = root;
+    cwd->pwd_offset = 1;
+    cwd->pwd[0] = '/';
+    cwd->pwd[1] = '\0';
+}
+
+/**
+ * 初始化分片的锁和分配器，不写入magic number
+ * @param header_size 分片开头不参与分配的大小
+ */
+static FileSystemError _shard_format(FileSystemShard* shard, size_t header_size)
+{
+    /* 初始化读写锁 */
+    pthread_rwlockattr_t attr;
+    // 初始化读写锁属性
+    if (pthread_rwlockattr_init(&attr) != 0)
+        return FS_ERROR_SYSTEM;
+    // 设置为进程间共享
+    if (pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0) {
+        pthread_rwlockattr_destroy(&attr);
+        return FS_ERROR_SYSTEM;
+    }
+    // 初始化读写锁
+    if (pthread_rwlock_init(&shard->rwlock, &attr) != 0) {
         pthread_rwlockattr_destroy(&attr);
+        return FS_ERROR_SYSTEM;
+    }
+    // 销毁属性对象
+    pthread_rwlockattr_destroy(&attr);
 
-        /* 设置文件系统初始值 */
-        f->shm_offset = sizeof(FileSystem);
-        f->unused_nodes = nullptr;
-        f->root = nullptr;
-        f->cur_dir = nullptr;
+    /* 初始化空闲链表的锁，同样设置为进程间共享 */
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    if (pthread_mutex_init(&shard->free_list_lock, &mutex_attr) != 0) {
+        pthread_mutexattr_destroy(&mutex_attr);
+        return FS_ERROR_SYSTEM;
+    }
+    pthread_mutexattr_destroy(&mutex_attr);
 
-        /* 创建释放后的内存列表 */
-        f->unused_nodes = clist_create();
+    /* 设置分配器初始值 */
+    atomic_init(&shard->shm_offset, _align_size(header_size));
+    memset(shard->free_lists, 0, sizeof(shard->free_lists));
+    shard->unused_nodes = nullptr;
+    atomic_init(&shard->epoch, 0);
+    shard->defrag_offset = atomic_load(&shard->shm_offset);
+    shard->zombies = nullptr;
+    atomic_init(&shard->allocated, 0);
+    shard->clock_hand = nullptr;
+    shard->clock_count = 0;
+    return FS_OK;
+}
 
-        /* 创建根目录 */
-        f->root = filesystem_node_create(nullptr, Directory, "/", nullptr);
-        f->cur_dir = f->root;
-        /* 初始化pwd */
-        f->pwd_offset = 1;
-        f->pwd[0] = '/';
-        f->pwd[1] = '\0';
+/**
+ * 获取并附加第index个分片的共享内存，分片必须按下标顺序附加
+ * @param creator 输入是否创建共享内存，输出共享内存是否由当前进程创建，通过IPC_EXCL确定由哪个进程负责初始化
+ */
+static FileSystemError _shard_attach(const char* key_path, size_t index, bool* creator)
+{
+    key_t shm_key = ftok(key_path, 'Z' + (int)index);
+    if (shm_key == -1)
+        return FS_ERROR_SYSTEM;
+    int shmid = -1;
+    if (*creator) {
+        shmid = shmget(shm_key, SHM_SIZE, 0644 | IPC_CREAT | IPC_EXCL);
+        if (shmid == -1 && errno == EEXIST)
+            *creator = false;
     }
+    if (!*creator)
+        shmid = shmget(shm_key, SHM_SIZE, 0644);
+    if (shmid == -1)
+        return FS_ERROR_SYSTEM;
+    /* 附加到分片的固定地址 */
+    auto shard = filesystem_shard_at(index);
+    if (shmat(shmid, shard, 0) != shard)
+        return FS_ERROR_SYSTEM;
+    attached_shmids[index] = shmid;
+    attached_shard_count = index + 1;
+    return FS_OK;
 }
 
-bool path_is_sep(char c)
+/**
+ * 分离所有已附加的分片
+ * @param remove 是否同时标记共享内存为待删除，所有进程分离后才会真正释放
+ */
+static void _shards_detach(bool remove)
 {
-    return c == '/' || c == '\\';
+    for (size_t i = attached_shard_count; i > 0; --i) {
+        if (remove && shmctl(attached_shmids[i - 1], IPC_RMID, nullptr) == -1) {
+            perror("shmctl IPC_RMID failed");
+        }
+        if (shmdt(filesystem_shard_at(i - 1)) == -1) {
+            perror("shmdt failed");
+        }
+    }
+    attached_shard_count = 0;
 }
 
 /**
- * 将当前路径变为其上一级路径，并返回新路径的大小, 只处理绝对路径
- * @param path 需要变化的路径
- * @param size 当前路径大小
- * @return 变化后的路径大小
+ * 初始化新创建的共享内存，并创建和初始化其余分片，只有创建共享内存的进程调用
  */
-size_t path_to_parent_path(char* path, size_t size)
+static FileSystemError _filesystem_format(FileSystem* fs, const char* key_path, size_t shard_count)
 {
-    // 根目录不动
-    if (size <= 1) {
-        return size;
+    auto error = _shard_format(&fs->shard, sizeof(FileSystem));
+    if (error != FS_OK)
+        return error;
+    fs->shard_count = shard_count;
+    for (size_t i = 1; i < shard_count; ++i) {
+        /* 上次未删除的分片同样重新初始化 */
+        bool creator = true;
+        error = _shard_attach(key_path, i, &creator);
+        if (error == FS_OK)
+            error = _shard_format(filesystem_shard_at(i), sizeof(FileSystemShard));
+        if (error != FS_OK)
+            return error;
     }
-    // 搜索上一个路径分隔符
-    for (--size; size > 1 && !path_is_sep(path[size]); --size) {}
-    return size;
+
+    /* 创建根目录 */
+    f = fs;
+    fs->root = nullptr;
+    error = filesystem_node_create(nullptr, FS_NODE_DIRECTORY, "/", nullptr, &fs->root);
+    if (error != FS_OK)
+        return error;
+    _cwd_reset(&fs->cwd, fs->root);
+    atomic_init(&fs->cwd_epoch, 0);
+    fs->cwd.epoch = 0;
+    atomic_init(&fs->ring_doorbell, 0);
+    atomic_init(&fs->ring_applier_waiting, 0);
+    memset(fs->rings, 0, sizeof(fs->rings));
+    memset(&fs->tier, 0, sizeof(fs->tier));
+
+    /* 最后写入magic number，其他进程看到分片0的magic number后才会开始使用 */
+    atomic_thread_fence(memory_order_release);
+    for (size_t i = shard_count; i > 0; --i) {
+        filesystem_shard_at(i - 1)->magic_number = MAGIC_NUMBER_INITED;
+    }
+    return FS_OK;
+}
+
+static void _tcache_key_init()
+{
+    pthread_key_create(&tcache_key, _tcache_thread_exit);
+    /* 主线程退出时不会调用key的析构函数 */
+    atexit(_tcache_flush);
 }
 
 /**
- * 拼接一级目录到原目录，只能拼接一级目录，被拼接的目录不能带有分隔符
- * @param path 原路径
- * @param size 原路径大小
- * @param new_path 新路径，以'\0'结束
- * @return 拼接后的路径大小
+ * 附加到共享内存，不存在时创建，调用者需要持有attach_lock
  */
-size_t path_join_path(char* path, size_t size, const char* new_path)
+static FileSystemError _filesystem_attach(const char* key_path, size_t shard_count)
 {
-    if (!path_is_sep(path[--size]))
-        path[++size] = '/';
-    for (size_t i = 0; new_path[i] != '\0'; ++i) {
-        path[++size] = new_path[i];
+    if (attach_count > 0) {
+        ++attach_count;
+        return FS_OK;
     }
-    path[++size] = '/';
-    path[++size] = '\0';
-    return size;
+    /* 分片0中存放文件系统，由它的创建者负责初始化所有分片 */
+    bool creator = true;
+    auto error = _shard_attach(key_path, 0, &creator);
+    if (error != FS_OK)
+        return error;
+    auto fs = (FileSystem*)filesystem_shard_at(0);
+
+    if (creator) {
+        error = _filesystem_format(fs, key_path, shard_count);
+    } else {
+        /* 等待创建者完成初始化，之后才能读取分片数 */
+        while (((volatile FileSystem*)fs)->shard.magic_number != MAGIC_NUMBER_INITED) {
+            sched_yield();
+        }
+        atomic_thread_fence(memory_order_acquire);
+        for (size_t i = 1; i < fs->shard_count && error == FS_OK; ++i) {
+            bool shard_creator = false;
+            error = _shard_attach(key_path, i, &shard_creator);
+        }
+    }
+    if (error != FS_OK) {
+        _shards_detach(creator);
+        return error;
+    }
+    attached_fs = fs;
+    attach_count = 1;
+    return FS_OK;
 }
 
-void filesystem_force_deinit()
+/**
+ * 减少附加计数，最后一个句柄关闭时分离共享内存，调用者需要持有attach_lock
+ */
+static void _filesystem_detach()
 {
-    debug_printf("filesystem_force_deinit\n");
-    if (f == nullptr)
+    if (attach_count == 0 || --attach_count > 0)
         return;
-    /* 防止后续重新分配到这块内存时被误认为已初始化 */
-    f->magic_number = MAGIC_NUMBER_DEINITED;
-    // todo 销毁过程中又有进程使用共享内存怎么办
-    /* 反初始化共享锁 */
-    pthread_rwlock_destroy(&f->rwlock);
-    /* 释放共享内存 */
-    // 分离共享内存
-    if (shmdt(f) == -1) {
-        perror("shmdt failed");
+    /* 当前线程的缓存还能归还，其他线程的缓存在分离后失效 */
+    _tcache_flush();
+    filesystem_tier_close();
+    atomic_fetch_add(&attach_generation, 1);
+    _shards_detach(false);
+    attached_fs = nullptr;
+}
+
+FileSystemError filesystem_open(const char* key_path, int flags, FileSystemHandle** handle)
+{
+    return filesystem_open_sharded(key_path, flags, 1, handle);
+}
+
+FileSystemError filesystem_open_sharded(const char* key_path, int flags, size_t shard_count,
+                                        FileSystemHandle** handle)
+{
+    if (shard_count == 0 || shard_count > FILESYSTEM_SHARD_MAX)
+        return FS_ERROR_INVALID_ARGUMENT;
+    pthread_once(&tcache_key_once, _tcache_key_init);
+    auto new_handle = (FileSystemHandle*)malloc(sizeof(FileSystemHandle));
+    if (new_handle == nullptr)
+        return FS_ERROR_NO_MEMORY;
+
+    pthread_mutex_lock(&attach_lock);
+    auto error = _filesystem_attach(key_path, shard_count);
+    pthread_mutex_unlock(&attach_lock);
+    if (error != FS_OK) {
+        free(new_handle);
+        return error;
     }
 
-    // 3. 获取共享内存ID以便删除
-    if (shmid == -1) {
-        perror("shmget for deletion failed");
-        return;
+    new_handle->fs = attached_fs;
+    /* 整理内存时root可能被移动，需要在锁内读取 */
+    _shard_lock(0, false);
+    _cwd_reset(&new_handle->private_cwd, new_handle->fs->root);
+    new_handle->private_cwd.epoch = atomic_load(&new_handle->fs->cwd_epoch);
+    filesystem_unlock(1);
+    if (flags & FILESYSTEM_OPEN_SHARED_CWD) {
+        new_handle->cwd = &new_handle->fs->cwd;
+    } else {
+        new_handle->cwd = &new_handle->private_cwd;
     }
+    *handle = new_handle;
+    return FS_OK;
+}
+
+size_t filesystem_shard_count(FileSystemHandle* handle)
+{
+    return handle->fs->shard_count;
+}
 
-    // 4. 标记共享内存为待删除
-    if (shmctl(shmid, IPC_RMID, nullptr) == -1) {
-        perror("shmctl IPC_RMID failed");
+size_t filesystem_memory_usage(FileSystemHandle* handle)
+{
+    size_t usage = 0;
+    for (size_t i = 0; i < handle->fs->shard_count; ++i) {
+        usage += atomic_load(&filesystem_shard_at(i)->shm_offset);
     }
-    debug_printf("filesystem_force_deinit unlocked\n");
+    return usage;
 }
 
-void filesystem_deinit()
+void filesystem_close(FileSystemHandle* handle)
 {
-    debug_printf("filesystem_deinit\n");
-    if (f == nullptr)
+    if (handle == nullptr)
         return;
-    /* 防止有进程在使用 */
-    pthread_rwlock_wrlock(&f->rwlock);
-    pthread_rwlock_unlock(&f->rwlock);
+    pthread_mutex_lock(&attach_lock);
+    _filesystem_detach();
+    pthread_mutex_unlock(&attach_lock);
+    free(handle);
+}
+
+void filesystem_destroy(FileSystemHandle* handle, bool force)
+{
+    debug_printf("filesystem_destroy\n");
+    if (handle == nullptr)
+        return;
+    auto fs = handle->fs;
+    if (!force) {
+        /* 防止有进程在使用 */
+        filesystem_unlock(filesystem_lock_all(handle, true));
+    }
     // todo 销毁过程中又有进程使用共享内存怎么办
-    filesystem_force_deinit();
-    debug_printf("filesystem_deinit unlocked\n");
+    /* 后备文件随文件系统一起删除 */
+    filesystem_tier_close();
+    if (fs->tier.enabled)
+        unlink(fs->tier.path);
+    for (size_t i = 0; i < fs->shard_count; ++i) {
+        auto shard = filesystem_shard_at(i);
+        /* 防止后续重新分配到这块内存时被误认为已初始化 */
+        shard->magic_number = MAGIC_NUMBER_DEINITED;
+        /* 反初始化共享锁 */
+        pthread_rwlock_destroy(&shard->rwlock);
+        pthread_mutex_destroy(&shard->free_list_lock);
+    }
+
+    pthread_mutex_lock(&attach_lock);
+    /* 线程缓存中的内存块随共享内存一起失效，这里强制分离，同进程的其他句柄也不能再使用 */
+    _tcache_reset();
+    atomic_fetch_add(&attach_generation, 1);
+    _shards_detach(true);
+    attached_fs = nullptr;
+    attach_count = 0;
+    pthread_mutex_unlock(&attach_lock);
+    free(handle);
+    debug_printf("filesystem_destroy finished\n");
+}
+
+/**
+ * 将路径变为其上一级路径，路径总是以分隔符结尾，根目录不变
+ * @return 变化后的路径大小
+ */
+static size_t _path_to_parent_path(char* path, size_t size)
+{
+    // 根目录不动
+    if (size <= 1)
+        return size;
+    // 跳过结尾的分隔符，搜索上一个路径分隔符
+    for (--size; size > 1 && !path_is_sep(path[size - 1]); --size) {}
+    path[size] = '\0';
+    return size;
 }
 
 /**
- * 处理单机目录的切换，出错会回溯
- * @param name 需要解析的路径名
- * @param ori_dir 原始目录，发生错误时恢复状态使用
- * @param ori_offset 原始pwd便宜
- * @param ori_pwd 原始pwd
- * @param arg_path 出错的参数
- * @return 是否成功
+ * 拼接一级目录到原路径，被拼接的目录不能带有分隔符
+ * @return 拼接后的路径大小，超出FILESYSTEM_PWD_SIZE时返回0且不修改原路径
  */
-bool _cd_parse_sigle_path(const char* name, FileSystemNode* ori_dir, size_t ori_offset, const char* ori_pwd,
-                          const char* arg_path)
+static size_t _path_join_path(char* path, size_t size, const char* name)
 {
-    if (strcmp(name, ".") == 0) {
+    size_t name_size = strlen(name);
+    if (size + name_size + 2 > FILESYSTEM_PWD_SIZE)
+        return 0;
+    memcpy(path + size, name, name_size);
+    size += name_size;
+    path[size++] = '/';
+    path[size] = '\0';
+    return size;
+}
+
+/**
+ * 处理单级目录的切换
+ * @param cwd 正在切换的目录
+ * @param name 需要解析的目录名
+ */
+static FileSystemError _cd_parse_single_path(FileSystemCwd* cwd, const char* name)
+{
+    if (cwd->dir == nullptr) {
+        // 当前目录已被删除，只能通过绝对路径切换
+        return FS_ERROR_NOT_EXIST;
+    } else if (name[0] == '\0' || strcmp(name, ".") == 0) {
         // 当前目录, 不变
     } else if (strcmp(name, "..") == 0) {
-        // 上一级目录
-        if (f->cur_dir != f->root) {
-            f->pwd_offset = path_to_parent_path(f->pwd, f->pwd_offset);
-            f->cur_dir = f->cur_dir->parent;
-        } else {
-            // 根目录的上一级不变
+        // 上一级目录, 根目录的上一级不变
+        if (cwd->dir != f->root) {
+            cwd->pwd_offset = _path_to_parent_path(cwd->pwd, cwd->pwd_offset);
+            cwd->dir = cwd->dir->parent;
         }
     } else {
         // 查找是否存在该子目录
-        auto subnode = filesystem_node_get_subnode(f->cur_dir, Directory, name);
-        if (subnode != nullptr) {
-            // 找到对应子目录
-            f->pwd_offset = path_join_path(f->pwd, f->pwd_offset, name);
-            f->cur_dir = subnode;
-        } else {
-            // 没有找到对应子目录
-            f->cur_dir = ori_dir;
-            f->pwd_offset = ori_offset;
-            strcpy(f->pwd, ori_pwd);
-            printf("cd error, dir \"%s\" not exist!", arg_path);
-            return false;
-        }
+        auto subnode = filesystem_node_get_subnode(cwd->dir, FS_NODE_DIRECTORY, name);
+        if (subnode == nullptr)
+            return FS_ERROR_NOT_EXIST;
+        auto offset = _path_join_path(cwd->pwd, cwd->pwd_offset, name);
+        if (offset == 0)
+            return FS_ERROR_INVALID_ARGUMENT;
+        cwd->pwd_offset = offset;
+        cwd->dir = subnode;
     }
-    return true;
+    return FS_OK;
 }
 
-void cd(const char* path)
+/**
+ * 从cwd出发解析路径，结果写回cwd
+ */
+static FileSystemError _cd_parse_path(FileSystemCwd* cwd, const char* path)
 {
-    debug_printf("cd: %s\n", path);
-    static size_t pos;
-    static char name[FILESYSTEM_NODE_NAME_SIZE];
-    static char ori_pwd[FILESYSTEM_PWD_SIZE];
-
-    pthread_rwlock_wrlock(&f->rwlock);
-
-    // 保留当前目录，方便查找错误后的回溯
-    auto ori_dir = f->cur_dir;
-    auto ori_offset = f->pwd_offset;
-    strcpy(ori_pwd, f->pwd);
-
-    pos = 0;
-    name[pos] = '\0';
-
+    char name[FILESYSTEM_NODE_NAME_SIZE];
+    size_t pos = 0;
     // 特殊处理绝对目录
-    int i = 0;
+    size_t i = 0;
     if (path_is_sep(path[0])) {
-        f->cur_dir = f->root;
+        _cwd_reset(cwd, f->root);
         ++i;
     }
-    // 处理所有其他目录
-
-    for (; path[i] != '\0'; i++) {
-        if (path_is_sep(path[i])) {
-            // 处理这一级目录操作
+    // 逐级处理目录，最后一级没有分隔符
+    for (;; ++i) {
+        if (path[i] == '\0' || path_is_sep(path[i])) {
             name[pos] = '\0';
-            bool unlocked = _cd_parse_sigle_path(name, ori_dir, ori_offset, ori_pwd, path);
-            if (!unlocked) {
-                // 发生错误，回溯结构并报错
-                break;
-            }
-            // 复位name
+            auto error = _cd_parse_single_path(cwd, name);
+            if (error != FS_OK)
+                return error;
             pos = 0;
-            name[pos] = '\0';
+            if (path[i] == '\0')
+                break;
+        } else if (pos + 1 >= FILESYSTEM_NODE_NAME_SIZE) {
+            return FS_ERROR_INVALID_ARGUMENT;
         } else {
-            // 正常情况下更新name
             name[pos++] = path[i];
         }
     }
-    // 处理最后一级目录
-    if (pos > 0) {
-        name[pos] = '\0';
-        _cd_parse_sigle_path(name, ori_dir, ori_offset, ori_pwd, path);
+    return FS_OK;
+}
+
+FileSystemError filesystem_op_cd(FileSystemCwd* cwd, const char* path)
+{
+    /* 在副本上解析，出错时当前目录保持不变 */
+    FileSystemCwd new_cwd;
+    memcpy(&new_cwd, cwd, sizeof(FileSystemCwd));
+    auto error = _cd_parse_path(&new_cwd, path);
+    if (error == FS_OK) {
+        memcpy(cwd, &new_cwd, sizeof(FileSystemCwd));
+    }
+    return error;
+}
+
+void filesystem_cwd_refresh(FileSystemCwd* cwd)
+{
+    char pwd[FILESYSTEM_PWD_SIZE];
+    memcpy(pwd, cwd->pwd, sizeof(pwd));
+    pwd[FILESYSTEM_PWD_SIZE - 1] = '\0';
+    /* 不能再访问原来的目录指针，从根目录开始查找 */
+    _cwd_reset(cwd, f->root);
+    if (_cd_parse_path(cwd, pwd) != FS_OK) {
+        /* 目录已被删除，保留原路径用于pwd */
+        memcpy(cwd->pwd, pwd, sizeof(pwd));
+        cwd->pwd_offset = strlen(pwd);
+        cwd->dir = nullptr;
     }
-    pthread_rwlock_unlock(&f->rwlock);
-    debug_printf("cd: %s unlocked\n", name);
+    cwd->epoch = atomic_load(&f->cwd_epoch);
 }
 
-void pwd()
+FileSystemError filesystem_cd(FileSystemHandle* handle, const char* path)
+{
+    debug_printf("cd: %s\n", path);
+    /* 路径可能跨越多个分片 */
+    auto locks = filesystem_lock_all(handle, false);
+    auto error = filesystem_op_cd(handle->cwd, path);
+    filesystem_unlock(locks);
+    debug_printf("cd: %s unlocked\n", path);
+    return error;
+}
+
+FileSystemError filesystem_pwd(FileSystemHandle* handle, char* buffer, size_t size)
 {
     debug_printf("pwd\n");
-    pthread_rwlock_rdlock(&f->rwlock);
-    printf("%s\n", f->pwd);
-    pthread_rwlock_unlock(&f->rwlock);
+    auto error = FS_OK;
+    auto locks = filesystem_lock_cwd(handle, false);
+    if (handle->cwd->pwd_offset + 1 > size) {
+        error = FS_ERROR_BUFFER_TOO_SMALL;
+    } else {
+        memcpy(buffer, handle->cwd->pwd, handle->cwd->pwd_offset + 1);
+    }
+    filesystem_unlock(locks);
     debug_printf("pwd unlocked\n");
+    return error;
+}
+
+FileSystemError filesystem_op_mkdir(FileSystemNode* dir, const char* name)
+{
+    /* parent为nullptr时会创建根目录 */
+    if (dir == nullptr)
+        return FS_ERROR_NOT_EXIST;
+    return filesystem_node_create(dir, FS_NODE_DIRECTORY, name, nullptr, nullptr);
 }
 
-void mkdir(const char* name)
+FileSystemError filesystem_mkdir(FileSystemHandle* handle, const char* name)
 {
     debug_printf("mkdir %s\n", name);
-    pthread_rwlock_wrlock(&f->rwlock);
-    filesystem_node_create(f->cur_dir, Directory, name, nullptr);
-    pthread_rwlock_unlock(&f->rwlock);
+    auto locks = filesystem_lock_cwd(handle, true);
+    auto error = filesystem_op_mkdir(handle->cwd->dir, name);
+    filesystem_unlock(locks);
     debug_printf("mkdir unlocked\n");
+    return error;
 }
 
-void rmdir(const char* name)
+FileSystemError filesystem_op_rmdir(FileSystemNode* dir, const char* name)
 {
-    debug_printf("rmdir %s\n", name);
-    pthread_rwlock_wrlock(&f->rwlock);
     // 搜索node
-    auto subnode = filesystem_node_get_subnode(f->cur_dir, Directory, name);
-    if (subnode == nullptr) {
-        printf("rmdir error, dir \"%s\" not exist!", name);
-    } else {
-        filesystem_node_destroy(subnode);
-    }
-    pthread_rwlock_unlock(&f->rwlock);
+    auto subnode = filesystem_node_get_subnode(dir, FS_NODE_DIRECTORY, name);
+    if (subnode == nullptr)
+        return FS_ERROR_NOT_EXIST;
+    filesystem_node_destroy(subnode);
+    return FS_OK;
+}
+
+FileSystemError filesystem_rmdir(FileSystemHandle* handle, const char* name)
+{
+    debug_printf("rmdir %s\n", name);
+    auto locks = filesystem_lock_cwd(handle, true);
+    /* 根目录下的子目录在其他分片中，删除前还需要获取该分片的写锁 */
+    auto subnode = filesystem_node_get_subnode(handle->cwd->dir, FS_NODE_DIRECTORY, name);
+    if (subnode != nullptr)
+        filesystem_lock_node(&locks, subnode);
+    auto error = filesystem_op_rmdir(handle->cwd->dir, name);
+    filesystem_unlock(locks);
     debug_printf("rmdir unlocked\n");
+    return error;
+}
+
+static void _dir_entry_fill(FileSystemDirEntry* entry, const FileSystemNode* node)
+{
+    strcpy(entry->name, node->name);
+    entry->type = node->type;
 }
 
-void ls()
+FileSystemError filesystem_ls(FileSystemHandle* handle, FileSystemDirEntry* entries, size_t capacity, size_t* count)
 {
     debug_printf("ls\n");
-    pthread_rwlock_rdlock(&f->rwlock);
-    auto subnode_list = (CList*)f->cur_dir->data;
+    size_t total = 0;
+    auto locks = filesystem_lock_cwd(handle, false);
+    if (handle->cwd->dir == nullptr) {
+        filesystem_unlock(locks);
+        return FS_ERROR_NOT_EXIST;
+    }
+    auto subnode_list = (CList*)handle->cwd->dir->data;
     for (auto it = clist_begin(subnode_list); it != clist_end(subnode_list); it = clist_iterator_next(it)) {
         auto subnode = (FileSystemNode*)clist_iterator_get(it);
-        if (subnode == nullptr)
-            continue;
-        printf("%s  type=%s\n", subnode->name, FileSystemNodeTypeNames[subnode->type]);
+        if (total < capacity)
+            _dir_entry_fill(&entries[total], subnode);
+        ++total;
     }
-    pthread_rwlock_unlock(&f->rwlock);
+    filesystem_unlock(locks);
+    *count = total;
     debug_printf("ls unlocked\n");
+    return total > capacity ? FS_ERROR_BUFFER_TOO_SMALL : FS_OK;
 }
 
-void create_file(const char* name, const char* data)
+/**
+ * 有序列出目录时的遍历状态
+ */
+typedef struct LsSortedContext
 {
-    debug_printf("create_file %s\n", name);
-    pthread_rwlock_wrlock(&f->rwlock);
+    const char* prefix; /* 名称前缀，为nullptr时不过滤 */
+    size_t prefix_size;
+    FileSystemDirEntry* entries;
+    size_t capacity;
+    size_t count; /* 已写入的条目数 */
+} LsSortedContext;
+
+static bool _ls_sorted_visit(void* item, void* ctx)
+{
+    auto node = (FileSystemNode*)item;
+    auto context = (LsSortedContext*)ctx;
+    if (context->count >= context->capacity)
+        return false;
+    /* 按序遍历，前缀不再匹配之后的节点都不会匹配 */
+    if (context->prefix != nullptr && strncmp(node->name, context->prefix, context->prefix_size) != 0)
+        return false;
+    _dir_entry_fill(&context->entries[context->count++], node);
+    return true;
+}
+
+static int _node_qsort_compare(const void* a, const void* b)
+{
+    auto node = *(FileSystemNode* const*)a;
+    FileSystemNodeKey key = {node->name, node->type};
+    return filesystem_node_key_compare(&key, *(FileSystemNode* const*)b);
+}
+
+FileSystemError filesystem_ls_sorted(FileSystemHandle* handle, const char* prefix, const FileSystemDirEntry* after,
+                                     FileSystemDirEntry* entries, size_t capacity, size_t* count)
+{
+    debug_printf("ls_sorted\n");
+    LsSortedContext context = {prefix, prefix == nullptr ? 0 : strlen(prefix), entries, capacity, 0};
+    /* 起始位置取前缀的下界和after之后的第一个位置中较大的一个, 类型是连续的整数，after的下一个位置即类型加一 */
+    FileSystemNodeKey key = {prefix == nullptr ? "" : prefix, FS_NODE_UNKNOWN};
+    if (after != nullptr) {
+        FileSystemNodeKey after_key = {after->name, after->type + 1};
+        if (strcmp(after_key.name, key.name) >= 0)
+            key = after_key;
+    }
+
+    auto error = FS_OK;
+    auto locks = filesystem_lock_cwd(handle, false);
+    auto dir = handle->cwd->dir;
+    if (dir == nullptr) {
+        error = FS_ERROR_NOT_EXIST;
+    } else if (dir->index != nullptr) {
+        cbtree_foreach_from(dir->index, &key, filesystem_node_key_compare, _ls_sorted_visit, &context);
+    } else {
+        /* 未启用索引的目录，只能取出所有子节点排序后再输出 */
+        auto subnode_list = (CList*)dir->data;
+        auto subnodes = (FileSystemNode**)malloc(clist_size(subnode_list) * sizeof(FileSystemNode*) + 1);
+        if (subnodes == nullptr) {
+            error = FS_ERROR_NO_MEMORY;
+        } else {
+            size_t subnode_count = 0;
+            for (auto it = clist_begin(subnode_list); it != clist_end(subnode_list); it = clist_iterator_next(it)) {
+                subnodes[subnode_count++] = (FileSystemNode*)clist_iterator_get(it);
+            }
+            qsort(subnodes, subnode_count, sizeof(FileSystemNode*), _node_qsort_compare);
+            for (size_t i = 0; i < subnode_count; ++i) {
+                if (filesystem_node_key_compare(&key, subnodes[i]) > 0)
+                    continue;
+                if (!_ls_sorted_visit(subnodes[i], &context))
+                    break;
+            }
+            free(subnodes);
+        }
+    }
+    filesystem_unlock(locks);
+    *count = context.count;
+    debug_printf("ls_sorted unlocked\n");
+    return error;
+}
+
+/**
+ * 把树节点的所有者设为ctx中的索引
+ */
+static void _index_adopt(void** slot, void* ctx)
+{
+    filesystem_memory_set_owner(*slot, ctx);
+}
+
+FileSystemError filesystem_index_dir(FileSystemHandle* handle, const char* name)
+{
+    debug_printf("index_dir %s\n", name);
+    auto error = FS_OK;
+    auto locks = filesystem_lock_cwd(handle, true);
+    auto cur_dir = handle->cwd->dir;
+    auto dir = strcmp(name, ".") == 0 ? cur_dir : filesystem_node_get_subnode(cur_dir, FS_NODE_DIRECTORY, name);
+    if (dir == nullptr) {
+        error = FS_ERROR_NOT_EXIST;
+    } else if (dir->index == nullptr) {
+        /* 索引分配在目录所在的分片中，并将已有的子节点全部插入索引 */
+        filesystem_lock_node(&locks, dir);
+        filesystem_use_node(dir);
+        auto index = cbtree_create();
+        if (index != nullptr) {
+            /* 索引属于目录，树节点属于索引，包括创建时分配的根节点 */
+            cbtree_relocate(index, _index_adopt, nullptr, index);
+            filesystem_use_index(index);
+        }
+        auto subnode_list = (CList*)dir->data;
+        for (auto it = clist_begin(subnode_list); index != nullptr && it != clist_end(subnode_list);
+             it = clist_iterator_next(it)) {
+            auto subnode = (FileSystemNode*)clist_iterator_get(it);
+            FileSystemNodeKey key = {subnode->name, subnode->type};
+            /* 同一目录中没有同名同类型的节点，插入失败只能是内存不足，放弃整个索引 */
+            if (!cbtree_insert(index, subnode, &key, filesystem_node_key_compare)) {
+                cbtree_destroy(index);
+                index = nullptr;
+            }
+        }
+        dir->index = index;
+        if (index == nullptr)
+            error = FS_ERROR_NO_MEMORY;
+    }
+    filesystem_unlock(locks);
+    debug_printf("index_dir unlocked\n");
+    return error;
+}
+
+FileSystemError filesystem_du(FileSystemHandle* handle, const char* name, FileSystemUsage* usage,
+                              FileSystemUsage* quota)
+{
+    debug_printf("du %s\n", name);
+    auto error = FS_OK;
+    auto locks = filesystem_lock_cwd(handle, false);
+    auto cur_dir = handle->cwd->dir;
+    auto dir = strcmp(name, ".") == 0 ? cur_dir : filesystem_node_get_subnode(cur_dir, FS_NODE_DIRECTORY, name);
+    if (dir == nullptr) {
+        error = FS_ERROR_NOT_EXIST;
+    } else {
+        usage->bytes = atomic_load(&dir->usage_bytes);
+        usage->entries = atomic_load(&dir->usage_entries);
+        if (quota != nullptr)
+            *quota = dir->quota;
+    }
+    filesystem_unlock(locks);
+    debug_printf("du unlocked\n");
+    return error;
+}
+
+FileSystemError filesystem_set_quota(FileSystemHandle* handle, const char* name, const FileSystemUsage* quota)
+{
+    debug_printf("set_quota %s\n", name);
+    auto error = FS_OK;
+    auto locks = filesystem_lock_cwd(handle, true);
+    auto cur_dir = handle->cwd->dir;
+    auto dir = strcmp(name, ".") == 0 ? cur_dir : filesystem_node_get_subnode(cur_dir, FS_NODE_DIRECTORY, name);
+    if (dir == nullptr) {
+        error = FS_ERROR_NOT_EXIST;
+    } else {
+        /* 检查配额的写者至少持有目录所在分片的读锁 */
+        filesystem_lock_node(&locks, dir);
+        dir->quota = *quota;
+    }
+    filesystem_unlock(locks);
+    debug_printf("set_quota unlocked\n");
+    return error;
+}
+
+/**
+ * 在目录所在的分片中复制一份文件数据，放入文件节点后需要修改所有者
+ * @param length 数据的长度，不含'\0'
+ * @return 复制后的数据，共享内存不足时返回nullptr
+ */
+static char* _file_data_create(FileSystemNode* dir, const char* data, size_t length)
+{
+    filesystem_use_node(dir);
+    auto file_data = (char*)alloc_memory(length + 1);
+    if (file_data != nullptr) {
+        memcpy(file_data, data, length);
+        file_data[length] = '\0';
+    }
+    return file_data;
+}
+
+FileSystemError filesystem_op_create_file(FileSystemNode* dir, const char* name, const char* data,
+                                          FileSystemNode** node)
+{
+    return filesystem_op_create_file_sized(dir, name, data, data == nullptr ? 0 : strlen(data), node);
+}
+
+FileSystemError filesystem_op_create_file_sized(FileSystemNode* dir, const char* name, const char* data,
+                                                size_t length, FileSystemNode** node)
+{
+    if (dir == nullptr)
+        return FS_ERROR_NOT_EXIST;
     // 为文件内存分配空间
     char* file_data = nullptr;
     if (data != nullptr) {
-        auto file_size = strlen(data) + 4;
-        file_data = (char*)alloc_memory(file_size);
-        strcpy(file_data, data);
+        filesystem_tier_reserve(filesystem_shard_of(dir), length + 1);
+        file_data = _file_data_create(dir, data, length);
+        if (file_data == nullptr)
+            return FS_ERROR_NO_MEMORY;
     }
-    filesystem_node_create(f->cur_dir, File, name, (void*)file_data);
-    pthread_rwlock_unlock(&f->rwlock);
+    FileSystemNode* new_node = nullptr;
+    auto error = filesystem_node_create(dir, FS_NODE_FILE, name, (void*)file_data, &new_node);
+    if (error != FS_OK) {
+        free_memory(file_data);
+        return error;
+    }
+    filesystem_tier_track(new_node);
+    if (node != nullptr)
+        *node = new_node;
+    return FS_OK;
+}
+
+FileSystemError filesystem_create_file(FileSystemHandle* handle, const char* name, const char* data)
+{
+    debug_printf("create_file %s\n", name);
+    auto locks = filesystem_lock_cwd(handle, true);
+    auto error = filesystem_op_create_file(handle->cwd->dir, name, data, nullptr);
+    filesystem_unlock(locks);
     debug_printf("create_file unlocked\n");
+    return error;
 }
 
-void alter_file(const char* name, const char* data)
+FileSystemError filesystem_op_alter_file(FileSystemNode* dir, const char* name, const char* data, void** old_data)
 {
-    debug_printf("alter_file %s\n", name);
-    pthread_rwlock_wrlock(&f->rwlock);
-    auto subnode = filesystem_node_get_subnode(f->cur_dir, File, name);
-    if (subnode == nullptr) {
-        printf("alter_file error, dir \"%s\" not exist!", name);
+    auto subnode = filesystem_node_get_subnode(dir, FS_NODE_FILE, name);
+    if (subnode == nullptr)
+        return FS_ERROR_NOT_EXIST;
+    // todo 修改内容较短的情况下可以复用
+    // 事务回滚需要原数据，已换出时先调回
+    if (old_data != nullptr && subnode->spilled) {
+        auto error = filesystem_tier_fault(subnode);
+        if (error != FS_OK)
+            return error;
+    }
+    // 内容变长时先计入祖先的用量，超过配额时不分配
+    auto old_size = filesystem_node_usage(subnode).bytes;
+    auto new_size = strlen(data);
+    if (new_size > old_size) {
+        auto error = filesystem_usage_add(dir, (FileSystemUsage){new_size - old_size, 0}, true);
+        if (error != FS_OK)
+            return error;
+    }
+    // 先复制新的数据到内存，失败时保留原数据，腾出空间时不能换出正在修改的文件
+    filesystem_tier_untrack(subnode);
+    filesystem_tier_reserve(filesystem_shard_of(dir), new_size + 1);
+    auto file_data = _file_data_create(dir, data, new_size);
+    if (file_data == nullptr) {
+        if (new_size > old_size)
+            filesystem_usage_sub(dir, (FileSystemUsage){new_size - old_size, 0});
+        filesystem_tier_track(subnode);
+        return FS_ERROR_NO_MEMORY;
+    }
+    if (new_size < old_size)
+        filesystem_usage_sub(dir, (FileSystemUsage){old_size - new_size, 0});
+    filesystem_trigrams_remove(subnode);
+    filesystem_tier_discard(subnode);
+    if (old_data != nullptr) {
+        *old_data = subnode->data;
     } else {
-        // todo 修改内容较短的情况下可以复用
-        auto old_data = (char*)subnode->data;
-        free_memory(old_data);
-        // 复制新的数据到内存
-        auto data_size = strlen(data) + 4;
-        auto file_data = (char*)alloc_memory(data_size);
-        strcpy(file_data, data);
-        subnode->data = (void*)file_data;
-    }
-    pthread_rwlock_unlock(&f->rwlock);
+        free_memory(subnode->data);
+    }
+    subnode->data = (void*)file_data;
+    filesystem_memory_set_owner(file_data, subnode);
+    filesystem_trigrams_add(subnode);
+    filesystem_tier_track(subnode);
+    filesystem_node_changed(subnode);
+    return FS_OK;
+}
+
+FileSystemError filesystem_alter_file(FileSystemHandle* handle, const char* name, const char* data)
+{
+    debug_printf("alter_file %s\n", name);
+    auto locks = filesystem_lock_cwd(handle, true);
+    auto error = filesystem_op_alter_file(handle->cwd->dir, name, data, nullptr);
+    filesystem_unlock(locks);
     debug_printf("alter_file unlocked\n");
+    return error;
 }
 
-void read_file(const char* name)
+FileSystemError filesystem_read_file(FileSystemHandle* handle, const char* name, char* buffer, size_t size,
+                                     size_t* length)
 {
     debug_printf("read_file %s\n", name);
-    pthread_rwlock_wrlock(&f->rwlock);
-    auto subnode = filesystem_node_get_subnode(f->cur_dir, File, name);
+    auto error = FS_OK;
+    auto locks = filesystem_lock_cwd(handle, false);
+    auto subnode = filesystem_node_get_subnode(handle->cwd->dir, FS_NODE_FILE, name);
+    if (subnode != nullptr && subnode->spilled) {
+        /* 内容已换出到后备文件，改为持有写锁后调回，期间文件可能已被修改或删除，需要重新查找 */
+        filesystem_unlock(locks);
+        locks = filesystem_lock_cwd(handle, true);
+        subnode = filesystem_node_get_subnode(handle->cwd->dir, FS_NODE_FILE, name);
+        if (subnode != nullptr && subnode->spilled)
+            error = filesystem_tier_fault(subnode);
+    } else if (subnode != nullptr) {
+        filesystem_tier_touch(subnode);
+    }
     if (subnode == nullptr) {
-        printf("read_file error, dir \"%s\" not exist!", name);
-    } else {
-        auto data = (char*)subnode->data;
-        if (data == nullptr) {
-            printf("\n");
+        error = FS_ERROR_NOT_EXIST;
+    } else if (error == FS_OK) {
+        auto data = subnode->data == nullptr ? "" : (const char*)subnode->data;
+        *length = strlen(data);
+        if (*length + 1 > size) {
+            error = FS_ERROR_BUFFER_TOO_SMALL;
         } else {
-            printf("%s\n", data);
+            memcpy(buffer, data, *length + 1);
         }
     }
-    pthread_rwlock_unlock(&f->rwlock);
+    filesystem_unlock(locks);
     debug_printf("read_file unlocked\n");
+    return error;
+}
+
+FileSystemError filesystem_op_remove_file(FileSystemNode* dir, const char* name)
+{
+    auto subnode = filesystem_node_get_subnode(dir, FS_NODE_FILE, name);
+    if (subnode == nullptr)
+        return FS_ERROR_NOT_EXIST;
+    filesystem_node_destroy(subnode);
+    return FS_OK;
 }
 
-void remove_file(const char* name)
+FileSystemError filesystem_remove_file(FileSystemHandle* handle, const char* name)
 {
     debug_printf("remove_file %s\n", name);
-    pthread_rwlock_wrlock(&f->rwlock);
-    auto subnode = filesystem_node_get_subnode(f->cur_dir, File, name);
-    if (subnode == nullptr) {
-        printf("remove_file error, dir \"%s\" not exist!", name);
-    } else {
-        filesystem_node_destroy(subnode);
-    }
-    pthread_rwlock_unlock(&f->rwlock);
+    auto locks = filesystem_lock_cwd(handle, true);
+    auto error = filesystem_op_remove_file(handle->cwd->dir, name);
+    filesystem_unlock(locks);
     debug_printf("remove_file unlocked\n");
+    return error;
+}
+
+static long _elapsed_ms(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+FileSystemError filesystem_watch(FileSystemHandle* handle, const char* name, FileSystemNodeType type, uint32_t* seq,
+                                 int timeout_ms)
+{
+    debug_printf("watch %s\n", name);
+    auto locks = filesystem_lock_cwd(handle, false);
+    auto cur_dir = handle->cwd->dir;
+    auto node = strcmp(name, ".") == 0 ? cur_dir : filesystem_node_get_subnode(cur_dir, type, name);
+    if (node == nullptr || node->type != type) {
+        filesystem_unlock(locks);
+        return FS_ERROR_NOT_EXIST;
+    }
+    auto current = atomic_load(&node->seq);
+    if (current != *seq || timeout_ms == 0) {
+        filesystem_unlock(locks);
+        auto error = current != *seq ? FS_OK : FS_ERROR_TIMEOUT;
+        *seq = current;
+        return error;
+    }
+    /* 持有锁时登记等待者，之后节点即使被摧毁也要等最后一个等待者离开才会释放，整理内存时也不会被移动 */
+    atomic_fetch_add(&node->watchers, 1);
+    filesystem_unlock(locks);
+    debug_printf("watch unlocked\n");
+
+    /* 被唤醒后序号可能没有变化，剩余时间内继续等待 */
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    auto remaining = timeout_ms;
+    while (atomic_load(&node->seq) == current && remaining != 0) {
+        filesystem_futex_wait(&node->seq, current, remaining);
+        if (timeout_ms > 0) {
+            auto elapsed = _elapsed_ms(&start);
+            remaining = elapsed >= timeout_ms ? 0 : timeout_ms - (int)elapsed;
+        }
+    }
+    *seq = atomic_load(&node->seq);
+
+    /* 离开后不能再访问节点，已摧毁的节点由分片的写者回收 */
+    if (atomic_fetch_sub(&node->watchers, 1) & FILESYSTEM_NODE_DEAD)
+        return FS_ERROR_NOT_EXIST;
+    return *seq != current ? FS_OK : FS_ERROR_TIMEOUT;
 }
@@ -10,27 +10,368 @@
 #ifndef MYFILESYSTEM_H
 #define MYFILESYSTEM_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+constexpr size_t FILESYSTEM_NODE_NAME_SIZE = 100;
+constexpr size_t FILESYSTEM_PWD_SIZE = FILESYSTEM_NODE_NAME_SIZE * 10;
+
+/**
+ * 打开文件系统的选项
+ */
+constexpr int FILESYSTEM_OPEN_SHARED_CWD = 1; /* 使用存放在共享内存中的当前目录，所有以此方式打开的句柄共享同一个当前目录 */
+
+/* 最多的分片数，每个分片是一块独立的共享内存，有自己的锁和分配器 */
+constexpr size_t FILESYSTEM_SHARD_MAX = 8;
+
+typedef enum FileSystemNodeType
+{
+    FS_NODE_UNKNOWN = -1,
+    FS_NODE_FILE = 0,
+    FS_NODE_DIRECTORY,
+} FileSystemNodeType;
+
+/**
+ * 所有接口的返回值，不会向标准输出打印任何内容，由调用者决定如何报告错误
+ */
+typedef enum FileSystemError
+{
+    FS_OK = 0,
+    FS_ERROR_NOT_EXIST, /* 文件或目录不存在 */
+    FS_ERROR_EXIST, /* 已有同名同类型节点 */
+    FS_ERROR_INVALID_ARGUMENT, /* 参数不合法，例如名称过长或包含路径分隔符 */
+    FS_ERROR_NO_MEMORY, /* 共享内存已用完 */
+    FS_ERROR_BUFFER_TOO_SMALL, /* 调用者提供的缓冲区不足 */
+    FS_ERROR_SYSTEM, /* 系统调用失败，详细原因见errno */
+    FS_ERROR_BUSY, /* 队列已满或没有空闲的队列，稍后重试 */
+    FS_ERROR_TIMEOUT, /* 等待超时 */
+    FS_ERROR_QUOTA, /* 超过目录的配额 */
+} FileSystemError;
+
+/**
+ * 文件系统句柄，每个句柄有自己的当前目录
+ * 所有接口都是线程安全的，多个线程可以共用同一个句柄，也可以各自打开句柄
+ */
+typedef struct FileSystemHandle FileSystemHandle;
+
+/**
+ * 列出目录时返回的条目
+ */
+typedef struct FileSystemDirEntry
+{
+    char name[FILESYSTEM_NODE_NAME_SIZE];
+    FileSystemNodeType type;
+} FileSystemDirEntry;
+
+/**
+ * 目录子树的用量或配额
+ */
+typedef struct FileSystemUsage
+{
+    size_t bytes; /* 子树中所有文件内容的字节数，不含结尾的'\0' */
+    size_t entries; /* 子树中的文件和目录数，不含目录自身 */
+} FileSystemUsage;
+
+/**
+ * 搜索文件内容时的一个匹配
+ */
+typedef struct FileSystemGrepMatch
+{
+    char path[FILESYSTEM_PWD_SIZE]; /* 相对于搜索目录的路径 */
+    size_t offset; /* 第一次出现的位置 */
+} FileSystemGrepMatch;
+
+/**
+ * 搜索文件内容时的统计
+ */
+typedef struct FileSystemGrepStats
+{
+    size_t files; /* 子树中的文件数 */
+    size_t scanned; /* 经过三元组倒排索引过滤后实际扫描的文件数 */
+    size_t bytes; /* 实际扫描的字节数 */
+} FileSystemGrepStats;
+
+/**
+ * 与宿主机之间导入导出时的统计
+ */
+typedef struct FileSystemTransferStats
+{
+    size_t files;
+    size_t directories;
+    size_t bytes; /* 文件内容的总字节数 */
+    size_t skipped; /* 无法表示而跳过的条目，例如名称过长、无法读取的文件、符号链接和设备文件 */
+} FileSystemTransferStats;
+
+/**
+ * 分层存储的统计，除allocated外都是启用以来的累计值
+ */
+typedef struct FileSystemTierStats
+{
+    size_t hits; /* 读取文件时内容在共享内存中的次数 */
+    size_t misses; /* 访问文件时内容已换出、需要从后备文件调回的次数 */
+    size_t spills; /* 换出的文件数 */
+    size_t spilled_bytes; /* 换出的字节数 */
+    size_t backing_bytes; /* 当前保存在后备文件中的字节数 */
+    size_t allocated; /* 所有分片当前已分配的共享内存字节数 */
+} FileSystemTierStats;
+
+const char* filesystem_strerror(FileSystemError error);
+const char* filesystem_node_type_name(FileSystemNodeType type);
+
+/**
+ * 打开文件系统，共享内存不存在时创建并初始化
+ * @param key_path 用于生成共享内存key的路径，必须是已存在的文件
+ * @param flags FILESYSTEM_OPEN_*选项
+ * @param handle 输出的句柄
+ */
+FileSystemError filesystem_open(const char* key_path, int flags, FileSystemHandle** handle);
+/**
+ * 打开文件系统，共享内存不存在时创建shard_count个分片
+ * 根目录下的各个目录按名称的哈希分布到不同分片，整棵子树都在同一个分片中，不同分片中的写操作可以并行
+ * 分片对调用者透明，cd等路径操作可以跨分片
+ * @param shard_count 分片数，1到FILESYSTEM_SHARD_MAX，文件系统已存在时忽略，以创建时的分片数为准
+ */
+FileSystemError filesystem_open_sharded(const char* key_path, int flags, size_t shard_count,
+                                        FileSystemHandle** handle);
+/**
+ * 获取文件系统的分片数
+ */
+size_t filesystem_shard_count(FileSystemHandle* handle);
+/**
+ * 关闭句柄，不会销毁共享内存
+ */
+void filesystem_close(FileSystemHandle* handle);
+/**
+ * 销毁共享内存并关闭句柄
+ * @param force 为false时等待正在进行的操作结束后再销毁
+ */
+void filesystem_destroy(FileSystemHandle* handle, bool force);
+
+FileSystemError filesystem_cd(FileSystemHandle* handle, const char* path);
+/**
+ * 获取当前目录的路径
+ * @param buffer 调用者提供的缓冲区，FILESYSTEM_PWD_SIZE大小一定足够
+ */
+FileSystemError filesystem_pwd(FileSystemHandle* handle, char* buffer, size_t size);
+FileSystemError filesystem_mkdir(FileSystemHandle* handle, const char* name);
+FileSystemError filesystem_rmdir(FileSystemHandle* handle, const char* name);
+/**
+ * 按插入顺序列出当前目录
+ * @param entries 调用者提供的条目数组
+ * @param capacity entries的大小
+ * @param count 输出条目总数，大于capacity时只写入前capacity个并返回FS_ERROR_BUFFER_TOO_SMALL
+ */
+FileSystemError filesystem_ls(FileSystemHandle* handle, FileSystemDirEntry* entries, size_t capacity, size_t* count);
+/**
+ * 按(名称, 类型)有序列出当前目录，启用了索引的目录复杂度为O(log n + k)
+ * @param prefix 只列出以prefix开头的条目，为nullptr时不过滤
+ * @param after 只列出排在after之后的条目，用于分页，传入上一页的最后一个条目即可，为nullptr时从头开始
+ * @param entries 调用者提供的条目数组，写满后停止
+ * @param capacity entries的大小
+ * @param count 输出实际写入的条目数
+ */
+FileSystemError filesystem_ls_sorted(FileSystemHandle* handle, const char* prefix, const FileSystemDirEntry* after,
+                                     FileSystemDirEntry* entries, size_t capacity, size_t* count);
+/**
+ * 为目录启用有序索引(B树)，之后该目录的查找和有序列出都走索引
+ * @param name 子目录名，为"."时表示当前目录
+ * @return 共享内存不足时返回FS_ERROR_NO_MEMORY，目录仍然没有索引
+ */
+FileSystemError filesystem_index_dir(FileSystemHandle* handle, const char* name);
 /**
- *
+ * @param data 文件内容，为nullptr时创建空文件
  */
-typedef struct FileSystem FileSystem;
+FileSystemError filesystem_create_file(FileSystemHandle* handle, const char* name, const char* data);
+FileSystemError filesystem_alter_file(FileSystemHandle* handle, const char* name, const char* data);
+/**
+ * 读取文件内容到调用者提供的缓冲区，内容以'\0'结尾
+ * @param length 输出文件内容的长度(不含'\0')，缓冲区不足时返回FS_ERROR_BUFFER_TOO_SMALL，可按length + 1重新分配后再读
+ */
+FileSystemError filesystem_read_file(FileSystemHandle* handle, const char* name, char* buffer, size_t size,
+                                     size_t* length);
+FileSystemError filesystem_remove_file(FileSystemHandle* handle, const char* name);
+/**
+ * 等待节点发生变化，目录的变化指子节点的创建和删除，文件的变化指内容修改，节点被删除时也会唤醒
+ * 等待时不持有锁，不需要轮询
+ * @param name 节点名，为"."时表示当前目录
+ * @param seq 输入上次看到的变化序号，与当前序号不同时立即返回，输出当前序号
+ * @param timeout_ms 超时时间，小于0时一直等待，为0时只获取当前序号
+ * @return 超时返回FS_ERROR_TIMEOUT，节点不存在或等待期间被删除时返回FS_ERROR_NOT_EXIST
+ */
+FileSystemError filesystem_watch(FileSystemHandle* handle, const char* name, FileSystemNodeType type, uint32_t* seq,
+                                 int timeout_ms);
+/**
+ * 获取目录子树的用量，用量在修改时沿父节点链更新，复杂度O(1)
+ * @param name 子目录名，为"."时表示当前目录
+ * @param usage 输出子树的用量
+ * @param quota 输出目录的配额，可以为nullptr
+ */
+FileSystemError filesystem_du(FileSystemHandle* handle, const char* name, FileSystemUsage* usage,
+                              FileSystemUsage* quota);
+/**
+ * 设置目录的配额，之后子树中任何使用量增加的操作超过配额时返回FS_ERROR_QUOTA，不影响已有的内容
+ * @param name 子目录名，为"."时表示当前目录
+ * @param quota 配额，为0的项不限制
+ */
+FileSystemError filesystem_set_quota(FileSystemHandle* handle, const char* name, const FileSystemUsage* quota);
+/**
+ * 为目录子树启用三元组倒排索引，每个目录为其中的文件记录每个三元组出现在哪些文件中
+ * 已有的文件立即编入索引，之后创建、修改和删除文件时维护，新建的子目录继承
+ * 搜索时只扫描模式串的所有三元组都出现过的文件，模式串短于3个字节时扫描所有文件
+ * 对已启用的目录再次调用时重建因共享内存不足而不完整的索引
+ * @param name 子目录名，为"."时表示当前目录
+ * @return 共享内存不足时返回FS_ERROR_NO_MEMORY，没有编入索引的目录搜索时仍然扫描所有文件
+ */
+FileSystemError filesystem_trigram_index(FileSystemHandle* handle, const char* name);
+/**
+ * 在目录子树中搜索内容包含pattern的文件，直接在共享内存中用SIMD扫描，多个线程并行
+ * @param name 子目录名，为"."时表示当前目录
+ * @param pattern 模式串，不能为空
+ * @param matches 调用者提供的匹配数组，按深度优先的顺序写入，使用倒排索引的目录中文件的顺序不固定
+ * @param capacity matches的大小
+ * @param count 输出匹配总数，大于capacity时只写入前capacity个并返回FS_ERROR_BUFFER_TOO_SMALL
+ * @param stats 输出统计，可以为nullptr
+ */
+FileSystemError filesystem_grep(FileSystemHandle* handle, const char* name, const char* pattern,
+                                FileSystemGrepMatch* matches, size_t capacity, size_t* count,
+                                FileSystemGrepStats* stats);
+/**
+ * 将宿主机目录导入为当前目录下的子目录
+ * 先遍历宿主机目录累计文件大小，超过配额或者目标分片剩余的共享内存(启用分层存储时只计节点和不能换出的小文件)时
+ * 直接失败，不读入任何文件；再用多个线程映射并读入文件，最后在一次加锁中建立整棵子树，失败时删除已导入的部分
+ * 文件内容以'\0'结尾保存，内容中有'\0'时只保留之前的部分
+ * @param host_path 宿主机目录的路径
+ * @param name 新建的子目录名，已存在时返回FS_ERROR_EXIST
+ * @param stats 输出统计，可以为nullptr
+ * @return 宿主机文件系统出错时返回FS_ERROR_SYSTEM，详细原因见errno
+ */
+FileSystemError filesystem_import(FileSystemHandle* handle, const char* host_path, const char* name,
+                                  FileSystemTransferStats* stats);
+/**
+ * 将目录子树导出到宿主机目录，目录不存在时创建，同名文件会被覆盖
+ * 导出期间持有子树所在分片的读锁，多个线程并行写入文件
+ * @param name 子目录名，为"."时表示当前目录
+ * @param host_path 宿主机目录的路径
+ * @param stats 输出统计，可以为nullptr
+ * @return 宿主机文件系统出错时返回FS_ERROR_SYSTEM，详细原因见errno
+ */
+FileSystemError filesystem_export(FileSystemHandle* handle, const char* name, const char* host_path,
+                                  FileSystemTransferStats* stats);
 
-int debug_printf(const char* format, ...) __attribute__((format(printf, 1, 2)));
+/**
+ * 启用分层存储，分片中已分配的共享内存超过高水位时，把最近没有被读过的文件内容换出到后备文件
+ * 节点仍然留在共享内存中，读取时自动调回，访问记录使用时钟算法，每个文件只有一个访问位
+ * 已启用时只修改水位，后备文件随文件系统一起删除
+ * @param backing_path 后备文件在宿主机上的路径，不存在时创建，已启用时必须与之前相同，否则返回FS_ERROR_EXIST
+ * @param high_water 每个分片的高水位，不能超过分片大小
+ * @param low_water 换出到不超过该值为止，不能超过高水位
+ * @return 无法打开后备文件时返回FS_ERROR_SYSTEM
+ */
+FileSystemError filesystem_tier_enable(FileSystemHandle* handle, const char* backing_path, size_t high_water,
+                                       size_t low_water);
+FileSystemError filesystem_tier_stats(FileSystemHandle* handle, FileSystemTierStats* stats);
 
-// 为了防止递归加锁，这里加锁只在暴露的api的最外层加锁
-void filesystem_init(const char *program_path);
-void filesystem_deinit();
-void filesystem_force_deinit();
+/**
+ * 在线整理共享内存，将存活的节点和数据向分片开头移动，降低分配偏移量并把末尾的内存页还给操作系统
+ * 分多步进行，每一步只整理有限的字节数，两步之间释放锁，其他操作可以继续执行
+ * @param reclaimed 输出还给操作系统的字节数，可以为nullptr
+ * @return 进程内存不足时返回FS_ERROR_NO_MEMORY，已经完成的步骤仍然有效
+ */
+FileSystemError filesystem_defrag(FileSystemHandle* handle, size_t* reclaimed);
+/**
+ * 获取所有分片已分配的字节数，包括已释放但还没有整理的内存
+ */
+size_t filesystem_memory_usage(FileSystemHandle* handle);
+
+/* 共享内存中的队列个数，即可同时注册的客户端数 */
+constexpr size_t FILESYSTEM_RING_COUNT = 8;
+/* 每个队列的容量，必须是2的幂 */
+constexpr uint32_t FILESYSTEM_RING_ENTRIES = 32;
+/* 通过队列提交的文件内容的最大长度(含'\0')，更长的内容使用filesystem_create_file等接口 */
+constexpr size_t FILESYSTEM_RING_DATA_SIZE = 1024;
 
-void cd(const char *path);
-void pwd();
-void mkdir(const char *name);
-void rmdir(const char *name);
-void ls();
-void create_file(const char *name, const char *data);
-void alter_file(const char *name, const char *data);
-void read_file(const char *name);
-void remove_file(const char *name);
+typedef enum FileSystemRingOp
+{
+    FS_RING_OP_NOP = 0,
+    FS_RING_OP_CD,
+    FS_RING_OP_MKDIR,
+    FS_RING_OP_RMDIR,
+    FS_RING_OP_CREATE_FILE,
+    FS_RING_OP_ALTER_FILE,
+    FS_RING_OP_REMOVE_FILE,
+} FileSystemRingOp;
+
+/**
+ * 完成事件
+ */
+typedef struct FileSystemRingCompletion
+{
+    size_t user_data; /* 提交时传入的值 */
+    FileSystemRingOp op;
+    FileSystemError error;
+} FileSystemRingCompletion;
 
+/**
+ * 存放在共享内存中的提交/完成队列，客户端提交操作后不需要获取锁，由应用者批量执行
+ * 每个队列只能由一个线程提交和等待
+ */
+typedef struct FileSystemRing FileSystemRing;
+
+/**
+ * 注册一个队列，队列中操作的当前目录初始为句柄的当前目录，之后只受FS_RING_OP_CD影响
+ * @return 没有空闲队列时返回FS_ERROR_BUSY
+ */
+FileSystemError filesystem_ring_register(FileSystemHandle* handle, FileSystemRing** ring);
+/**
+ * 释放队列，调用前需要取出所有已提交操作的完成事件
+ */
+void filesystem_ring_unregister(FileSystemRing* ring);
+/**
+ * 提交一个操作，不会阻塞
+ * @param name 文件名或目录名，cd时为路径
+ * @param data 文件内容，只有创建和修改文件时使用
+ * @param user_data 原样返回到完成事件中
+ * @return 提交队列已满时返回FS_ERROR_BUSY
+ */
+FileSystemError filesystem_ring_submit(FileSystemRing* ring, FileSystemRingOp op, const char* name, const char* data,
+                                       size_t user_data);
+/**
+ * 取出一个完成事件
+ * @param wait 为true时没有完成事件则在futex上等待，否则立即返回FS_ERROR_BUSY
+ */
+FileSystemError filesystem_ring_reap(FileSystemRing* ring, FileSystemRingCompletion* completion, bool wait);
+/**
+ * 取出所有队列中的提交并执行，整批只获取一次所有分片的写锁
+ * @param max_batch 本批最多执行的操作数
+ * @param applied 输出实际执行的操作数
+ */
+FileSystemError filesystem_ring_apply(FileSystemHandle* handle, size_t max_batch, size_t* applied);
+/**
+ * 循环等待提交并批量执行，直到stop变为true
+ */
+FileSystemError filesystem_ring_serve(FileSystemHandle* handle, volatile bool* stop);
+
+/**
+ * 事务，暂存一组操作，提交时在一次加锁中按顺序全部执行，任何一步失败时全部回滚
+ * 其他句柄看不到执行到一半的状态，事务存放在进程内存中，只能由一个线程使用
+ */
+typedef struct FileSystemTxn FileSystemTxn;
+
+FileSystemError filesystem_txn_begin(FileSystemHandle* handle, FileSystemTxn** txn);
+/**
+ * 暂存一个操作，操作类型与提交队列相同
+ * cd只影响事务中之后的操作，不会改变句柄的当前目录
+ * @return 参数不合法时返回FS_ERROR_INVALID_ARGUMENT，已暂存的操作不受影响
+ */
+FileSystemError filesystem_txn_add(FileSystemTxn* txn, FileSystemRingOp op, const char* name, const char* data);
+/**
+ * 提交事务，无论成功与否都会释放事务
+ * @param failed_index 失败时输出失败操作的下标，不是某个操作失败时输出操作数，可以为nullptr
+ */
+FileSystemError filesystem_txn_commit(FileSystemTxn* txn, size_t* failed_index);
+/**
+ * 放弃并释放事务
+ */
+void filesystem_txn_abort(FileSystemTxn* txn);
 
 #endif //MYFILESYSTEM_H
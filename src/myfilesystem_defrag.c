@@ -0,0 +1,418 @@
+/**
+  ******************************************************************************
+  * @encoding  utf-8
+  * @file      myfilesystem_defrag.c
+  * @author    ZYX
+  * @brief     在线整理共享内存，将存活的内存块向分片开头滑动，降低分配偏移量并把末尾的内存页还给操作系统
+  ******************************************************************************
+  */
+
+#include "myfilesystem_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "clist.h"
+
+/* 每一步最多整理的字节数，限制每次持有锁的时间 */
+constexpr size_t DEFRAG_STEP_SIZE = 1024 * 1024;
+/* 每一步最多修正的指针数，同样限制每次持有锁的时间；需要修正的指针超过该值的内存块固定不动 */
+constexpr size_t DEFRAG_STEP_WORK = 64 * 1024;
+/* 移动一个节点时除了子节点和目录链表之外最多修正的指针数 */
+constexpr size_t DEFRAG_NODE_WORK = 16;
+
+/**
+ * 范围内一个存活的内存块和它移动后的地址，固定的内存块两者相同
+ */
+typedef struct DefragBlock
+{
+    char* block;
+    char* target;
+} DefragBlock;
+
+/**
+ * 一次指针修正，先用原来的指针收集全部修正再统一写入，收集时各个数据结构都保持原样
+ */
+typedef struct DefragWrite
+{
+    void** slot;
+    void* value;
+} DefragWrite;
+
+/**
+ * 一步整理的范围
+ * 通过所有者只找到指向范围内移动的内存块的指针，每一步的工作量不超过DEFRAG_STEP_SIZE和DEFRAG_STEP_WORK，
+ * 与目录的大小和整个文件系统的大小都无关
+ */
+typedef struct DefragWindow
+{
+    char* begin;
+    char* end;
+    DefragBlock* blocks; /* 按地址排序 */
+    size_t count;
+    DefragWrite* writes;
+    size_t write_count;
+    void* value; /* 正在收集的内存块移动后的地址 */
+} DefragWindow;
+
+static FileSystemMemoryMetadata* _block_metadata(const void* mem)
+{
+    return (FileSystemMemoryMetadata*)((char*)mem - sizeof(FileSystemMemoryMetadata));
+}
+
+static bool _in_window(const DefragWindow* window, const void* mem)
+{
+    if (mem == nullptr)
+        return false;
+    auto block = (char*)_block_metadata(mem);
+    return block >= window->begin && block < window->end;
+}
+
+static void _defrag_write(DefragWindow* window, void** slot, void* value)
+{
+    window->writes[window->write_count++] = (DefragWrite){slot, value};
+}
+
+/**
+ * 访问一个指向正在收集的内存块的指针，改为移动后的地址
+ */
+static void _defrag_slot(void** slot, void* ctx)
+{
+    auto window = (DefragWindow*)ctx;
+    _defrag_write(window, slot, window->value);
+}
+
+/**
+ * 访问一个指向正在收集的内存块所拥有的内存块的指针，把该内存块的所有者改为移动后的地址
+ */
+static void _defrag_owned_slot(void** slot, void* ctx)
+{
+    auto window = (DefragWindow*)ctx;
+    if (*slot != nullptr)
+        _defrag_write(window, &_block_metadata(*slot)->owner, window->value);
+}
+
+/**
+ * 所有者是节点自身的内存块是节点，否则所有者是节点时为节点的数据，是索引时为索引的树节点
+ */
+static bool _owner_is_node(const void* owner)
+{
+    return _block_metadata(owner)->owner == owner;
+}
+
+/**
+ * 移动内存块时最多需要修正的指针数
+ * @return 不能移动时返回SIZE_MAX：有等待者的节点和僵尸节点，子节点太多的目录和元素太多的索引
+ */
+static size_t _defrag_work(const void* mem, const void* owner)
+{
+    if (owner == mem) {
+        auto node = (const FileSystemNode*)mem;
+        if (node->type == FS_NODE_UNKNOWN || (atomic_load(&node->watchers) & ~FILESYSTEM_NODE_DEAD) != 0)
+            return SIZE_MAX;
+        if (node->type == FS_NODE_FILE)
+            return DEFRAG_NODE_WORK;
+        /* 每个子节点的parent，以及每个链表节点(含哨兵)的所有者，链表内部对每个链表节点访问两次 */
+        auto work = 3 * (clist_size(node->data) + 1) + DEFRAG_NODE_WORK;
+        return work > DEFRAG_STEP_WORK ? SIZE_MAX : work;
+    }
+    if (_owner_is_node(owner)) {
+        auto node = (const FileSystemNode*)owner;
+        size_t work = 4;
+        if (mem == node->index) {
+            /* 索引移动时还要修改所有树节点的所有者，树节点数不超过元素数加一 */
+            work = cbtree_size(node->index) + 2;
+        } else if (mem == node->postings) {
+            /* 倒排索引移动时还要修改两个数组和所有编号列表的所有者 */
+            work = node->postings->posting_count + 3;
+        }
+        return work > DEFRAG_STEP_WORK ? SIZE_MAX : work;
+    }
+    return 1;
+}
+
+/**
+ * 整理内存块时需要修正的指针数，空闲和固定的内存块为0
+ */
+static size_t _defrag_block_work(const char* block)
+{
+    auto metadata = (const FileSystemMemoryMetadata*)block;
+    if (metadata->owner == nullptr)
+        return 0;
+    auto work = _defrag_work(block + sizeof(FileSystemMemoryMetadata), metadata->owner);
+    return work == SIZE_MAX ? 0 : work;
+}
+
+/**
+ * 目录索引中元素之间的比较函数，用于从根节点找到树节点
+ */
+static int _defrag_item_compare(const void* key, const void* item)
+{
+    auto node = (const FileSystemNode*)key;
+    FileSystemNodeKey node_key = {node->name, node->type};
+    return filesystem_node_key_compare(&node_key, item);
+}
+
+/**
+ * 收集移动一个内存块时需要修正的指针，只读取原来的数据结构
+ */
+static void _defrag_collect(FileSystem* fs, FileSystemShard* shard, DefragWindow* window, void* mem, void* target)
+{
+    window->value = target;
+    auto owner = _block_metadata(mem)->owner;
+    if (owner == mem) {
+        auto node = (FileSystemNode*)mem;
+        _defrag_write(window, &_block_metadata(mem)->owner, target);
+        if (node->parent != nullptr) {
+            auto postings = node->parent->postings;
+            clist_relocate_data(node->link, _defrag_slot, window);
+            if (node->parent->index != nullptr)
+                cbtree_relocate_item(node->parent->index, node, _defrag_item_compare, _defrag_slot, window);
+            if (postings != nullptr && node->trigram_id != FILESYSTEM_TRIGRAM_NONE)
+                _defrag_slot((void**)&postings->files[node->trigram_id].file, window);
+        }
+        if (node->type == FS_NODE_DIRECTORY) {
+            auto subnode_list = (CList*)node->data;
+            for (auto it = clist_begin(subnode_list); it != clist_end(subnode_list); it = clist_iterator_next(it)) {
+                auto subnode = (FileSystemNode*)clist_iterator_get(it);
+                _defrag_write(window, (void**)&subnode->parent, target);
+            }
+            clist_relocate(subnode_list, _defrag_owned_slot, nullptr, window);
+            _defrag_owned_slot((void**)&node->index, window);
+            _defrag_owned_slot((void**)&node->postings, window);
+        }
+        _defrag_owned_slot(&node->data, window);
+        if (node->clock_next != nullptr) {
+            _defrag_slot((void**)&node->clock_prev->clock_next, window);
+            _defrag_slot((void**)&node->clock_next->clock_prev, window);
+        }
+        if (fs->root == node)
+            _defrag_slot((void**)&fs->root, window);
+        if (shard->clock_hand == node)
+            _defrag_slot((void**)&shard->clock_hand, window);
+        return;
+    }
+    if (!_owner_is_node(owner)) {
+        /* 所有者是目录的索引或者倒排索引 */
+        auto dir = (FileSystemNode*)_block_metadata(owner)->owner;
+        if (owner == dir->index) {
+            cbtree_relocate_node(dir->index, mem, _defrag_item_compare, _defrag_slot, window);
+            return;
+        }
+        auto postings = (FileSystemTrigramIndex*)owner;
+        if (mem == postings->files) {
+            _defrag_slot((void**)&postings->files, window);
+        } else if (mem == postings->buckets) {
+            _defrag_slot((void**)&postings->buckets, window);
+        } else {
+            auto posting = (FileSystemPosting*)mem;
+            _defrag_slot((void**)filesystem_posting_slot(postings, posting->trigram), window);
+        }
+        return;
+    }
+    auto node = (FileSystemNode*)owner;
+    if (mem == node->data) {
+        _defrag_slot(&node->data, window);
+    } else if (mem == node->index) {
+        _defrag_slot((void**)&node->index, window);
+        cbtree_relocate(node->index, _defrag_owned_slot, nullptr, window);
+    } else if (mem == node->postings) {
+        auto postings = node->postings;
+        _defrag_slot((void**)&node->postings, window);
+        _defrag_owned_slot((void**)&postings->files, window);
+        _defrag_owned_slot((void**)&postings->buckets, window);
+        for (size_t i = 0; i <= postings->bucket_mask; ++i) {
+            for (auto slot = &postings->buckets[i]; *slot != nullptr; slot = &(*slot)->next) {
+                _defrag_owned_slot((void**)slot, window);
+            }
+        }
+    } else {
+        /* 其余的都是目录链表的节点，除哨兵外还有对应的子节点指向它 */
+        auto subnode_list = (CList*)node->data;
+        auto it = (CListIterator*)mem;
+        clist_relocate_iterator(subnode_list, it, _defrag_slot, window);
+        if (it != clist_end(subnode_list))
+            _defrag_slot((void**)&((FileSystemNode*)clist_iterator_get(it))->link, window);
+    }
+}
+
+/**
+ * 从空闲链表中移除范围内的内存块，这些内存块会被覆盖
+ */
+static void _defrag_purge_free_list(FileSystemFreeBlock** list, const DefragWindow* window)
+{
+    for (auto prev = list; *prev != nullptr;) {
+        if (_in_window(window, *prev)) {
+            *prev = (*prev)->next;
+        } else {
+            prev = &(*prev)->next;
+        }
+    }
+}
+
+/**
+ * 在address处写入大小为size(含元数据)的内存块的元数据
+ * 也用于生成不属于任何链表的空洞，下一步整理时回收
+ */
+static void _defrag_make_block(char* address, size_t size)
+{
+    auto metadata = (FileSystemMemoryMetadata*)address;
+    metadata->size = size;
+    metadata->owner = nullptr;
+}
+
+/**
+ * 分片中第一个内存块的偏移量
+ */
+static size_t _defrag_start(size_t index)
+{
+    auto header_size = index == 0 ? sizeof(FileSystem) : sizeof(FileSystemShard);
+    return (header_size + FILESYSTEM_MEMORY_ALIGN - 1) & ~(FILESYSTEM_MEMORY_ALIGN - 1);
+}
+
+static size_t _page_align(size_t size)
+{
+    auto page_size = (size_t)sysconf(_SC_PAGESIZE);
+    return (size + page_size - 1) & ~(page_size - 1);
+}
+
+/**
+ * 整理分片的一步，调用者需要持有所有分片的写锁
+ * @param reclaimed 累加降低的分配偏移量
+ * @param done 输出是否已经整理到分片末尾
+ * @return 临时内存不足时返回FS_ERROR_NO_MEMORY，分片不变
+ */
+static FileSystemError _defrag_step(FileSystem* fs, size_t index, size_t* reclaimed, bool* done)
+{
+    auto shard = filesystem_shard_at(index);
+    auto base = (char*)shard;
+    auto top = base + atomic_load(&shard->shm_offset);
+    filesystem_zombie_sweep(shard);
+
+    /* 确定本步的范围，总是在内存块的边界上，第一个内存块是上一步留下的空洞，不计入本步的大小 */
+    DefragWindow window = {base + shard->defrag_offset, base + shard->defrag_offset, nullptr, 0, nullptr, 0, nullptr};
+    size_t block_count = 0;
+    size_t work = 0;
+    if (window.end < top) {
+        work += _defrag_block_work(window.end);
+        window.end += ((FileSystemMemoryMetadata*)window.end)->size;
+        ++block_count;
+    }
+    auto limit = window.end + DEFRAG_STEP_SIZE;
+    while (window.end < top && window.end < limit && work < DEFRAG_STEP_WORK) {
+        work += _defrag_block_work(window.end);
+        window.end += ((FileSystemMemoryMetadata*)window.end)->size;
+        ++block_count;
+    }
+    window.blocks = malloc(block_count * sizeof(DefragBlock) + 1);
+    window.writes = malloc(work * sizeof(DefragWrite) + 1);
+    if (window.blocks == nullptr || window.writes == nullptr) {
+        free(window.blocks);
+        free(window.writes);
+        return FS_ERROR_NO_MEMORY;
+    }
+
+    /* 计算移动后的地址，固定的内存块不动，之后的内存块从它后面开始，同时收集指向移动的内存块的指针 */
+    auto dest = window.begin;
+    bool moved = false;
+    for (auto block = window.begin; block < window.end;) {
+        auto metadata = (FileSystemMemoryMetadata*)block;
+        auto size = metadata->size;
+        if (metadata->owner == nullptr) {
+            block += size;
+            continue;
+        }
+        auto mem = block + sizeof(FileSystemMemoryMetadata);
+        auto target = _defrag_work(mem, metadata->owner) == SIZE_MAX ? block : dest;
+        if (target != block) {
+            _defrag_collect(fs, shard, &window, mem, target + sizeof(FileSystemMemoryMetadata));
+            moved = true;
+        }
+        window.blocks[window.count++] = (DefragBlock){block, target};
+        dest = target + size;
+        block += size;
+    }
+
+    /* 范围内的空闲内存块都会被覆盖，从空闲链表中移除，线程缓存通过epoch作废 */
+    pthread_mutex_lock(&shard->free_list_lock);
+    for (size_t i = 0; i < FILESYSTEM_SIZE_CLASS_COUNT; ++i) {
+        _defrag_purge_free_list(&shard->free_lists[i], &window);
+    }
+    _defrag_purge_free_list(&shard->unused_nodes, &window);
+    pthread_mutex_unlock(&shard->free_list_lock);
+    atomic_fetch_add(&shard->epoch, 1);
+
+    /* 收集完成后再统一修正指针，指向的都是原来的位置，随后随内存块一起移动 */
+    for (size_t i = 0; i < window.write_count; ++i) {
+        *window.writes[i].slot = window.writes[i].value;
+    }
+
+    /* 按地址顺序移动，目标地址总是不大于原地址，元数据随内存块一起移动 */
+    dest = window.begin;
+    for (size_t i = 0; i < window.count; ++i) {
+        auto block = window.blocks[i].block;
+        auto target = window.blocks[i].target;
+        auto size = ((FileSystemMemoryMetadata*)block)->size;
+        if (target == block && dest < block)
+            _defrag_make_block(dest, block - dest);
+        if (target != block)
+            memmove(target, block, size);
+        dest = target + size;
+    }
+    free(window.blocks);
+    free(window.writes);
+
+    if (moved) {
+        /* 共享内存中的当前目录按路径重新查找，进程内存中的当前目录在下次加锁时查找 */
+        atomic_fetch_add(&fs->cwd_epoch, 1);
+        filesystem_cwd_refresh(&fs->cwd);
+        for (size_t i = 0; i < FILESYSTEM_RING_COUNT; ++i) {
+            if (atomic_load(&fs->rings[i].in_use) == FILESYSTEM_RING_ACTIVE)
+                filesystem_cwd_refresh(&fs->rings[i].cwd);
+        }
+    }
+
+    *done = window.end >= top;
+    if (!*done) {
+        /* 剩余的空洞留到下一步，随着存活的内存块一起向末尾推进 */
+        if (dest < window.end)
+            _defrag_make_block(dest, window.end - dest);
+        shard->defrag_offset = dest - base;
+        return FS_OK;
+    }
+    /* 到达末尾，降低分配偏移量并把空出来的内存页还给操作系统 */
+    *reclaimed += top - dest;
+    atomic_store(&shard->shm_offset, (size_t)(dest - base));
+    auto release_begin = _page_align(dest - base);
+    auto release_end = _page_align(top - base);
+    if (release_begin < release_end)
+        madvise(base + release_begin, release_end - release_begin, MADV_REMOVE);
+    shard->defrag_offset = _defrag_start(index);
+    return FS_OK;
+}
+
+FileSystemError filesystem_defrag(FileSystemHandle* handle, size_t* reclaimed)
+{
+    debug_printf("defrag\n");
+    auto fs = handle->fs;
+    auto error = FS_OK;
+    size_t total = 0;
+    for (size_t i = 0; i < fs->shard_count && error == FS_OK; ++i) {
+        /* 从分片开头整理到末尾，每一步之间释放锁，其他操作可以继续执行 */
+        bool done = false;
+        auto locks = filesystem_lock_all(handle, true);
+        filesystem_shard_at(i)->defrag_offset = _defrag_start(i);
+        while (!done && error == FS_OK) {
+            error = _defrag_step(fs, i, &total, &done);
+            filesystem_unlock(locks);
+            if (!done && error == FS_OK)
+                locks = filesystem_lock_all(handle, true);
+        }
+    }
+    if (reclaimed != nullptr)
+        *reclaimed = total;
+    debug_printf("defrag finished\n");
+    return error;
+}
@@ -0,0 +1,805 @@
+/**
+  ******************************************************************************
+  * @encoding  utf-8
+  * @file      myfilesystem_grep.c
+  * @author    ZYX
+  * @brief     搜索文件内容，直接在共享内存中用SIMD扫描，多个线程并行，可选三元组倒排索引过滤
+  ******************************************************************************
+  */
+
+#include "myfilesystem_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "clist.h"
+
+/* 倒排索引初始的桶数，编号列表数超过桶数时加倍 */
+constexpr size_t TRIGRAM_BUCKETS_MIN = 64;
+/* 不是任何三元组，倒排索引中这个key的编号列表记录子目录 */
+constexpr uint32_t TRIGRAM_DIRECTORIES = 1u << 24;
+/* 编号列表初始的字节数 */
+constexpr size_t POSTING_BYTES_MIN = 8;
+/* 每个线程至少分到的文件数，文件太少时不值得创建线程 */
+constexpr size_t GREP_FILES_PER_THREAD = 64;
+/* 线程每次领取的文件数 */
+constexpr size_t GREP_BATCH = 16;
+
+static size_t _trigram_hash(uint32_t trigram, size_t mask)
+{
+    return (trigram * 2654435761u >> 8) & mask;
+}
+
+/**
+ * 三元组只有24位，按字节做3趟基数排序，比比较排序快得多
+ * @param buffer 与trigrams一样大的临时数组，排序结果存放在trigrams中
+ */
+static void _trigrams_sort(uint32_t* trigrams, uint32_t* buffer, size_t count)
+{
+    auto from = trigrams;
+    auto to = buffer;
+    for (unsigned shift = 0; shift < 24; shift += 8) {
+        size_t offsets[256] = {0};
+        for (size_t i = 0; i < count; ++i) {
+            ++offsets[from[i] >> shift & 0xff];
+        }
+        size_t sum = 0;
+        for (size_t i = 0; i < 256; ++i) {
+            auto n = offsets[i];
+            offsets[i] = sum;
+            sum += n;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            to[offsets[from[i] >> shift & 0xff]++] = from[i];
+        }
+        auto swap = from;
+        from = to;
+        to = swap;
+    }
+    /* 奇数趟之后结果在buffer中 */
+    memcpy(trigrams, from, count * sizeof(uint32_t));
+}
+
+/**
+ * 提取文本中出现过的三元组，升序排列，不重复
+ * @param trigrams 输出三元组数组，使用free释放，没有三元组时为nullptr
+ * @return 三元组数，进程内存不足时返回SIZE_MAX
+ */
+static size_t _trigrams_extract(const char* text, size_t length, uint32_t** trigrams)
+{
+    *trigrams = nullptr;
+    if (length < 3)
+        return 0;
+    auto total = length - 2;
+    auto result = (uint32_t*)malloc(2 * total * sizeof(uint32_t));
+    if (result == nullptr)
+        return SIZE_MAX;
+    auto p = (const unsigned char*)text;
+    for (size_t i = 0; i < total; ++i) {
+        result[i] = p[i] | (uint32_t)p[i + 1] << 8 | (uint32_t)p[i + 2] << 16;
+    }
+    _trigrams_sort(result, result + total, total);
+    size_t count = 1;
+    for (size_t i = 1; i < total; ++i) {
+        if (result[i] != result[count - 1])
+            result[count++] = result[i];
+    }
+    *trigrams = result;
+    return count;
+}
+
+/**
+ * 提取文件当前内容的三元组，已换出的内容读到进程内存中
+ * @return 三元组数，读取失败或者进程内存不足时返回SIZE_MAX
+ */
+static size_t _file_trigrams(const FileSystemNode* file, uint32_t** trigrams)
+{
+    if (!file->spilled) {
+        auto data = file->data == nullptr ? "" : (const char*)file->data;
+        return _trigrams_extract(data, strlen(data), trigrams);
+    }
+    auto loaded = filesystem_tier_load(file);
+    if (loaded == nullptr)
+        return SIZE_MAX;
+    auto count = _trigrams_extract(loaded, strlen(loaded), trigrams);
+    free(loaded);
+    return count;
+}
+
+static size_t _varint_size(uint32_t value)
+{
+    size_t size = 1;
+    for (; value >= 0x80; value >>= 7) {
+        ++size;
+    }
+    return size;
+}
+
+static size_t _varint_put(uint8_t* p, uint32_t value)
+{
+    size_t size = 0;
+    for (; value >= 0x80; value >>= 7) {
+        p[size++] = (uint8_t)(value | 0x80);
+    }
+    p[size++] = (uint8_t)value;
+    return size;
+}
+
+static size_t _varint_get(const uint8_t* p, uint32_t* value)
+{
+    uint32_t result = 0;
+    size_t size = 0;
+    for (unsigned shift = 0;; shift += 7) {
+        auto byte = p[size++];
+        result |= (uint32_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            break;
+    }
+    *value = result;
+    return size;
+}
+
+/**
+ * 之后的分配都在倒排索引所在的分片中进行，分配的内存块属于倒排索引
+ */
+static void _postings_use(FileSystemTrigramIndex* index)
+{
+    arena = filesystem_shard_of(index);
+    arena_owner = index;
+}
+
+FileSystemPosting** filesystem_posting_slot(FileSystemTrigramIndex* index, uint32_t trigram)
+{
+    auto slot = &index->buckets[_trigram_hash(trigram, index->bucket_mask)];
+    while (*slot != nullptr && (*slot)->trigram != trigram) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+/**
+ * 把slot指向的编号列表换成至少能容纳size字节的新列表
+ */
+static bool _posting_reserve(FileSystemTrigramIndex* index, FileSystemPosting** slot, size_t size)
+{
+    auto posting = *slot;
+    if (size <= posting->capacity)
+        return true;
+    auto capacity = posting->capacity * 2 > size ? posting->capacity * 2 : size;
+    _postings_use(index);
+    auto grown = (FileSystemPosting*)alloc_memory(sizeof(FileSystemPosting) + capacity);
+    if (grown == nullptr)
+        return false;
+    memcpy(grown, posting, sizeof(FileSystemPosting) + posting->size);
+    grown->capacity = capacity;
+    *slot = grown;
+    free_memory(posting);
+    return true;
+}
+
+/**
+ * 在三元组的编号列表中加入编号，列表不存在时创建
+ */
+static bool _posting_insert(FileSystemTrigramIndex* index, uint32_t trigram, uint32_t id)
+{
+    auto slot = filesystem_posting_slot(index, trigram);
+    if (*slot == nullptr) {
+        _postings_use(index);
+        auto posting = (FileSystemPosting*)alloc_memory(sizeof(FileSystemPosting) + POSTING_BYTES_MIN);
+        if (posting == nullptr)
+            return false;
+        *posting = (FileSystemPosting){nullptr, trigram, 0, 0, 0, POSTING_BYTES_MIN};
+        *slot = posting;
+        ++index->posting_count;
+    }
+    auto posting = *slot;
+    if (posting->count == 0 || id > posting->last) {
+        /* 新编号通常是最大的，直接追加 */
+        auto delta = posting->count == 0 ? id : id - posting->last;
+        if (!_posting_reserve(index, slot, posting->size + _varint_size(delta)))
+            return false;
+        posting = *slot;
+        posting->size += _varint_put(posting->bytes + posting->size, delta);
+        posting->last = id;
+        ++posting->count;
+        return true;
+    }
+    /* 找到第一个更大的编号，把它的差值拆成两段 */
+    size_t offset = 0;
+    uint32_t prev = 0;
+    uint32_t current = 0;
+    size_t length = 0;
+    for (uint32_t i = 0; i < posting->count; ++i) {
+        uint32_t delta;
+        length = _varint_get(posting->bytes + offset, &delta);
+        current = i == 0 ? delta : prev + delta;
+        if (current >= id)
+            break;
+        prev = current;
+        offset += length;
+    }
+    if (current == id)
+        return true;
+    auto base = offset == 0 ? 0 : prev;
+    auto first = _varint_size(id - base);
+    auto second = _varint_size(current - id);
+    if (!_posting_reserve(index, slot, posting->size + first + second - length))
+        return false;
+    posting = *slot;
+    auto tail = posting->bytes + offset + length;
+    memmove(posting->bytes + offset + first + second, tail, posting->size - offset - length);
+    _varint_put(posting->bytes + offset, id - base);
+    _varint_put(posting->bytes + offset + first, current - id);
+    posting->size += first + second - length;
+    ++posting->count;
+    return true;
+}
+
+/**
+ * 从三元组的编号列表中删除编号，列表为空时释放
+ */
+static void _posting_erase(FileSystemTrigramIndex* index, uint32_t trigram, uint32_t id)
+{
+    auto slot = filesystem_posting_slot(index, trigram);
+    auto posting = *slot;
+    if (posting == nullptr)
+        return;
+    size_t offset = 0;
+    uint32_t prev = 0;
+    for (uint32_t i = 0; i < posting->count; ++i) {
+        uint32_t delta;
+        auto length = _varint_get(posting->bytes + offset, &delta);
+        auto current = i == 0 ? delta : prev + delta;
+        if (current > id)
+            return;
+        if (current < id) {
+            prev = current;
+            offset += length;
+            continue;
+        }
+        if (--posting->count == 0) {
+            *slot = posting->next;
+            free_memory(posting);
+            --index->posting_count;
+            return;
+        }
+        auto base = offset == 0 ? 0 : prev;
+        if (i == posting->count) {
+            /* 删除的是最后一个编号 */
+            posting->size = offset;
+            posting->last = base;
+            return;
+        }
+        /* 与下一个编号的差值合并，合并后的编码不会比两段更长 */
+        uint32_t next_delta;
+        auto next_length = _varint_get(posting->bytes + offset + length, &next_delta);
+        auto merged = _varint_size(id + next_delta - base);
+        auto tail = offset + length + next_length;
+        memmove(posting->bytes + offset + merged, posting->bytes + tail, posting->size - tail);
+        _varint_put(posting->bytes + offset, id + next_delta - base);
+        posting->size -= length + next_length - merged;
+        return;
+    }
+}
+
+/**
+ * 编号列表数超过桶数时把桶数加倍，共享内存不足时保持原样，只是链表变长
+ */
+static void _postings_rehash(FileSystemTrigramIndex* index)
+{
+    if (index->posting_count <= index->bucket_mask + 1)
+        return;
+    auto bucket_count = (index->bucket_mask + 1) * 2;
+    _postings_use(index);
+    auto buckets = (FileSystemPosting**)alloc_memory(bucket_count * sizeof(FileSystemPosting*));
+    if (buckets == nullptr)
+        return;
+    memset(buckets, 0, bucket_count * sizeof(FileSystemPosting*));
+    for (size_t i = 0; i <= index->bucket_mask; ++i) {
+        for (auto posting = index->buckets[i]; posting != nullptr;) {
+            auto next = posting->next;
+            auto bucket = _trigram_hash(posting->trigram, bucket_count - 1);
+            posting->next = buckets[bucket];
+            buckets[bucket] = posting;
+            posting = next;
+        }
+    }
+    free_memory(index->buckets);
+    index->buckets = buckets;
+    index->bucket_mask = bucket_count - 1;
+}
+
+/**
+ * 分配一个节点编号，编号数组已满时加倍
+ * @return 共享内存不足时返回FILESYSTEM_TRIGRAM_NONE
+ */
+static uint32_t _postings_alloc_id(FileSystemTrigramIndex* index, FileSystemNode* node)
+{
+    size_t id = index->free_id;
+    if (id != SIZE_MAX) {
+        index->free_id = index->files[id].next_free;
+    } else {
+        if (index->file_next == index->file_capacity) {
+            auto capacity = index->file_capacity == 0 ? TRIGRAM_BUCKETS_MIN : index->file_capacity * 2;
+            if (capacity > FILESYSTEM_TRIGRAM_NONE)
+                return FILESYSTEM_TRIGRAM_NONE;
+            _postings_use(index);
+            auto files = (FileSystemTrigramSlot*)alloc_memory(capacity * sizeof(FileSystemTrigramSlot));
+            if (files == nullptr)
+                return FILESYSTEM_TRIGRAM_NONE;
+            if (index->files != nullptr)
+                memcpy(files, index->files, index->file_next * sizeof(FileSystemTrigramSlot));
+            free_memory(index->files);
+            index->files = files;
+            index->file_capacity = capacity;
+        }
+        id = index->file_next++;
+    }
+    index->files[id].file = node;
+    return (uint32_t)id;
+}
+
+static FileSystemTrigramIndex* _postings_create(FileSystemNode* dir)
+{
+    filesystem_use_node(dir);
+    auto index = (FileSystemTrigramIndex*)alloc_memory(sizeof(FileSystemTrigramIndex));
+    if (index == nullptr)
+        return nullptr;
+    _postings_use(index);
+    auto buckets = (FileSystemPosting**)alloc_memory(TRIGRAM_BUCKETS_MIN * sizeof(FileSystemPosting*));
+    if (buckets == nullptr) {
+        free_memory(index);
+        return nullptr;
+    }
+    memset(buckets, 0, TRIGRAM_BUCKETS_MIN * sizeof(FileSystemPosting*));
+    *index = (FileSystemTrigramIndex){nullptr, 0, 0, SIZE_MAX, 0, buckets, TRIGRAM_BUCKETS_MIN - 1, 0, true};
+    return index;
+}
+
+void filesystem_trigrams_destroy(FileSystemNode* dir)
+{
+    auto index = dir->postings;
+    if (index == nullptr)
+        return;
+    for (size_t i = 0; i <= index->bucket_mask; ++i) {
+        for (auto posting = index->buckets[i]; posting != nullptr;) {
+            auto next = posting->next;
+            free_memory(posting);
+            posting = next;
+        }
+    }
+    free_memory(index->buckets);
+    free_memory(index->files);
+    free_memory(index);
+    dir->postings = nullptr;
+}
+
+/**
+ * 节点编入倒排索引时所在的编号列表，目录只在TRIGRAM_DIRECTORIES中，文件在内容中的每个三元组中
+ * @return 列表数，读取失败或者进程内存不足时返回SIZE_MAX
+ */
+static size_t _node_trigrams(const FileSystemNode* node, uint32_t** trigrams)
+{
+    if (node->type == FS_NODE_FILE)
+        return _file_trigrams(node, trigrams);
+    *trigrams = (uint32_t*)malloc(sizeof(uint32_t));
+    if (*trigrams == nullptr)
+        return SIZE_MAX;
+    **trigrams = TRIGRAM_DIRECTORIES;
+    return 1;
+}
+
+/**
+ * 把节点编入倒排索引，共享内存不足时把索引标记为不完整
+ */
+static void _postings_add_node(FileSystemTrigramIndex* index, FileSystemNode* node)
+{
+    uint32_t* trigrams;
+    auto count = _node_trigrams(node, &trigrams);
+    auto id = count == SIZE_MAX ? FILESYSTEM_TRIGRAM_NONE : _postings_alloc_id(index, node);
+    if (id == FILESYSTEM_TRIGRAM_NONE) {
+        free(trigrams);
+        index->complete = false;
+        return;
+    }
+    node->trigram_id = id;
+    if (node->type == FS_NODE_FILE)
+        ++index->file_count;
+    for (size_t i = 0; i < count; ++i) {
+        /* 只插入了一部分时，移出时按内容逐个删除，不存在的编号会被忽略 */
+        if (!_posting_insert(index, trigrams[i], id)) {
+            index->complete = false;
+            break;
+        }
+    }
+    free(trigrams);
+    _postings_rehash(index);
+}
+
+void filesystem_trigrams_add(FileSystemNode* node)
+{
+    if (node->type == FS_NODE_DIRECTORY && node->trigram_index && node->postings == nullptr)
+        node->postings = _postings_create(node);
+    auto parent = node->parent;
+    if (parent != nullptr && parent->postings != nullptr && node->trigram_id == FILESYSTEM_TRIGRAM_NONE)
+        _postings_add_node(parent->postings, node);
+}
+
+void filesystem_trigrams_remove(FileSystemNode* node)
+{
+    auto parent = node->parent;
+    if (parent == nullptr || parent->postings == nullptr)
+        return;
+    auto index = parent->postings;
+    auto id = node->trigram_id;
+    if (id == FILESYSTEM_TRIGRAM_NONE)
+        return;
+    node->trigram_id = FILESYSTEM_TRIGRAM_NONE;
+    if (node->type == FS_NODE_FILE)
+        --index->file_count;
+    uint32_t* trigrams;
+    auto count = _node_trigrams(node, &trigrams);
+    if (count == SIZE_MAX) {
+        /* 无法确定编号在哪些列表中，编号不再分配，索引在重建之前不再使用 */
+        index->files[id].file = nullptr;
+        index->complete = false;
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        _posting_erase(index, trigrams[i], id);
+    }
+    free(trigrams);
+    index->files[id].next_free = index->free_id;
+    index->free_id = id;
+}
+
+/**
+ * 为目录子树建立倒排索引，已有完整索引的目录保持不变，不完整的重建，调用者需要持有子树所在分片的写锁
+ * @return 共享内存不足时返回FS_ERROR_NO_MEMORY，没有索引或索引不完整的目录搜索时扫描所有文件
+ */
+static FileSystemError _trigram_index_subtree(FileSystemNode* dir)
+{
+    auto error = FS_OK;
+    dir->trigram_index = true;
+    auto rebuild = dir->postings == nullptr || !dir->postings->complete;
+    if (rebuild) {
+        filesystem_trigrams_destroy(dir);
+        dir->postings = _postings_create(dir);
+        if (dir->postings == nullptr)
+            error = FS_ERROR_NO_MEMORY;
+    }
+    auto subnode_list = (CList*)dir->data;
+    for (auto it = clist_begin(subnode_list); it != clist_end(subnode_list); it = clist_iterator_next(it)) {
+        auto subnode = (FileSystemNode*)clist_iterator_get(it);
+        if (subnode->type == FS_NODE_DIRECTORY) {
+            auto sub_error = _trigram_index_subtree(subnode);
+            if (sub_error != FS_OK)
+                error = sub_error;
+        }
+        if (rebuild) {
+            subnode->trigram_id = FILESYSTEM_TRIGRAM_NONE;
+            filesystem_trigrams_add(subnode);
+        }
+    }
+    if (dir->postings != nullptr && !dir->postings->complete)
+        error = FS_ERROR_NO_MEMORY;
+    return error;
+}
+
+FileSystemError filesystem_trigram_index(FileSystemHandle* handle, const char* name)
+{
+    debug_printf("trigram_index %s\n", name);
+    auto error = FS_OK;
+    /* 子树可能跨越所有分片，启用索引不常用，直接获取所有分片的写锁 */
+    auto locks = filesystem_lock_all(handle, true);
+    auto cur_dir = handle->cwd->dir;
+    auto dir = strcmp(name, ".") == 0 ? cur_dir : filesystem_node_get_subnode(cur_dir, FS_NODE_DIRECTORY, name);
+    if (dir == nullptr) {
+        error = FS_ERROR_NOT_EXIST;
+    } else {
+        error = _trigram_index_subtree(dir);
+    }
+    filesystem_unlock(locks);
+    debug_printf("trigram_index unlocked\n");
+    return error;
+}
+
+/**
+ * 在text中查找pattern第一次出现的位置
+ * 每次比较16个位置的首字节和尾字节，两者都相等的位置才逐字节比较
+ * @return 没有找到时返回-1
+ */
+static ptrdiff_t _find(const char* text, size_t length, const char* pattern, size_t pattern_length)
+{
+    if (pattern_length > length)
+        return -1;
+    size_t i = 0;
+#ifdef __SSE2__
+    auto first = _mm_set1_epi8(pattern[0]);
+    auto last = _mm_set1_epi8(pattern[pattern_length - 1]);
+    for (; i + pattern_length - 1 + 16 <= length; i += 16) {
+        auto block_first = _mm_loadu_si128((const __m128i*)(text + i));
+        auto block_last = _mm_loadu_si128((const __m128i*)(text + i + pattern_length - 1));
+        auto eq = _mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last));
+        auto mask = (unsigned)_mm_movemask_epi8(eq);
+        while (mask != 0) {
+            auto offset = i + __builtin_ctz(mask);
+            if (memcmp(text + offset, pattern, pattern_length) == 0)
+                return (ptrdiff_t)offset;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    /* 剩余不足16个位置的部分 */
+    for (; i + pattern_length <= length; ++i) {
+        if (text[i] == pattern[0] && memcmp(text + i, pattern, pattern_length) == 0)
+            return (ptrdiff_t)i;
+    }
+    return -1;
+}
+
+/**
+ * 一次搜索的状态，候选文件按深度优先的顺序存放，线程通过next领取
+ */
+typedef struct GrepContext
+{
+    const char* pattern;
+    size_t pattern_length;
+    uint32_t* trigrams; /* 模式串中的三元组，模式串短于3个字节时为nullptr */
+    size_t trigram_count;
+    FileSystemPosting** postings; /* 求交集时使用的临时数组，大小为trigram_count */
+    uint32_t* ids; /* 求交集时使用的临时数组 */
+    size_t id_capacity;
+    FileSystemNode** files; /* 经过倒排索引过滤后需要扫描的文件 */
+    ptrdiff_t* offsets; /* 每个候选文件中第一次出现的位置，没有时为-1 */
+    size_t count;
+    size_t capacity;
+    size_t total; /* 子树中的文件数 */
+    _Atomic size_t next; /* 下一个未被领取的候选文件 */
+    _Atomic size_t bytes; /* 已扫描的字节数 */
+} GrepContext;
+
+static FileSystemError _grep_push(GrepContext* context, FileSystemNode* file)
+{
+    if (context->count == context->capacity) {
+        auto capacity = context->capacity == 0 ? GREP_BATCH : context->capacity * 2;
+        auto files = (FileSystemNode**)realloc(context->files, capacity * sizeof(FileSystemNode*));
+        if (files == nullptr)
+            return FS_ERROR_NO_MEMORY;
+        context->files = files;
+        context->capacity = capacity;
+    }
+    context->files[context->count++] = file;
+    return FS_OK;
+}
+
+static int _posting_count_compare(const void* a, const void* b)
+{
+    auto x = (*(FileSystemPosting* const*)a)->count;
+    auto y = (*(FileSystemPosting* const*)b)->count;
+    return (x > y) - (x < y);
+}
+
+/**
+ * 对模式串中各个三元组的编号列表求交集，交集中的文件才可能包含模式串
+ * 从最短的列表开始，依次与更长的列表合并，交集为空时提前结束
+ */
+static FileSystemError _grep_intersect(GrepContext* context, FileSystemTrigramIndex* index)
+{
+    for (size_t i = 0; i < context->trigram_count; ++i) {
+        context->postings[i] = *filesystem_posting_slot(index, context->trigrams[i]);
+        if (context->postings[i] == nullptr)
+            return FS_OK;
+    }
+    qsort(context->postings, context->trigram_count, sizeof(FileSystemPosting*), _posting_count_compare);
+    auto shortest = context->postings[0];
+    if (shortest->count > context->id_capacity) {
+        auto ids = (uint32_t*)realloc(context->ids, shortest->count * sizeof(uint32_t));
+        if (ids == nullptr)
+            return FS_ERROR_NO_MEMORY;
+        context->ids = ids;
+        context->id_capacity = shortest->count;
+    }
+    auto ids = context->ids;
+    size_t id_count = 0;
+    uint32_t id = 0;
+    for (size_t offset = 0; offset < shortest->size;) {
+        uint32_t delta;
+        offset += _varint_get(shortest->bytes + offset, &delta);
+        id = id_count == 0 ? delta : id + delta;
+        ids[id_count++] = id;
+    }
+    for (size_t i = 1; i < context->trigram_count && id_count > 0; ++i) {
+        auto posting = context->postings[i];
+        size_t kept = 0;
+        size_t j = 0;
+        size_t offset = 0;
+        uint32_t current = 0;
+        for (uint32_t k = 0; k < posting->count && j < id_count; ++k) {
+            uint32_t delta;
+            offset += _varint_get(posting->bytes + offset, &delta);
+            current = k == 0 ? delta : current + delta;
+            while (j < id_count && ids[j] < current) {
+                ++j;
+            }
+            if (j < id_count && ids[j] == current)
+                ids[kept++] = ids[j++];
+        }
+        id_count = kept;
+    }
+    for (size_t i = 0; i < id_count; ++i) {
+        auto error = _grep_push(context, index->files[ids[i]].file);
+        if (error != FS_OK)
+            return error;
+    }
+    return FS_OK;
+}
+
+/**
+ * 收集子树中的候选文件
+ * 有完整倒排索引的目录只取交集中的文件，子目录从索引中记录子目录的编号列表取得，不需要遍历子节点列表
+ */
+static FileSystemError _grep_collect(GrepContext* context, FileSystemNode* dir)
+{
+    auto index = dir->postings;
+    if (index != nullptr && index->complete && context->trigram_count > 0) {
+        context->total += index->file_count;
+        auto error = _grep_intersect(context, index);
+        auto directories = *filesystem_posting_slot(index, TRIGRAM_DIRECTORIES);
+        if (error != FS_OK || directories == nullptr)
+            return error;
+        uint32_t id = 0;
+        for (size_t offset = 0, i = 0; i < directories->count; ++i) {
+            uint32_t delta;
+            offset += _varint_get(directories->bytes + offset, &delta);
+            id = i == 0 ? delta : id + delta;
+            error = _grep_collect(context, index->files[id].file);
+            if (error != FS_OK)
+                return error;
+        }
+        return FS_OK;
+    }
+    auto subnode_list = (CList*)dir->data;
+    for (auto it = clist_begin(subnode_list); it != clist_end(subnode_list); it = clist_iterator_next(it)) {
+        auto subnode = (FileSystemNode*)clist_iterator_get(it);
+        if (subnode->type == FS_NODE_DIRECTORY) {
+            auto error = _grep_collect(context, subnode);
+            if (error != FS_OK)
+                return error;
+            continue;
+        }
+        ++context->total;
+        if (subnode->data == nullptr && !subnode->spilled)
+            continue;
+        auto error = _grep_push(context, subnode);
+        if (error != FS_OK)
+            return error;
+    }
+    return FS_OK;
+}
+
+/**
+ * 扫描线程，每次领取GREP_BATCH个候选文件，文件大小不均时也能平衡负载
+ * 调用者持有子树所在分片的读锁，扫描期间文件内容不会改变
+ */
+static void* _grep_worker(void* arg)
+{
+    auto context = (GrepContext*)arg;
+    size_t bytes = 0;
+    for (;;) {
+        auto begin = atomic_fetch_add(&context->next, GREP_BATCH);
+        if (begin >= context->count)
+            break;
+        auto end = begin + GREP_BATCH < context->count ? begin + GREP_BATCH : context->count;
+        for (auto i = begin; i < end; ++i) {
+            /* 已换出的文件读到进程内存中扫描，不调回共享内存，避免一次搜索换出所有常用的文件 */
+            auto file = context->files[i];
+            auto loaded = file->spilled ? filesystem_tier_load(file) : nullptr;
+            auto data = file->spilled ? loaded : (const char*)file->data;
+            if (data == nullptr) {
+                context->offsets[i] = -1;
+                continue;
+            }
+            auto length = strlen(data);
+            context->offsets[i] = _find(data, length, context->pattern, context->pattern_length);
+            bytes += length;
+            free(loaded);
+        }
+    }
+    atomic_fetch_add(&context->bytes, bytes);
+    return nullptr;
+}
+
+/**
+ * 生成node相对于dir的路径，过长时截断
+ */
+static void _grep_path(const FileSystemNode* dir, const FileSystemNode* node, char* path, size_t size)
+{
+    /* 从node向上找到dir，再按从上到下的顺序拼接 */
+    const FileSystemNode* chain[FILESYSTEM_PWD_SIZE / 2];
+    size_t depth = 0;
+    for (auto it = node; it != dir && depth < FILESYSTEM_PWD_SIZE / 2; it = it->parent) {
+        chain[depth++] = it;
+    }
+    size_t offset = 0;
+    path[0] = '\0';
+    for (size_t i = depth; i > 0 && offset + 1 < size; --i) {
+        auto name_length = strlen(chain[i - 1]->name);
+        auto copy = name_length < size - offset - 1 ? name_length : size - offset - 1;
+        memcpy(path + offset, chain[i - 1]->name, copy);
+        offset += copy;
+        if (i > 1 && offset + 1 < size)
+            path[offset++] = '/';
+        path[offset] = '\0';
+    }
+}
+
+FileSystemError filesystem_grep(FileSystemHandle* handle, const char* name, const char* pattern,
+                                FileSystemGrepMatch* matches, size_t capacity, size_t* count,
+                                FileSystemGrepStats* stats)
+{
+    debug_printf("grep %s %s\n", name, pattern);
+    if (pattern == nullptr || pattern[0] == '\0')
+        return FS_ERROR_INVALID_ARGUMENT;
+    GrepContext context = {pattern, strlen(pattern), nullptr, 0, nullptr, nullptr, 0, nullptr, nullptr, 0, 0, 0, 0, 0};
+    auto error = FS_OK;
+    size_t total = 0;
+    context.trigram_count = _trigrams_extract(pattern, context.pattern_length, &context.trigrams);
+    if (context.trigram_count == SIZE_MAX)
+        return FS_ERROR_NO_MEMORY;
+    if (context.trigram_count > 0) {
+        context.postings = (FileSystemPosting**)malloc(context.trigram_count * sizeof(FileSystemPosting*));
+        if (context.postings == nullptr) {
+            free(context.trigrams);
+            return FS_ERROR_NO_MEMORY;
+        }
+    }
+
+    auto locks = filesystem_lock_cwd(handle, false);
+    auto cur_dir = handle->cwd->dir;
+    auto dir = strcmp(name, ".") == 0 ? cur_dir : filesystem_node_get_subnode(cur_dir, FS_NODE_DIRECTORY, name);
+    if (dir == nullptr) {
+        error = FS_ERROR_NOT_EXIST;
+    } else {
+        /* 根目录的子树跨越所有分片 */
+        filesystem_lock_subtree(&locks, dir);
+        error = _grep_collect(&context, dir);
+    }
+    if (error == FS_OK && context.count > 0) {
+        context.offsets = (ptrdiff_t*)malloc(context.count * sizeof(ptrdiff_t));
+        if (context.offsets == nullptr)
+            error = FS_ERROR_NO_MEMORY;
+    }
+    if (error == FS_OK) {
+        filesystem_parallel(_grep_worker, &context, context.count, GREP_FILES_PER_THREAD);
+        for (size_t i = 0; i < context.count; ++i) {
+            if (context.offsets[i] < 0)
+                continue;
+            if (total < capacity) {
+                _grep_path(dir, context.files[i], matches[total].path, sizeof(matches[total].path));
+                matches[total].offset = (size_t)context.offsets[i];
+            }
+            ++total;
+        }
+    }
+    filesystem_unlock(locks);
+    debug_printf("grep unlocked\n");
+
+    free(context.trigrams);
+    free(context.postings);
+    free(context.ids);
+    free(context.files);
+    free(context.offsets);
+    if (error != FS_OK)
+        return error;
+    *count = total;
+    if (stats != nullptr) {
+        stats->files = context.total;
+        stats->scanned = context.count;
+        stats->bytes = atomic_load(&context.bytes);
+    }
+    return total > capacity ? FS_ERROR_BUFFER_TOO_SMALL : FS_OK;
+}
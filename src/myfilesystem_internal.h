@@ -0,0 +1,471 @@
+/**
+  ******************************************************************************
+  * @encoding  utf-8
+  * @file      myfilesystem_internal.h
+  * @author    ZYX
+  * @brief     文件系统内部使用的数据结构，不对库的使用者公开
+  ******************************************************************************
+  */
+
+#ifndef MYFILESYSTEM_INTERNAL_H
+#define MYFILESYSTEM_INTERNAL_H
+
+#include "myfilesystem.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "cbtree.h"
+#include "clist.h"
+
+constexpr bool DEBUG = false;
+
+/* 所有分配的内存都按该大小对齐，包括元数据 */
+constexpr size_t FILESYSTEM_MEMORY_ALIGN = 16;
+/* 小内存按2的幂分级，最小一级为FILESYSTEM_MEMORY_ALIGN，共FILESYSTEM_SIZE_CLASS_COUNT级，超过最大一级的按大内存处理 */
+constexpr size_t FILESYSTEM_SIZE_CLASS_COUNT = 9;
+constexpr size_t FILESYSTEM_SIZE_CLASS_MAX = FILESYSTEM_MEMORY_ALIGN << (FILESYSTEM_SIZE_CLASS_COUNT - 1);
+/* 每个线程每一级最多缓存的内存块数 */
+constexpr size_t FILESYSTEM_TCACHE_COUNT = 32;
+/* 线程缓存与共享空闲链表之间每次批量转移的内存块数 */
+constexpr size_t FILESYSTEM_TCACHE_BATCH = 16;
+
+/* 并行处理时最多使用的线程数 */
+constexpr size_t FILESYSTEM_PARALLEL_MAX = 16;
+
+/* 内容短于该长度的文件不换出到后备文件，节省的共享内存还不如节点本身大，不值得一次磁盘I/O */
+constexpr size_t FILESYSTEM_TIER_SPILL_MIN = 256;
+
+/* 节点watchers的最高位，表示节点已被摧毁，由最后一个等待者释放 */
+constexpr uint32_t FILESYSTEM_NODE_DEAD = 1u << 31;
+
+/* 节点没有编入父目录的三元组倒排索引 */
+constexpr uint32_t FILESYSTEM_TRIGRAM_NONE = UINT32_MAX;
+
+typedef struct FileSystemNode FileSystemNode;
+
+typedef struct FileSystemPosting FileSystemPosting;
+
+/**
+ * 倒排索引中一个三元组对应的文件编号列表，编号升序排列，与前一个编号之差按变长整数编码，第一个编号直接编码
+ * 同一个桶中的列表通过next串成链表
+ */
+struct FileSystemPosting
+{
+    FileSystemPosting* next;
+    uint32_t trigram;
+    uint32_t count; /* 编号数 */
+    uint32_t last; /* 最大的编号，追加更大的编号时不需要解码 */
+    size_t size; /* bytes中已使用的字节数 */
+    size_t capacity;
+    uint8_t bytes[];
+};
+
+/**
+ * 倒排索引中编号到节点的映射，空闲的编号通过next_free串成链表
+ */
+typedef union FileSystemTrigramSlot
+{
+    FileSystemNode* file;
+    size_t next_free;
+} FileSystemTrigramSlot;
+
+/**
+ * 目录的三元组倒排索引，只包含目录中直接的子节点，存放在目录所在的分片中
+ * 搜索时对模式串中各个三元组的编号列表求交集，只扫描交集中的文件，子目录记录在一个特殊的编号列表中，不需要遍历子节点列表
+ * 编号数组、桶数组和编号列表都属于索引，整理内存时通过索引找到指向它们的指针
+ */
+typedef struct FileSystemTrigramIndex
+{
+    FileSystemTrigramSlot* files;
+    size_t file_capacity;
+    size_t file_next; /* 从未使用过的最小编号 */
+    size_t free_id; /* 空闲编号链表的表头，为SIZE_MAX时为空 */
+    size_t file_count; /* 编入索引的文件数 */
+    FileSystemPosting** buckets;
+    size_t bucket_mask; /* 桶数减一，桶数是2的幂 */
+    size_t posting_count;
+    /* 共享内存不足或者读取换出的内容失败时为false，搜索时退回扫描目录中的所有文件，重新启用时重建 */
+    bool complete;
+} FileSystemTrigramIndex;
+
+/**
+ * 存储内存的元数据，包含内存的实际大小信息和内存块的所有者
+ * 整理内存时通过所有者找到指向该内存块的指针：
+ * 节点自身的内存块所有者是它自己，指向它的指针由父目录的链表节点、索引和倒排索引、子节点和时钟环中的相邻节点保存
+ * 文件内容、目录的链表及其节点、索引和倒排索引的所有者是节点，指针保存在节点或链表中
+ * 索引内部的树节点的所有者是索引，指针保存在索引或父树节点中；倒排索引内部的数组和编号列表的所有者是倒排索引
+ */
+typedef struct FileSystemMemoryMetadata
+{
+    size_t size; /* 包含元数据在内的内存块大小 */
+    void* owner; /* 空闲的内存块为nullptr */
+} FileSystemMemoryMetadata;
+
+/**
+ * 空闲内存块链表的节点，直接存放在空闲内存块的数据区中
+ */
+typedef struct FileSystemFreeBlock FileSystemFreeBlock;
+
+struct FileSystemFreeBlock
+{
+    FileSystemFreeBlock* next;
+};
+
+struct FileSystemNode
+{
+    FileSystemNode* parent; /* 父节点指针 */
+    CListIterator* link; /* 父目录链表中指向该节点的链表节点，没有父节点时为nullptr */
+    FileSystemNodeType type; /* 节点类型 */
+    char name[FILESYSTEM_NODE_NAME_SIZE]; /* 文件或路径名 */
+    void* data; /* 对于目录，这个是一个CList, 存储子节点; 对于文件，这里存储文件数据 */
+    CBTree* index; /* 目录的有序索引，按(name, type)排序，为nullptr时表示该目录未启用索引 */
+    _Atomic uint32_t seq; /* 变化序号，目录的子节点增删、文件内容修改以及节点被摧毁时加一，等待者在此futex等待 */
+    _Atomic uint32_t watchers; /* 正在等待的线程数，没有等待者时不需要唤醒 */
+    /* 子树的用量，沿父节点链更新，根目录在分片0中只持有读锁时也会被更新，所以使用原子操作 */
+    _Atomic size_t usage_bytes;
+    _Atomic size_t usage_entries;
+    FileSystemUsage quota; /* 目录的配额，为0的项不限制，修改时需要持有目录所在分片的写锁 */
+    bool trigram_index; /* 目录是否为其中的文件维护三元组倒排索引，新建的子目录继承 */
+    /* 文件最近是否被读过，读取时只持有读锁，所以使用原子操作；时钟指针经过时清除，再次经过时仍未被读过就换出 */
+    _Atomic bool referenced;
+    bool spilled; /* 文件内容是否已换出到后备文件，此时data为nullptr */
+    FileSystemTrigramIndex* postings; /* 目录的三元组倒排索引，未启用或者共享内存不足时为nullptr */
+    uint32_t trigram_id; /* 在父目录倒排索引中的编号，没有编入时为FILESYSTEM_TRIGRAM_NONE */
+    /* 分片中可以换出的文件组成的双向环，不在环中时都为nullptr */
+    FileSystemNode* clock_prev;
+    FileSystemNode* clock_next;
+    size_t spill_offset; /* 换出的内容在后备文件中的偏移量 */
+    size_t spill_length; /* 换出的内容长度 */
+};
+
+/**
+ * 目录索引中使用的key
+ */
+typedef struct FileSystemNodeKey
+{
+    const char* name;
+    FileSystemNodeType type; /* 为FS_NODE_UNKNOWN时小于所有同名节点，用于查找下界 */
+} FileSystemNodeKey;
+
+typedef struct FileSystem FileSystem;
+
+/**
+ * 当前目录及其路径
+ */
+typedef struct FileSystemCwd
+{
+    FileSystemNode* dir; /* 当前目录，所在目录已被删除时为nullptr，之后的操作返回FS_ERROR_NOT_EXIST直到切换目录 */
+    size_t pwd_offset;
+    char pwd[FILESYSTEM_PWD_SIZE]; /* 当前目录路径 */
+    size_t epoch; /* 对应的FileSystem::cwd_epoch，落后时dir可能已失效，需要按路径重新查找 */
+} FileSystemCwd;
+
+/**
+ * 提交队列中的一项操作，由客户端写入，应用者读取
+ */
+typedef struct FileSystemRingEntry
+{
+    FileSystemRingOp op;
+    size_t user_data;
+    bool has_data; /* data为nullptr时为false */
+    char name[FILESYSTEM_PWD_SIZE]; /* 文件名、目录名，cd时为路径 */
+    char data[FILESYSTEM_RING_DATA_SIZE];
+} FileSystemRingEntry;
+
+/* 队列的占用状态，初始化期间为FILESYSTEM_RING_SETUP，应用者只执行FILESYSTEM_RING_ACTIVE的队列 */
+constexpr uint32_t FILESYSTEM_RING_FREE = 0;
+constexpr uint32_t FILESYSTEM_RING_ACTIVE = 1;
+constexpr uint32_t FILESYSTEM_RING_SETUP = 2;
+
+/**
+ * 一个客户端的提交队列和完成队列，均为单生产者单消费者的无锁环形队列
+ * 下标只增不减，取模后得到位置，队列中的元素个数为tail - head
+ */
+struct FileSystemRing
+{
+    _Atomic uint32_t in_use; /* 占用状态，取值为FILESYSTEM_RING_* */
+    _Atomic uint32_t sq_head; /* 应用者推进 */
+    _Atomic uint32_t sq_tail; /* 客户端推进 */
+    _Atomic uint32_t cq_head; /* 客户端推进 */
+    _Atomic uint32_t cq_tail; /* 应用者推进，客户端在此futex等待 */
+    _Atomic uint32_t cq_waiting; /* 客户端是否在等待完成事件，没有等待者时应用者不需要唤醒 */
+    FileSystem* fs;
+    FileSystemCwd cwd; /* 该队列中的操作所在的当前目录 */
+    FileSystemRingEntry sq[FILESYSTEM_RING_ENTRIES];
+    FileSystemRingCompletion cq[FILESYSTEM_RING_ENTRIES];
+};
+
+/**
+ * 一个分片，存放在分片共享内存的开头，第k个分片附加在SHM_ADDR + k * SHM_SIZE处
+ * 根目录下的目录按名称哈希到分片，其整棵子树都分配在该分片中，其余节点都在分片0中
+ */
+typedef struct FileSystemShard
+{
+    size_t magic_number; /* 辅助判断该共享内存是不是第一次创建, 只有创建时可以修改，其余时候只读 */
+    pthread_rwlock_t rwlock; /* 读写锁，保护分片中的所有节点，分片0的锁同时保护根目录和所有当前目录 */
+    _Atomic size_t shm_offset; /* 记录当前使用的共享内存偏移量，通过CAS推进，不需要持有rwlock */
+    pthread_mutex_t free_list_lock; /* 保护free_lists和unused_nodes，只在线程缓存批量换入换出时持有 */
+    FileSystemFreeBlock* free_lists[FILESYSTEM_SIZE_CLASS_COUNT]; /* 各级小内存的共享空闲链表 */
+    FileSystemFreeBlock* unused_nodes; /* 分配后被释放的大内存 */
+    _Atomic size_t epoch; /* 整理内存后加一，之前的线程缓存全部作废 */
+    size_t defrag_offset; /* 整理内存的进度，之前的内存已经紧凑 */
+    FileSystemNode* zombies; /* 已被摧毁但还有等待者的节点，通过data串成链表 */
+    _Atomic size_t allocated; /* 已分配出去的内存块大小之和(含元数据)，不含空闲链表和线程缓存中的内存块 */
+    FileSystemNode* clock_hand; /* 换出时的时钟指针，指向分片中可以换出的文件组成的环，环为空时为nullptr */
+    size_t clock_count; /* 环中的文件数 */
+} FileSystemShard;
+
+/**
+ * 持有的分片锁集合，第k位表示持有第k个分片的锁
+ */
+typedef uint32_t FileSystemLocks;
+
+/**
+ * 分层存储的状态，分片中已分配的内存超过高水位时把最近没有被读过的文件内容换出到后备文件
+ */
+typedef struct FileSystemTier
+{
+    bool enabled; /* 修改时需要持有所有分片的写锁 */
+    char path[FILESYSTEM_PWD_SIZE]; /* 后备文件在宿主机上的路径 */
+    size_t high_water; /* 分片中已分配的内存超过该值时开始换出 */
+    size_t low_water; /* 换出到分片中已分配的内存不超过该值为止 */
+    /* 后备文件中已使用的长度，只增不减，换出时通过原子操作推进，不再使用的区间打洞归还磁盘空间 */
+    _Atomic size_t file_size;
+    _Atomic size_t hits;
+    _Atomic size_t misses;
+    _Atomic size_t spills;
+    _Atomic size_t spilled_bytes;
+    _Atomic size_t backing_bytes;
+} FileSystemTier;
+
+struct FileSystem
+{
+    FileSystemShard shard; /* 分片0，必须是第一个成员 */
+    size_t shard_count; /* 分片数，只有创建时可以修改 */
+    FileSystemNode* root; /* 根目录 */
+    FileSystemCwd cwd; /* 以FILESYSTEM_OPEN_SHARED_CWD方式打开的句柄共享的当前目录 */
+    _Atomic size_t cwd_epoch; /* 整理内存移动节点或目录被摧毁后加一，所有当前目录都需要重新查找 */
+    _Atomic uint32_t ring_doorbell; /* 客户端提交后加一，应用者在此futex等待 */
+    _Atomic uint32_t ring_applier_waiting; /* 应用者是否在等待提交 */
+    FileSystemRing rings[FILESYSTEM_RING_COUNT];
+    FileSystemTier tier;
+};
+
+struct FileSystemHandle
+{
+    FileSystem* fs; /* 句柄所属的文件系统 */
+    FileSystemCwd* cwd; /* 指向private_cwd或者共享内存中的cwd，只能在持有写锁时修改 */
+    FileSystemCwd private_cwd;
+};
+
+/**
+ * 当前线程正在操作的文件系统，每个接口进入时设置
+ */
+extern thread_local FileSystem* f;
+/**
+ * 当前线程分配内存时使用的分片，分配前通过filesystem_use_node设置，释放内存时按地址找到分片
+ */
+extern thread_local FileSystemShard* arena;
+/**
+ * 当前线程分配的内存块的所有者，和arena一起设置
+ */
+extern thread_local void* arena_owner;
+
+int debug_printf(const char* format, ...) __attribute__((format(printf, 1, 2)));
+
+void* alloc_memory(size_t size);
+void free_memory(void* mem);
+
+/* 每个分片的共享内存大小 */
+extern const int SHM_SIZE;
+
+FileSystemShard* filesystem_shard_at(size_t index);
+/**
+ * 获取地址所在的分片
+ */
+FileSystemShard* filesystem_shard_of(const void* address);
+size_t filesystem_shard_index(const void* address);
+/**
+ * 之后的分配都在node所在的分片中进行，分配的内存块属于node
+ */
+void filesystem_use_node(FileSystemNode* node);
+/**
+ * 之后的分配都在index所在的分片中进行，分配的内存块属于index，在向目录索引插入之前调用
+ */
+void filesystem_use_index(CBTree* index);
+/**
+ * 修改内存块的所有者，用于先分配内存再创建或修改节点的情况
+ */
+void filesystem_memory_set_owner(void* mem, void* owner);
+
+/**
+ * 目录索引使用的比较函数，先比较名称，名称相同时比较类型
+ */
+int filesystem_node_key_compare(const void* key, const void* item);
+FileSystemNode* filesystem_node_get_subnode(FileSystemNode* node, FileSystemNodeType subnode_type,
+                                            const char* subnode_name);
+FileSystemError filesystem_node_create(FileSystemNode* parent, FileSystemNodeType type, const char* name,
+                                       void* data, FileSystemNode** node);
+/**
+ * 在parent下新建的节点所在的分片，parent为nullptr时是根目录所在的分片0
+ */
+FileSystemShard* filesystem_node_shard(const FileSystemNode* parent, FileSystemNodeType type, const char* name);
+void filesystem_node_destroy(FileSystemNode* node);
+/**
+ * 将节点从父节点的子节点列表和索引中移出，不释放节点，之后节点的parent为nullptr
+ * @return 列表中排在该节点之前的节点，该节点是第一个时返回nullptr，用于放回原位置
+ */
+FileSystemNode* filesystem_node_unlink(FileSystemNode* node);
+/**
+ * 节点发生变化，序号加一并唤醒等待者，调用者需要持有节点所在分片的写锁
+ */
+void filesystem_node_changed(FileSystemNode* node);
+/**
+ * 释放分片中已经没有等待者的已摧毁节点，调用者需要持有分片的写锁
+ */
+void filesystem_zombie_sweep(FileSystemShard* shard);
+
+/**
+ * 节点自身计入父目录的用量，文件为内容长度和1，目录为子树用量和1
+ */
+FileSystemUsage filesystem_node_usage(const FileSystemNode* node);
+/**
+ * 将用量计入dir及其所有祖先
+ * @param check 为true时只要有一个祖先会超过配额就不计入，返回FS_ERROR_QUOTA
+ */
+FileSystemError filesystem_usage_add(FileSystemNode* dir, FileSystemUsage usage, bool check);
+void filesystem_usage_sub(FileSystemNode* dir, FileSystemUsage usage);
+/**
+ * 只检查不计入，用量计入dir及其所有祖先后是否都不超过配额，并发修改时只是估计
+ */
+bool filesystem_usage_fits(const FileSystemNode* dir, FileSystemUsage usage);
+
+/**
+ * 维护父目录的三元组倒排索引，调用者需要持有节点所在分片的写锁
+ * 节点加入目录之后和文件内容改变之后调用filesystem_trigrams_add，节点移出目录之前和文件内容改变之前调用
+ * filesystem_trigrams_remove，移出时按当前内容重新计算三元组，所以必须在内容改变之前调用
+ * 新建的目录继承启用时在add中创建自己的倒排索引，共享内存不足时把索引标记为不完整，不影响正确性
+ */
+void filesystem_trigrams_add(FileSystemNode* node);
+void filesystem_trigrams_remove(FileSystemNode* node);
+/**
+ * 释放目录的倒排索引，摧毁目录时在子节点都移出之后调用
+ */
+void filesystem_trigrams_destroy(FileSystemNode* dir);
+/**
+ * 倒排索引中指向三元组对应编号列表的指针，不存在时指向桶中链表末尾的nullptr，也用于整理内存
+ */
+FileSystemPosting** filesystem_posting_slot(FileSystemTrigramIndex* index, uint32_t trigram);
+
+/**
+ * 分层存储，以下函数的调用者都需要持有文件所在分片的写锁
+ * 文件有非空内容且在共享内存中时加入所在分片的时钟环，不论是否启用分层存储，启用后已有的文件也可以换出
+ */
+void filesystem_tier_track(FileSystemNode* file);
+/**
+ * 将文件移出时钟环，在替换文件内容之前调用，防止为新内容腾出空间时换出正在修改的文件
+ */
+void filesystem_tier_untrack(FileSystemNode* file);
+/**
+ * 丢弃文件换出到后备文件的内容，文件被摧毁或内容被替换之后调用
+ */
+void filesystem_tier_discard(FileSystemNode* file);
+/**
+ * 即将在分片中分配size字节，已分配的内存会超过高水位时按时钟算法换出文件，直到不超过低水位
+ */
+void filesystem_tier_reserve(FileSystemShard* shard, size_t size);
+/**
+ * 把换出的文件内容调回共享内存
+ */
+FileSystemError filesystem_tier_fault(FileSystemNode* file);
+/**
+ * 读取文件时调用，只需要持有读锁，设置访问位并计入命中次数
+ */
+void filesystem_tier_touch(FileSystemNode* file);
+/**
+ * 不调回共享内存，把换出的内容读到进程内存中，以'\0'结尾，只需要持有读锁，用于搜索和导出等批量读取
+ * @return 使用free释放，失败时返回nullptr
+ */
+char* filesystem_tier_load(const FileSystemNode* file);
+/**
+ * 关闭进程打开的后备文件，分离共享内存时调用
+ */
+void filesystem_tier_close(void);
+
+/**
+ * 不加锁的操作实现，调用者需要持有当前目录所在分片的写锁，根目录下的rmdir还需要持有子目录所在分片的写锁
+ * 供接口、提交队列等复用
+ */
+FileSystemError filesystem_op_cd(FileSystemCwd* cwd, const char* path);
+/**
+ * 按路径从根目录重新查找当前目录，路径已不存在时dir为nullptr，用于节点被移动或目录被删除之后
+ * 调用者需要持有分片0的写锁
+ */
+void filesystem_cwd_refresh(FileSystemCwd* cwd);
+/**
+ * 当前目录的epoch落后时重新查找，调用者需要持有分片0的写锁
+ */
+void filesystem_cwd_validate(FileSystemCwd* cwd);
+FileSystemError filesystem_op_mkdir(FileSystemNode* dir, const char* name);
+FileSystemError filesystem_op_rmdir(FileSystemNode* dir, const char* name);
+/**
+ * @param node 输出创建的文件节点，可以为nullptr
+ */
+FileSystemError filesystem_op_create_file(FileSystemNode* dir, const char* name, const char* data,
+                                          FileSystemNode** node);
+/**
+ * 创建文件，data不需要以'\0'结尾，用于从映射的宿主机文件中直接复制
+ * @param length data的长度，其中不能包含'\0'
+ */
+FileSystemError filesystem_op_create_file_sized(FileSystemNode* dir, const char* name, const char* data,
+                                                size_t length, FileSystemNode** node);
+/**
+ * @param old_data 不为nullptr时不释放原数据，而是输出给调用者，用于事务回滚
+ */
+FileSystemError filesystem_op_alter_file(FileSystemNode* dir, const char* name, const char* data, void** old_data);
+FileSystemError filesystem_op_remove_file(FileSystemNode* dir, const char* name);
+
+/**
+ * 共享内存上的futex，可以跨进程等待和唤醒
+ * @param timeout_ms 超时时间，小于0时一直等待
+ * @return 被唤醒或值已改变时返回true，超时返回false
+ */
+bool filesystem_futex_wait(_Atomic uint32_t* address, uint32_t expected, int timeout_ms);
+void filesystem_futex_wake(_Atomic uint32_t* address, int count);
+
+/**
+ * 用最多CPU数个线程(含当前线程)运行worker，所有线程结束后返回，工作由worker自行领取
+ * @param count 工作的总数
+ * @param per_thread 每个线程至少分到的工作数，工作太少时不值得创建线程
+ */
+void filesystem_parallel(void* (*worker)(void*), void* arg, size_t count, size_t per_thread);
+
+/**
+ * 获取句柄对应文件系统的锁，同时设置f，接口只在最外层加锁，防止递归加锁
+ * 分片锁总是按下标从小到大获取，防止死锁
+ */
+
+/**
+ * 获取分片0的读锁和当前目录所在分片的锁，写操作时当前目录所在分片加写锁
+ * @return 持有的锁集合，用于解锁
+ */
+FileSystemLocks filesystem_lock_cwd(FileSystemHandle* handle, bool write);
+/**
+ * 获取所有分片的锁，分片0总是加写锁，可以修改当前目录
+ * @param write 其余分片是否加写锁
+ */
+FileSystemLocks filesystem_lock_all(FileSystemHandle* handle, bool write);
+/**
+ * 额外获取node所在分片的写锁，已持有时不变，只能获取下标比已持有的锁都大的分片
+ */
+void filesystem_lock_node(FileSystemLocks* locks, const FileSystemNode* node);
+/**
+ * 额外获取dir整棵子树所在分片的读锁，已持有时不变
+ * dir是根目录时为所有分片，否则只有dir所在的分片，只能在持有的锁都在dir所在分片之前时调用
+ */
+void filesystem_lock_subtree(FileSystemLocks* locks, const FileSystemNode* dir);
+void filesystem_unlock(FileSystemLocks locks);
+
+#endif //MYFILESYSTEM_INTERNAL_H
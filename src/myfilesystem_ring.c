@@ -0,0 +1,208 @@
+/**
+  ******************************************************************************
+  * @encoding  utf-8
+  * @file      myfilesystem_ring.c
+  * @author    ZYX
+  * @brief     共享内存中的提交/完成队列，客户端无锁提交，应用者批量执行
+  ******************************************************************************
+  */
+
+#include "myfilesystem_internal.h"
+
+#include <string.h>
+
+/* 应用者等待提交时的超时时间，超时后检查是否需要停止 */
+constexpr int RING_SERVE_TIMEOUT_MS = 100;
+
+FileSystemError filesystem_ring_register(FileSystemHandle* handle, FileSystemRing** ring)
+{
+    auto fs = handle->fs;
+    /* 应用者执行队列时持有分片0的写锁，初始化期间持有读锁，应用者不会看到初始化到一半的队列 */
+    auto locks = filesystem_lock_cwd(handle, false);
+    auto error = FS_ERROR_BUSY;
+    for (size_t i = 0; i < FILESYSTEM_RING_COUNT; ++i) {
+        auto candidate = &fs->rings[i];
+        uint32_t expected = FILESYSTEM_RING_FREE;
+        if (!atomic_compare_exchange_strong(&candidate->in_use, &expected, FILESYSTEM_RING_SETUP))
+            continue;
+        atomic_store(&candidate->sq_head, 0);
+        atomic_store(&candidate->sq_tail, 0);
+        atomic_store(&candidate->cq_head, 0);
+        atomic_store(&candidate->cq_tail, 0);
+        atomic_store(&candidate->cq_waiting, 0);
+        candidate->fs = fs;
+        memcpy(&candidate->cwd, handle->cwd, sizeof(FileSystemCwd));
+        /* 全部初始化完成后才发布 */
+        atomic_store_explicit(&candidate->in_use, FILESYSTEM_RING_ACTIVE, memory_order_release);
+        *ring = candidate;
+        error = FS_OK;
+        break;
+    }
+    filesystem_unlock(locks);
+    return error;
+}
+
+void filesystem_ring_unregister(FileSystemRing* ring)
+{
+    if (ring != nullptr)
+        atomic_store(&ring->in_use, FILESYSTEM_RING_FREE);
+}
+
+FileSystemError filesystem_ring_submit(FileSystemRing* ring, FileSystemRingOp op, const char* name, const char* data,
+                                       size_t user_data)
+{
+    auto name_size = strlen(name) + 1;
+    auto data_size = data == nullptr ? 0 : strlen(data) + 1;
+    if (name_size > FILESYSTEM_PWD_SIZE || data_size > FILESYSTEM_RING_DATA_SIZE)
+        return FS_ERROR_INVALID_ARGUMENT;
+
+    /* 只有当前线程推进tail，应用者推进head */
+    auto tail = atomic_load_explicit(&ring->sq_tail, memory_order_relaxed);
+    auto head = atomic_load_explicit(&ring->sq_head, memory_order_acquire);
+    if (tail - head == FILESYSTEM_RING_ENTRIES)
+        return FS_ERROR_BUSY;
+
+    auto entry = &ring->sq[tail % FILESYSTEM_RING_ENTRIES];
+    entry->op = op;
+    entry->user_data = user_data;
+    entry->has_data = data != nullptr;
+    memcpy(entry->name, name, name_size);
+    if (data != nullptr)
+        memcpy(entry->data, data, data_size);
+    atomic_store_explicit(&ring->sq_tail, tail + 1, memory_order_release);
+
+    /* 通知应用者，只有应用者在等待时才需要系统调用 */
+    auto fs = ring->fs;
+    atomic_fetch_add(&fs->ring_doorbell, 1);
+    if (atomic_load(&fs->ring_applier_waiting))
+        filesystem_futex_wake(&fs->ring_doorbell, 1);
+    return FS_OK;
+}
+
+FileSystemError filesystem_ring_reap(FileSystemRing* ring, FileSystemRingCompletion* completion, bool wait)
+{
+    auto head = atomic_load_explicit(&ring->cq_head, memory_order_relaxed);
+    while (true) {
+        auto tail = atomic_load_explicit(&ring->cq_tail, memory_order_acquire);
+        if (head != tail)
+            break;
+        if (!wait)
+            return FS_ERROR_BUSY;
+        /* 先声明在等待再检查一次，防止错过应用者的唤醒 */
+        atomic_store(&ring->cq_waiting, 1);
+        if (atomic_load(&ring->cq_tail) == tail)
+            filesystem_futex_wait(&ring->cq_tail, tail, -1);
+        atomic_store(&ring->cq_waiting, 0);
+    }
+    *completion = ring->cq[head % FILESYSTEM_RING_ENTRIES];
+    atomic_store_explicit(&ring->cq_head, head + 1, memory_order_release);
+    return FS_OK;
+}
+
+/**
+ * 执行一项操作，调用者需要持有所有分片的写锁
+ */
+static FileSystemError _ring_execute(FileSystemRing* ring, const FileSystemRingEntry* entry)
+{
+    /* 队列的当前目录可能已被其他句柄或同一批中的操作删除 */
+    filesystem_cwd_validate(&ring->cwd);
+    auto dir = ring->cwd.dir;
+    auto data = entry->has_data ? entry->data : nullptr;
+    switch (entry->op) {
+    case FS_RING_OP_NOP:
+        return FS_OK;
+    case FS_RING_OP_CD:
+        return filesystem_op_cd(&ring->cwd, entry->name);
+    case FS_RING_OP_MKDIR:
+        return filesystem_op_mkdir(dir, entry->name);
+    case FS_RING_OP_RMDIR:
+        return filesystem_op_rmdir(dir, entry->name);
+    case FS_RING_OP_CREATE_FILE:
+        return filesystem_op_create_file(dir, entry->name, data, nullptr);
+    case FS_RING_OP_ALTER_FILE:
+        if (data == nullptr)
+            return FS_ERROR_INVALID_ARGUMENT;
+        return filesystem_op_alter_file(dir, entry->name, data, nullptr);
+    case FS_RING_OP_REMOVE_FILE:
+        return filesystem_op_remove_file(dir, entry->name);
+    }
+    return FS_ERROR_INVALID_ARGUMENT;
+}
+
+/**
+ * 检查是否有队列存在待执行的提交，避免没有提交时也获取写锁
+ */
+static bool _ring_pending(FileSystem* fs)
+{
+    for (size_t i = 0; i < FILESYSTEM_RING_COUNT; ++i) {
+        auto ring = &fs->rings[i];
+        if (atomic_load(&ring->in_use) == FILESYSTEM_RING_ACTIVE && atomic_load(&ring->sq_head) != atomic_load(&ring->sq_tail))
+            return true;
+    }
+    return false;
+}
+
+FileSystemError filesystem_ring_apply(FileSystemHandle* handle, size_t max_batch, size_t* applied)
+{
+    auto fs = handle->fs;
+    size_t count = 0;
+    bool need_wake[FILESYSTEM_RING_COUNT] = {};
+    if (_ring_pending(fs)) {
+        /* 队列中的操作可能分布在任意分片，整批获取所有分片的写锁 */
+        auto locks = filesystem_lock_all(handle, true);
+        for (size_t i = 0; i < FILESYSTEM_RING_COUNT && count < max_batch; ++i) {
+            auto ring = &fs->rings[i];
+            if (atomic_load_explicit(&ring->in_use, memory_order_acquire) != FILESYSTEM_RING_ACTIVE)
+                continue;
+            auto sq_head = atomic_load_explicit(&ring->sq_head, memory_order_relaxed);
+            auto sq_tail = atomic_load_explicit(&ring->sq_tail, memory_order_acquire);
+            auto cq_head = atomic_load_explicit(&ring->cq_head, memory_order_acquire);
+            auto cq_tail = atomic_load_explicit(&ring->cq_tail, memory_order_relaxed);
+            /* 完成队列满时暂停该队列，等客户端取走完成事件 */
+            auto begin = sq_head;
+            while (sq_head != sq_tail && cq_tail - cq_head < FILESYSTEM_RING_ENTRIES && count < max_batch) {
+                auto entry = &ring->sq[sq_head % FILESYSTEM_RING_ENTRIES];
+                auto completion = &ring->cq[cq_tail % FILESYSTEM_RING_ENTRIES];
+                completion->user_data = entry->user_data;
+                completion->op = entry->op;
+                completion->error = _ring_execute(ring, entry);
+                ++sq_head;
+                ++cq_tail;
+                ++count;
+            }
+            if (sq_head == begin)
+                continue;
+            atomic_store_explicit(&ring->sq_head, sq_head, memory_order_release);
+            /* 与客户端先写cq_waiting再读cq_tail对称，需要顺序一致，否则两边可能都读到旧值而错过唤醒 */
+            atomic_store(&ring->cq_tail, cq_tail);
+            need_wake[i] = atomic_load(&ring->cq_waiting) != 0;
+        }
+        filesystem_unlock(locks);
+    }
+    /* 释放锁之后再唤醒客户端 */
+    for (size_t i = 0; i < FILESYSTEM_RING_COUNT; ++i) {
+        if (need_wake[i])
+            filesystem_futex_wake(&fs->rings[i].cq_tail, 1);
+    }
+    if (applied != nullptr)
+        *applied = count;
+    return FS_OK;
+}
+
+FileSystemError filesystem_ring_serve(FileSystemHandle* handle, volatile bool* stop)
+{
+    auto fs = handle->fs;
+    while (!*stop) {
+        auto doorbell = atomic_load(&fs->ring_doorbell);
+        size_t applied = 0;
+        filesystem_ring_apply(handle, SIZE_MAX, &applied);
+        if (applied > 0)
+            continue;
+        /* 没有提交时在门铃上等待，声明等待后门铃未变才睡眠 */
+        atomic_store(&fs->ring_applier_waiting, 1);
+        if (atomic_load(&fs->ring_doorbell) == doorbell)
+            filesystem_futex_wait(&fs->ring_doorbell, doorbell, RING_SERVE_TIMEOUT_MS);
+        atomic_store(&fs->ring_applier_waiting, 0);
+    }
+    return FS_OK;
+}
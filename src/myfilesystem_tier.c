@@ -0,0 +1,286 @@
+/**
+  ******************************************************************************
+  * @encoding  utf-8
+  * @file      myfilesystem_tier.c
+  * @author    ZYX
+  * @brief     分层存储，共享内存紧张时按时钟算法把最近没有被读过的文件内容换出到宿主机上的后备文件
+  ******************************************************************************
+  */
+
+#include "myfilesystem_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+#include <sys/syscall.h>
+
+/* 进程打开的后备文件，所有线程共用，pread和pwrite不依赖文件偏移量 */
+static pthread_mutex_t tier_fd_lock = PTHREAD_MUTEX_INITIALIZER;
+static int tier_fd = -1;
+
+/**
+ * 获取后备文件，第一次使用时打开
+ * 搜索和导出的工作线程没有设置f，文件系统总是位于分片0的开头
+ * @return 打开失败时返回-1
+ */
+static int _tier_fd(void)
+{
+    pthread_mutex_lock(&tier_fd_lock);
+    if (tier_fd == -1) {
+        auto fs = (FileSystem*)filesystem_shard_at(0);
+        tier_fd = open(fs->tier.path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    }
+    auto fd = tier_fd;
+    pthread_mutex_unlock(&tier_fd_lock);
+    return fd;
+}
+
+void filesystem_tier_close(void)
+{
+    pthread_mutex_lock(&tier_fd_lock);
+    if (tier_fd != -1) {
+        close(tier_fd);
+        tier_fd = -1;
+    }
+    pthread_mutex_unlock(&tier_fd_lock);
+}
+
+static bool _tier_pwrite(int fd, const char* data, size_t length, size_t offset)
+{
+    for (size_t written = 0; written < length;) {
+        auto result = pwrite(fd, data + written, length - written, (off_t)(offset + written));
+        if (result == -1 && errno != EINTR)
+            return false;
+        if (result > 0)
+            written += (size_t)result;
+    }
+    return true;
+}
+
+static bool _tier_pread(int fd, char* buffer, size_t length, size_t offset)
+{
+    for (size_t done = 0; done < length;) {
+        auto result = pread(fd, buffer + done, length - done, (off_t)(offset + done));
+        if (result == 0 || (result == -1 && errno != EINTR))
+            return false;
+        if (result > 0)
+            done += (size_t)result;
+    }
+    return true;
+}
+
+/**
+ * 在后备文件中打洞，把不再使用的区间占用的磁盘空间还给宿主机，文件长度不变
+ */
+static void _tier_punch(int fd, size_t offset, size_t length)
+{
+    syscall(SYS_fallocate, fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)length);
+}
+
+void filesystem_tier_track(FileSystemNode* file)
+{
+    if (file->clock_next != nullptr || file->data == nullptr ||
+        strnlen(file->data, FILESYSTEM_TIER_SPILL_MIN) < FILESYSTEM_TIER_SPILL_MIN)
+        return;
+    auto shard = filesystem_shard_of(file);
+    /* 新写入的内容算作刚被访问过 */
+    atomic_store_explicit(&file->referenced, true, memory_order_relaxed);
+    auto hand = shard->clock_hand;
+    if (hand == nullptr) {
+        file->clock_prev = file;
+        file->clock_next = file;
+        shard->clock_hand = file;
+    } else {
+        /* 插入到时钟指针之前，指针转过一整圈后才会再经过 */
+        file->clock_prev = hand->clock_prev;
+        file->clock_next = hand;
+        hand->clock_prev->clock_next = file;
+        hand->clock_prev = file;
+    }
+    ++shard->clock_count;
+}
+
+void filesystem_tier_untrack(FileSystemNode* file)
+{
+    if (file->clock_next == nullptr)
+        return;
+    auto shard = filesystem_shard_of(file);
+    if (file->clock_next == file) {
+        shard->clock_hand = nullptr;
+    } else {
+        file->clock_prev->clock_next = file->clock_next;
+        file->clock_next->clock_prev = file->clock_prev;
+        if (shard->clock_hand == file)
+            shard->clock_hand = file->clock_next;
+    }
+    file->clock_prev = nullptr;
+    file->clock_next = nullptr;
+    --shard->clock_count;
+}
+
+void filesystem_tier_discard(FileSystemNode* file)
+{
+    if (!file->spilled)
+        return;
+    auto fd = _tier_fd();
+    if (fd != -1)
+        _tier_punch(fd, file->spill_offset, file->spill_length);
+    atomic_fetch_sub(&f->tier.backing_bytes, file->spill_length);
+    file->spilled = false;
+    file->spill_offset = 0;
+    file->spill_length = 0;
+}
+
+/**
+ * 把文件内容写入后备文件并释放共享内存，节点中只留下内容在后备文件中的位置
+ * @return 写入失败时返回false，文件不变
+ */
+static bool _tier_spill(FileSystemNode* file)
+{
+    auto tier = &f->tier;
+    auto fd = _tier_fd();
+    if (fd == -1)
+        return false;
+    auto data = (const char*)file->data;
+    auto length = strlen(data);
+    auto offset = atomic_fetch_add(&tier->file_size, length);
+    if (!_tier_pwrite(fd, data, length, offset)) {
+        _tier_punch(fd, offset, length);
+        return false;
+    }
+    filesystem_tier_untrack(file);
+    free_memory(file->data);
+    file->data = nullptr;
+    file->spilled = true;
+    file->spill_offset = offset;
+    file->spill_length = length;
+    atomic_fetch_add(&tier->spills, 1);
+    atomic_fetch_add(&tier->spilled_bytes, length);
+    atomic_fetch_add(&tier->backing_bytes, length);
+    return true;
+}
+
+void filesystem_tier_reserve(FileSystemShard* shard, size_t size)
+{
+    auto tier = &f->tier;
+    if (!tier->enabled || atomic_load(&shard->allocated) + size <= tier->high_water)
+        return;
+    /* 第一次经过时清除访问位，第二次经过时仍未被读过才换出，所以最多转两圈 */
+    auto steps = 2 * shard->clock_count;
+    while (shard->clock_hand != nullptr && steps-- > 0 &&
+           atomic_load(&shard->allocated) + size > tier->low_water) {
+        auto file = shard->clock_hand;
+        shard->clock_hand = file->clock_next;
+        if (atomic_exchange_explicit(&file->referenced, false, memory_order_relaxed))
+            continue;
+        if (!_tier_spill(file))
+            break;
+    }
+}
+
+FileSystemError filesystem_tier_fault(FileSystemNode* file)
+{
+    auto fd = _tier_fd();
+    if (fd == -1)
+        return FS_ERROR_SYSTEM;
+    auto length = file->spill_length;
+    /* 调回的内容可能挤出其他文件，自身已不在时钟环中，不会被换出 */
+    filesystem_tier_reserve(filesystem_shard_of(file), length + 1);
+    filesystem_use_node(file);
+    auto data = (char*)alloc_memory(length + 1);
+    if (data == nullptr)
+        return FS_ERROR_NO_MEMORY;
+    if (!_tier_pread(fd, data, length, file->spill_offset)) {
+        free_memory(data);
+        return FS_ERROR_SYSTEM;
+    }
+    data[length] = '\0';
+    filesystem_tier_discard(file);
+    file->data = data;
+    filesystem_tier_track(file);
+    atomic_fetch_add(&f->tier.misses, 1);
+    return FS_OK;
+}
+
+void filesystem_tier_touch(FileSystemNode* file)
+{
+    /* 已经置位时不再写入，避免经常被读的节点所在的缓存行在读者之间来回传递 */
+    if (!atomic_load_explicit(&file->referenced, memory_order_relaxed))
+        atomic_store_explicit(&file->referenced, true, memory_order_relaxed);
+    if (f->tier.enabled)
+        atomic_fetch_add_explicit(&f->tier.hits, 1, memory_order_relaxed);
+}
+
+char* filesystem_tier_load(const FileSystemNode* file)
+{
+    auto fd = _tier_fd();
+    if (fd == -1)
+        return nullptr;
+    auto buffer = (char*)malloc(file->spill_length + 1);
+    if (buffer == nullptr)
+        return nullptr;
+    if (!_tier_pread(fd, buffer, file->spill_length, file->spill_offset)) {
+        free(buffer);
+        return nullptr;
+    }
+    buffer[file->spill_length] = '\0';
+    return buffer;
+}
+
+FileSystemError filesystem_tier_enable(FileSystemHandle* handle, const char* backing_path, size_t high_water,
+                                       size_t low_water)
+{
+    debug_printf("tier_enable %s\n", backing_path);
+    if (backing_path == nullptr || high_water > (size_t)SHM_SIZE || low_water > high_water)
+        return FS_ERROR_INVALID_ARGUMENT;
+    auto error = FS_OK;
+    /* 换出只发生在持有写锁时，修改水位需要所有分片的写锁 */
+    auto locks = filesystem_lock_all(handle, true);
+    auto tier = &handle->fs->tier;
+    if (!tier->enabled) {
+        /* 创建或清空后备文件，保存绝对路径，使当前目录不同的进程打开同一个文件 */
+        char resolved[PATH_MAX];
+        auto fd = open(backing_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd == -1 || realpath(backing_path, resolved) == nullptr) {
+            error = FS_ERROR_SYSTEM;
+        } else if (strlen(resolved) >= sizeof(tier->path)) {
+            error = FS_ERROR_INVALID_ARGUMENT;
+        } else {
+            strcpy(tier->path, resolved);
+            atomic_store(&tier->file_size, 0);
+            tier->enabled = true;
+        }
+        if (fd != -1)
+            close(fd);
+    } else {
+        char resolved[PATH_MAX];
+        if (realpath(backing_path, resolved) == nullptr || strcmp(resolved, tier->path) != 0)
+            error = FS_ERROR_EXIST;
+    }
+    if (error == FS_OK) {
+        tier->high_water = high_water;
+        tier->low_water = low_water;
+    }
+    filesystem_unlock(locks);
+    debug_printf("tier_enable unlocked\n");
+    return error;
+}
+
+FileSystemError filesystem_tier_stats(FileSystemHandle* handle, FileSystemTierStats* stats)
+{
+    auto tier = &handle->fs->tier;
+    stats->hits = atomic_load(&tier->hits);
+    stats->misses = atomic_load(&tier->misses);
+    stats->spills = atomic_load(&tier->spills);
+    stats->spilled_bytes = atomic_load(&tier->spilled_bytes);
+    stats->backing_bytes = atomic_load(&tier->backing_bytes);
+    stats->allocated = 0;
+    for (size_t i = 0; i < handle->fs->shard_count; ++i) {
+        stats->allocated += atomic_load(&filesystem_shard_at(i)->allocated);
+    }
+    return FS_OK;
+}
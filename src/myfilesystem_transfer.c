@@ -0,0 +1,447 @@
+/**
+  ******************************************************************************
+  * @encoding  utf-8
+  * @file      myfilesystem_transfer.c
+  * @author    ZYX
+  * @brief     与宿主机文件系统之间批量导入导出，宿主机的读写由多个线程并行进行
+  ******************************************************************************
+  */
+
+#include "myfilesystem_internal.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "clist.h"
+
+/* 每个线程至少分到的文件数，文件太少时不值得创建线程 */
+constexpr size_t TRANSFER_FILES_PER_THREAD = 16;
+/* 条目数组的初始容量 */
+constexpr size_t TRANSFER_INITIAL_CAPACITY = 64;
+/* 每个导入条目除文件内容外占用的共享内存的估计值，包括节点、父目录链表中的节点和内存块元数据 */
+constexpr size_t IMPORT_ENTRY_OVERHEAD = 512;
+
+/**
+ * 拼接宿主机路径
+ * @return 新分配的路径，内存不足时返回nullptr
+ */
+static char* _host_path_join(const char* dir, const char* name)
+{
+    auto size = strlen(dir) + strlen(name) + 2;
+    auto path = (char*)malloc(size);
+    if (path != nullptr)
+        snprintf(path, size, "%s/%s", dir, name);
+    return path;
+}
+
+/**
+ * 导入的一个条目，按深度优先的先序存放，父目录总是在子节点之前
+ */
+typedef struct ImportEntry
+{
+    char* host_path;
+    size_t parent; /* 父目录的下标，导入的根目录为0 */
+    FileSystemNodeType type;
+    char name[FILESYSTEM_NODE_NAME_SIZE];
+    size_t size; /* 遍历时宿主机文件的大小 */
+    const char* data; /* 映射的文件内容，空文件为nullptr */
+    size_t mapped; /* 映射的长度 */
+    size_t length; /* 第一个'\0'之前的长度 */
+    bool failed; /* 无法读取，跳过 */
+    FileSystemNode* node; /* 导入后的目录节点，跳过时为nullptr */
+} ImportEntry;
+
+typedef struct ImportContext
+{
+    ImportEntry* entries;
+    size_t count;
+    size_t capacity;
+    size_t skipped;
+    size_t bytes; /* 所有文件的大小之和 */
+    size_t resident_bytes; /* 不能换出到后备文件的文件大小之和，未启用分层存储时为所有文件 */
+    size_t populate_limit; /* 最多预先读入的字节数，超过的部分在复制时才读入 */
+    _Atomic size_t populated; /* 已预先读入的字节数 */
+    _Atomic size_t next; /* 下一个未被领取的条目 */
+} ImportContext;
+
+/**
+ * 追加一个条目，数组扩容后之前的条目指针会失效，只能保存下标
+ * @return 新条目的下标，内存不足时返回SIZE_MAX
+ */
+static size_t _import_push(ImportContext* context, char* host_path, size_t parent, FileSystemNodeType type,
+                           const char* name)
+{
+    if (context->count == context->capacity) {
+        auto capacity = context->capacity == 0 ? TRANSFER_INITIAL_CAPACITY : context->capacity * 2;
+        auto entries = (ImportEntry*)realloc(context->entries, capacity * sizeof(ImportEntry));
+        if (entries == nullptr)
+            return SIZE_MAX;
+        context->entries = entries;
+        context->capacity = capacity;
+    }
+    auto entry = &context->entries[context->count];
+    memset(entry, 0, sizeof(ImportEntry));
+    entry->host_path = host_path;
+    entry->parent = parent;
+    entry->type = type;
+    strcpy(entry->name, name);
+    return context->count++;
+}
+
+/**
+ * 遍历宿主机目录，只收集目录和普通文件，不跟随符号链接
+ */
+static FileSystemError _import_walk(ImportContext* context, size_t dir_index)
+{
+    auto dir = opendir(context->entries[dir_index].host_path);
+    if (dir == nullptr) {
+        if (dir_index == 0)
+            return FS_ERROR_SYSTEM;
+        /* 无法读取的子目录导入为空目录 */
+        ++context->skipped;
+        return FS_OK;
+    }
+    auto error = FS_OK;
+    struct dirent* dirent;
+    while (error == FS_OK && (dirent = readdir(dir)) != nullptr) {
+        auto name = dirent->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        struct stat st;
+        auto host_path = _host_path_join(context->entries[dir_index].host_path, name);
+        if (host_path == nullptr) {
+            error = FS_ERROR_NO_MEMORY;
+            break;
+        }
+        if (strlen(name) >= FILESYSTEM_NODE_NAME_SIZE || lstat(host_path, &st) == -1 ||
+            (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))) {
+            ++context->skipped;
+            free(host_path);
+            continue;
+        }
+        auto type = S_ISDIR(st.st_mode) ? FS_NODE_DIRECTORY : FS_NODE_FILE;
+        auto index = _import_push(context, host_path, dir_index, type, name);
+        if (index == SIZE_MAX) {
+            free(host_path);
+            error = FS_ERROR_NO_MEMORY;
+        } else if (type == FS_NODE_DIRECTORY) {
+            error = _import_walk(context, index);
+        } else {
+            context->entries[index].size = (size_t)st.st_size;
+            context->bytes += (size_t)st.st_size;
+            if ((size_t)st.st_size < FILESYSTEM_TIER_SPILL_MIN)
+                context->resident_bytes += (size_t)st.st_size;
+        }
+    }
+    closedir(dir);
+    return error;
+}
+
+/**
+ * 映射文件之前估计导入后的用量，超过配额或者目标分片放不下时直接失败，不读入任何文件
+ * 目标分片中剩余的空间同时决定最多预先读入多少字节
+ */
+static FileSystemError _import_estimate(FileSystemHandle* handle, ImportContext* context, const char* name)
+{
+    auto error = FS_OK;
+    auto locks = filesystem_lock_cwd(handle, false);
+    auto dir = handle->cwd->dir;
+    if (dir == nullptr) {
+        error = FS_ERROR_NOT_EXIST;
+    } else if (filesystem_node_get_subnode(dir, FS_NODE_DIRECTORY, name) != nullptr) {
+        error = FS_ERROR_EXIST;
+    } else if (!filesystem_usage_fits(dir, (FileSystemUsage){context->bytes, context->count})) {
+        error = FS_ERROR_QUOTA;
+    } else {
+        /* 启用分层存储时较大的文件可以换出到后备文件，只有节点和小文件必须留在共享内存中 */
+        auto shard = filesystem_node_shard(dir, FS_NODE_DIRECTORY, name);
+        auto allocated = atomic_load(&shard->allocated);
+        auto available = allocated < (size_t)SHM_SIZE ? (size_t)SHM_SIZE - allocated : 0;
+        auto overhead = context->count * IMPORT_ENTRY_OVERHEAD;
+        if (!handle->fs->tier.enabled)
+            context->resident_bytes = context->bytes;
+        if (overhead + context->resident_bytes > available) {
+            error = FS_ERROR_NO_MEMORY;
+        } else {
+            context->populate_limit = available - overhead;
+        }
+    }
+    filesystem_unlock(locks);
+    return error;
+}
+
+/**
+ * 映射一个宿主机文件，预先读入的部分之后在锁内复制时不会再发生磁盘I/O
+ * @param populate 是否预先读入所有页
+ */
+static void _import_map(ImportEntry* entry, bool populate)
+{
+    auto fd = open(entry->host_path, O_RDONLY);
+    if (fd == -1) {
+        entry->failed = true;
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        entry->failed = true;
+    } else if (st.st_size > 0) {
+        auto data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd, 0);
+        if (data == MAP_FAILED) {
+            entry->failed = true;
+        } else {
+            entry->data = data;
+            entry->mapped = st.st_size;
+            entry->length = strnlen(data, st.st_size);
+        }
+    }
+    close(fd);
+}
+
+static void* _import_worker(void* arg)
+{
+    auto context = (ImportContext*)arg;
+    for (;;) {
+        auto index = atomic_fetch_add(&context->next, 1);
+        if (index >= context->count)
+            break;
+        auto entry = &context->entries[index];
+        if (entry->type != FS_NODE_FILE)
+            continue;
+        /* 超过共享内存剩余空间的部分即使读入也会被换出，不预先读入 */
+        auto populated = atomic_fetch_add(&context->populated, entry->size) + entry->size;
+        _import_map(entry, populated <= context->populate_limit);
+    }
+    return nullptr;
+}
+
+/**
+ * 在一次加锁中建立整棵子树，名称不合法的条目连同其子树一起跳过
+ */
+static FileSystemError _import_build(ImportContext* context, FileSystemNode* cur_dir, FileSystemTransferStats* stats)
+{
+    if (cur_dir == nullptr)
+        return FS_ERROR_NOT_EXIST;
+    auto entries = context->entries;
+    auto error = filesystem_node_create(cur_dir, FS_NODE_DIRECTORY, entries[0].name, nullptr, &entries[0].node);
+    for (size_t i = 1; i < context->count && error == FS_OK; ++i) {
+        auto entry = &entries[i];
+        auto parent = entries[entry->parent].node;
+        if (parent == nullptr || entry->failed) {
+            ++context->skipped;
+            continue;
+        }
+        if (entry->type == FS_NODE_DIRECTORY) {
+            error = filesystem_node_create(parent, FS_NODE_DIRECTORY, entry->name, nullptr, &entry->node);
+        } else {
+            error = filesystem_op_create_file_sized(parent, entry->name, entry->data, entry->length, nullptr);
+        }
+        if (error == FS_ERROR_INVALID_ARGUMENT) {
+            ++context->skipped;
+            error = FS_OK;
+        } else if (error == FS_OK && entry->type == FS_NODE_DIRECTORY) {
+            ++stats->directories;
+        } else if (error == FS_OK) {
+            ++stats->files;
+            stats->bytes += entry->length;
+        }
+    }
+    /* 导入的根目录是新建的，删除它即可撤销整个导入 */
+    if (error != FS_OK && entries[0].node != nullptr)
+        filesystem_node_destroy(entries[0].node);
+    return error;
+}
+
+FileSystemError filesystem_import(FileSystemHandle* handle, const char* host_path, const char* name,
+                                  FileSystemTransferStats* stats)
+{
+    debug_printf("import %s %s\n", host_path, name);
+    FileSystemTransferStats result = {0, 0, 0, 0};
+    ImportContext context = {nullptr, 0, 0, 0, 0, 0, 0, 0, 0};
+    auto root_path = (char*)malloc(strlen(host_path) + 1);
+    if (root_path == nullptr)
+        return FS_ERROR_NO_MEMORY;
+    strcpy(root_path, host_path);
+
+    /* 不持有锁时遍历宿主机目录并并行映射所有文件 */
+    auto error = FS_OK;
+    if (strlen(name) >= FILESYSTEM_NODE_NAME_SIZE) {
+        free(root_path);
+        error = FS_ERROR_INVALID_ARGUMENT;
+    } else if (_import_push(&context, root_path, 0, FS_NODE_DIRECTORY, name) == SIZE_MAX) {
+        free(root_path);
+        error = FS_ERROR_NO_MEMORY;
+    } else {
+        error = _import_walk(&context, 0);
+    }
+    auto saved_errno = errno;
+    if (error == FS_OK)
+        error = _import_estimate(handle, &context, name);
+    if (error == FS_OK) {
+        filesystem_parallel(_import_worker, &context, context.count, TRANSFER_FILES_PER_THREAD);
+        auto locks = filesystem_lock_all(handle, true);
+        error = _import_build(&context, handle->cwd->dir, &result);
+        filesystem_unlock(locks);
+        debug_printf("import unlocked\n");
+    }
+
+    for (size_t i = 0; i < context.count; ++i) {
+        if (context.entries[i].data != nullptr)
+            munmap((void*)context.entries[i].data, context.entries[i].mapped);
+        free(context.entries[i].host_path);
+    }
+    free(context.entries);
+    result.skipped = context.skipped;
+    if (stats != nullptr)
+        *stats = result;
+    errno = saved_errno;
+    return error;
+}
+
+/**
+ * 导出的一个文件，内容直接从共享内存写出，已换出的内容从后备文件读出
+ */
+typedef struct ExportEntry
+{
+    char* host_path;
+    const FileSystemNode* file;
+} ExportEntry;
+
+typedef struct ExportContext
+{
+    ExportEntry* files;
+    size_t count;
+    size_t capacity;
+    size_t directories;
+    _Atomic size_t next; /* 下一个未被领取的文件 */
+    _Atomic size_t bytes; /* 已写出的字节数 */
+    _Atomic int error; /* 第一个出错的errno，没有出错时为0 */
+} ExportContext;
+
+/**
+ * 创建宿主机目录并收集子树中的文件，调用者需要持有子树所在分片的读锁
+ */
+static FileSystemError _export_collect(ExportContext* context, const FileSystemNode* dir, const char* host_path)
+{
+    if (mkdir(host_path, 0755) == -1 && errno != EEXIST)
+        return FS_ERROR_SYSTEM;
+    auto subnode_list = (CList*)dir->data;
+    for (auto it = clist_begin(subnode_list); it != clist_end(subnode_list); it = clist_iterator_next(it)) {
+        auto subnode = (const FileSystemNode*)clist_iterator_get(it);
+        auto path = _host_path_join(host_path, subnode->name);
+        if (path == nullptr)
+            return FS_ERROR_NO_MEMORY;
+        if (subnode->type == FS_NODE_DIRECTORY) {
+            ++context->directories;
+            auto error = _export_collect(context, subnode, path);
+            free(path);
+            if (error != FS_OK)
+                return error;
+            continue;
+        }
+        if (context->count == context->capacity) {
+            auto capacity = context->capacity == 0 ? TRANSFER_INITIAL_CAPACITY : context->capacity * 2;
+            auto files = (ExportEntry*)realloc(context->files, capacity * sizeof(ExportEntry));
+            if (files == nullptr) {
+                free(path);
+                return FS_ERROR_NO_MEMORY;
+            }
+            context->files = files;
+            context->capacity = capacity;
+        }
+        context->files[context->count++] = (ExportEntry){path, subnode};
+    }
+    return FS_OK;
+}
+
+/**
+ * 写出一个文件，每次write尽量写出全部剩余内容
+ * @return 出错时返回errno，成功返回0
+ */
+static int _export_write(const ExportEntry* entry, size_t* bytes)
+{
+    auto loaded = entry->file->spilled ? filesystem_tier_load(entry->file) : nullptr;
+    if (entry->file->spilled && loaded == nullptr)
+        return EIO;
+    auto data = entry->file->spilled ? loaded : (const char*)entry->file->data;
+    auto fd = open(entry->host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        auto saved_errno = errno;
+        free(loaded);
+        return saved_errno;
+    }
+    auto length = data == nullptr ? 0 : strlen(data);
+    for (size_t written = 0; written < length;) {
+        auto result = write(fd, data + written, length - written);
+        if (result == -1 && errno != EINTR) {
+            auto saved_errno = errno;
+            close(fd);
+            free(loaded);
+            return saved_errno;
+        }
+        if (result > 0)
+            written += (size_t)result;
+    }
+    free(loaded);
+    *bytes += length;
+    return close(fd) == -1 ? errno : 0;
+}
+
+static void* _export_worker(void* arg)
+{
+    auto context = (ExportContext*)arg;
+    size_t bytes = 0;
+    for (;;) {
+        auto index = atomic_fetch_add(&context->next, 1);
+        if (index >= context->count)
+            break;
+        auto error = _export_write(&context->files[index], &bytes);
+        int expected = 0;
+        if (error != 0)
+            atomic_compare_exchange_strong(&context->error, &expected, error);
+    }
+    atomic_fetch_add(&context->bytes, bytes);
+    return nullptr;
+}
+
+FileSystemError filesystem_export(FileSystemHandle* handle, const char* name, const char* host_path,
+                                  FileSystemTransferStats* stats)
+{
+    debug_printf("export %s %s\n", name, host_path);
+    ExportContext context = {nullptr, 0, 0, 0, 0, 0, 0};
+    auto error = FS_OK;
+    auto locks = filesystem_lock_cwd(handle, false);
+    auto cur_dir = handle->cwd->dir;
+    auto dir = strcmp(name, ".") == 0 ? cur_dir : filesystem_node_get_subnode(cur_dir, FS_NODE_DIRECTORY, name);
+    if (dir == nullptr) {
+        error = FS_ERROR_NOT_EXIST;
+    } else {
+        /* 写出期间持有读锁，文件内容不会改变，不需要先复制到进程内存 */
+        filesystem_lock_subtree(&locks, dir);
+        error = _export_collect(&context, dir, host_path);
+    }
+    auto saved_errno = errno;
+    if (error == FS_OK) {
+        filesystem_parallel(_export_worker, &context, context.count, TRANSFER_FILES_PER_THREAD);
+        saved_errno = atomic_load(&context.error);
+        if (saved_errno != 0)
+            error = FS_ERROR_SYSTEM;
+    }
+    filesystem_unlock(locks);
+    debug_printf("export unlocked\n");
+
+    for (size_t i = 0; i < context.count; ++i) {
+        free(context.files[i].host_path);
+    }
+    free(context.files);
+    if (stats != nullptr)
+        *stats = (FileSystemTransferStats){context.count, context.directories, atomic_load(&context.bytes), 0};
+    errno = saved_errno;
+    return error;
+}
@@ -0,0 +1,264 @@
+/**
+  ******************************************************************************
+  * @encoding  utf-8
+  * @file      myfilesystem_txn.c
+  * @author    ZYX
+  * @brief     事务，暂存一组操作，提交时在一次加锁中全部执行，失败时按撤销日志回滚
+  ******************************************************************************
+  */
+
+#include "myfilesystem_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "clist.h"
+
+/* 事务中暂存操作的初始容量 */
+constexpr size_t TXN_INITIAL_CAPACITY = 16;
+
+/**
+ * 暂存的一项操作，名称和内容都复制到进程内存中
+ */
+typedef struct FileSystemTxnOp
+{
+    FileSystemRingOp op;
+    char* name;
+    char* data; /* 为nullptr时表示没有内容 */
+} FileSystemTxnOp;
+
+/**
+ * 一项已执行操作的撤销信息
+ * 删除操作只把节点移出父目录，提交时才摧毁；修改文件时保留原数据，提交时才释放
+ */
+typedef struct FileSystemTxnUndo
+{
+    FileSystemNode* node; /* 创建或移出的节点 */
+    FileSystemNode* dir; /* 操作所在的目录 */
+    FileSystemNode* prev; /* 移出的节点在列表中的前一个节点 */
+    void* old_data; /* 修改前的文件数据 */
+} FileSystemTxnUndo;
+
+struct FileSystemTxn
+{
+    FileSystemHandle* handle;
+    size_t count;
+    size_t capacity;
+    FileSystemTxnOp* ops;
+};
+
+FileSystemError filesystem_txn_begin(FileSystemHandle* handle, FileSystemTxn** txn)
+{
+    auto new_txn = (FileSystemTxn*)malloc(sizeof(FileSystemTxn));
+    if (new_txn == nullptr)
+        return FS_ERROR_NO_MEMORY;
+    new_txn->handle = handle;
+    new_txn->count = 0;
+    new_txn->capacity = 0;
+    new_txn->ops = nullptr;
+    *txn = new_txn;
+    return FS_OK;
+}
+
+static char* _string_copy(const char* string)
+{
+    if (string == nullptr)
+        return nullptr;
+    auto size = strlen(string) + 1;
+    auto copy = (char*)malloc(size);
+    if (copy != nullptr)
+        memcpy(copy, string, size);
+    return copy;
+}
+
+FileSystemError filesystem_txn_add(FileSystemTxn* txn, FileSystemRingOp op, const char* name, const char* data)
+{
+    if (name == nullptr || op <= FS_RING_OP_NOP || op > FS_RING_OP_REMOVE_FILE)
+        return FS_ERROR_INVALID_ARGUMENT;
+    if (op == FS_RING_OP_ALTER_FILE && data == nullptr)
+        return FS_ERROR_INVALID_ARGUMENT;
+    if (txn->count == txn->capacity) {
+        auto capacity = txn->capacity == 0 ? TXN_INITIAL_CAPACITY : txn->capacity * 2;
+        auto ops = (FileSystemTxnOp*)realloc(txn->ops, capacity * sizeof(FileSystemTxnOp));
+        if (ops == nullptr)
+            return FS_ERROR_NO_MEMORY;
+        txn->ops = ops;
+        txn->capacity = capacity;
+    }
+    auto txn_op = &txn->ops[txn->count];
+    txn_op->op = op;
+    txn_op->name = _string_copy(name);
+    txn_op->data = _string_copy(data);
+    if (txn_op->name == nullptr || (data != nullptr && txn_op->data == nullptr)) {
+        free(txn_op->name);
+        free(txn_op->data);
+        return FS_ERROR_NO_MEMORY;
+    }
+    ++txn->count;
+    return FS_OK;
+}
+
+void filesystem_txn_abort(FileSystemTxn* txn)
+{
+    if (txn == nullptr)
+        return;
+    for (size_t i = 0; i < txn->count; ++i) {
+        free(txn->ops[i].name);
+        free(txn->ops[i].data);
+    }
+    free(txn->ops);
+    free(txn);
+}
+
+/**
+ * 执行一项操作并记录撤销信息，调用者需要持有所有分片的写锁
+ */
+static FileSystemError _txn_apply(FileSystemCwd* cwd, const FileSystemTxnOp* op, FileSystemTxnUndo* undo)
+{
+    auto dir = cwd->dir;
+    undo->dir = dir;
+    switch (op->op) {
+    case FS_RING_OP_CD:
+        return filesystem_op_cd(cwd, op->name);
+    case FS_RING_OP_MKDIR:
+        /* 同filesystem_op_mkdir，当前目录已被删除时不能创建出没有父节点的目录 */
+        if (dir == nullptr)
+            return FS_ERROR_NOT_EXIST;
+        return filesystem_node_create(dir, FS_NODE_DIRECTORY, op->name, nullptr, &undo->node);
+    case FS_RING_OP_CREATE_FILE:
+        return filesystem_op_create_file(dir, op->name, op->data, &undo->node);
+    case FS_RING_OP_ALTER_FILE:
+        return filesystem_op_alter_file(dir, op->name, op->data, &undo->old_data);
+    case FS_RING_OP_RMDIR:
+    case FS_RING_OP_REMOVE_FILE:
+        undo->node = filesystem_node_get_subnode(dir, op->op == FS_RING_OP_RMDIR ? FS_NODE_DIRECTORY : FS_NODE_FILE,
+                                                 op->name);
+        if (undo->node == nullptr)
+            return FS_ERROR_NOT_EXIST;
+        undo->prev = filesystem_node_unlink(undo->node);
+        return FS_OK;
+    default:
+        return FS_ERROR_INVALID_ARGUMENT;
+    }
+}
+
+/**
+ * 将移出的节点放回父目录中原来的位置
+ */
+static void _txn_relink(FileSystemTxnUndo* undo)
+{
+    auto node = undo->node;
+    auto dir = undo->dir;
+    filesystem_use_node(dir);
+    auto subnode_list = (CList*)dir->data;
+    auto it = clist_end(subnode_list);
+    if (undo->prev != nullptr) {
+        for (it = clist_begin(subnode_list); clist_iterator_get(it) != undo->prev; it = clist_iterator_next(it)) {}
+    }
+    node->link = clist_insert(subnode_list, it, node);
+    if (dir->index != nullptr) {
+        filesystem_use_index(dir->index);
+        FileSystemNodeKey key = {node->name, node->type};
+        cbtree_insert(dir->index, node, &key, filesystem_node_key_compare);
+    }
+    node->parent = dir;
+    filesystem_trigrams_add(node);
+    /* 撤销时恢复原来的用量，不检查配额 */
+    filesystem_usage_add(dir, filesystem_node_usage(node), false);
+    filesystem_node_changed(dir);
+}
+
+/**
+ * 撤销一项已执行的操作，必须按执行的逆序撤销，保证撤销时的状态与执行后相同
+ */
+static void _txn_undo(const FileSystemTxnOp* op, FileSystemTxnUndo* undo)
+{
+    switch (op->op) {
+    case FS_RING_OP_MKDIR:
+    case FS_RING_OP_CREATE_FILE:
+        filesystem_node_destroy(undo->node);
+        break;
+    case FS_RING_OP_ALTER_FILE: {
+        auto node = filesystem_node_get_subnode(undo->dir, FS_NODE_FILE, op->name);
+        filesystem_usage_sub(undo->dir, filesystem_node_usage(node));
+        filesystem_trigrams_remove(node);
+        /* 修改后的内容可能已被后续的操作换出 */
+        filesystem_tier_untrack(node);
+        filesystem_tier_discard(node);
+        free_memory(node->data);
+        node->data = undo->old_data;
+        filesystem_usage_add(undo->dir, filesystem_node_usage(node), false);
+        filesystem_trigrams_add(node);
+        filesystem_tier_track(node);
+        filesystem_node_changed(node);
+        break;
+    }
+    case FS_RING_OP_RMDIR:
+    case FS_RING_OP_REMOVE_FILE:
+        _txn_relink(undo);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * 提交成功后释放被删除的节点和被替换的文件数据
+ */
+static void _txn_finish(const FileSystemTxnOp* op, FileSystemTxnUndo* undo)
+{
+    switch (op->op) {
+    case FS_RING_OP_ALTER_FILE:
+        free_memory(undo->old_data);
+        break;
+    case FS_RING_OP_RMDIR:
+    case FS_RING_OP_REMOVE_FILE:
+        filesystem_node_destroy(undo->node);
+        break;
+    default:
+        break;
+    }
+}
+
+FileSystemError filesystem_txn_commit(FileSystemTxn* txn, size_t* failed_index)
+{
+    debug_printf("txn_commit %zu ops\n", txn->count);
+    auto undo = (FileSystemTxnUndo*)calloc(txn->count + 1, sizeof(FileSystemTxnUndo));
+    if (undo == nullptr) {
+        if (failed_index != nullptr)
+            *failed_index = txn->count;
+        filesystem_txn_abort(txn);
+        return FS_ERROR_NO_MEMORY;
+    }
+
+    /* 操作可能跨越多个分片，整个事务只获取一次所有分片的写锁 */
+    auto handle = txn->handle;
+    auto error = FS_OK;
+    size_t applied = 0;
+    auto locks = filesystem_lock_all(handle, true);
+    /* cd只作用于事务自己的当前目录 */
+    FileSystemCwd cwd;
+    memcpy(&cwd, handle->cwd, sizeof(FileSystemCwd));
+    for (; applied < txn->count; ++applied) {
+        error = _txn_apply(&cwd, &txn->ops[applied], &undo[applied]);
+        if (error != FS_OK)
+            break;
+    }
+    if (error != FS_OK) {
+        for (size_t i = applied; i > 0; --i) {
+            _txn_undo(&txn->ops[i - 1], &undo[i - 1]);
+        }
+        if (failed_index != nullptr)
+            *failed_index = applied;
+    } else {
+        for (size_t i = 0; i < txn->count; ++i) {
+            _txn_finish(&txn->ops[i], &undo[i]);
+        }
+    }
+    filesystem_unlock(locks);
+    debug_printf("txn_commit unlocked\n");
+
+    free(undo);
+    filesystem_txn_abort(txn);
+    return error;
+}
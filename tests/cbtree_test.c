@@ -0,0 +1,312 @@
+/**
+  ******************************************************************************
+  * @encoding  utf-8
+  * @file      cbtree_test.c
+  * @author    ZYX
+  * @brief     cbtree的插入、删除和指针修正的行为测试，只链接cbtree，分配器用malloc代替共享内存
+  ******************************************************************************
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cbtree.h"
+
+constexpr size_t TEST_ITEM_COUNT = 2000;
+
+static int failures = 0;
+
+#define CHECK(condition)                                                                 \
+    do {                                                                                 \
+        if (!(condition)) {                                                              \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition);         \
+            ++failures;                                                                  \
+        }                                                                                \
+    } while (0)
+
+/**
+ * 每块内存前保存大小，用于移动时复制，同时统计未释放的块数
+ * alloc_failures_after不为0时，再分配这么多次之后开始失败
+ */
+typedef struct TestBlock
+{
+    size_t size;
+    max_align_t align[];
+} TestBlock;
+
+static size_t live_blocks = 0;
+static size_t alloc_failures_after = 0;
+
+void* alloc_memory(size_t size)
+{
+    if (alloc_failures_after != 0 && --alloc_failures_after == 0) {
+        alloc_failures_after = 1;
+        return nullptr;
+    }
+    auto block = (TestBlock*)malloc(sizeof(TestBlock) + size);
+    if (block == nullptr)
+        return nullptr;
+    block->size = size;
+    ++live_blocks;
+    return block->align;
+}
+
+void free_memory(void* mem)
+{
+    if (mem == nullptr)
+        return;
+    --live_blocks;
+    free((char*)mem - offsetof(TestBlock, align));
+}
+
+static int _compare(const void* key, const void* item)
+{
+    auto a = *(const int*)key;
+    auto b = *(const int*)item;
+    return (a > b) - (a < b);
+}
+
+typedef struct OrderContext
+{
+    int last;
+    size_t count;
+    bool sorted;
+} OrderContext;
+
+static bool _order_visitor(void* item, void* ctx)
+{
+    auto order = (OrderContext*)ctx;
+    auto value = *(int*)item;
+    if (order->count > 0 && value <= order->last)
+        order->sorted = false;
+    order->last = value;
+    ++order->count;
+    return true;
+}
+
+/**
+ * 检查树中元素严格升序，且个数与cbtree_size一致
+ */
+static void _check_order(CBTree* tree, size_t expected)
+{
+    OrderContext order = {0, 0, true};
+    cbtree_foreach_from(tree, nullptr, _compare, _order_visitor, &order);
+    CHECK(order.sorted);
+    CHECK(order.count == expected);
+    CHECK(cbtree_size(tree) == expected);
+}
+
+static void _shuffle(int* values, size_t count)
+{
+    for (size_t i = count - 1; i > 0; --i) {
+        auto j = (size_t)rand() % (i + 1);
+        auto temp = values[i];
+        values[i] = values[j];
+        values[j] = temp;
+    }
+}
+
+static void test_insert_remove(void)
+{
+    static int values[TEST_ITEM_COUNT];
+    for (size_t i = 0; i < TEST_ITEM_COUNT; ++i) {
+        values[i] = (int)i * 2;
+    }
+    _shuffle(values, TEST_ITEM_COUNT);
+    auto tree = cbtree_create();
+    CHECK(tree != nullptr);
+    for (size_t i = 0; i < TEST_ITEM_COUNT; ++i) {
+        CHECK(cbtree_insert(tree, &values[i], &values[i], _compare));
+    }
+    _check_order(tree, TEST_ITEM_COUNT);
+
+    /* 重复的元素不插入 */
+    int duplicate = values[0];
+    CHECK(!cbtree_insert(tree, &duplicate, &duplicate, _compare));
+    CHECK(cbtree_find(tree, &duplicate, _compare) == &values[0]);
+
+    /* 从不存在的key开始遍历，从下一个元素开始 */
+    int odd = 101;
+    OrderContext order = {0, 0, true};
+    cbtree_foreach_from(tree, &odd, _compare, _order_visitor, &order);
+    CHECK(order.count == TEST_ITEM_COUNT - 51);
+
+    /* 删除一半，剩下的仍然有序且都能找到 */
+    for (size_t i = 0; i < TEST_ITEM_COUNT; i += 2) {
+        CHECK(cbtree_remove(tree, &values[i], _compare) == &values[i]);
+        CHECK(cbtree_find(tree, &values[i], _compare) == nullptr);
+    }
+    int missing = -1;
+    CHECK(cbtree_remove(tree, &missing, _compare) == nullptr);
+    _check_order(tree, TEST_ITEM_COUNT / 2);
+    for (size_t i = 1; i < TEST_ITEM_COUNT; i += 2) {
+        CHECK(cbtree_find(tree, &values[i], _compare) == &values[i]);
+    }
+    for (size_t i = 1; i < TEST_ITEM_COUNT; i += 2) {
+        CHECK(cbtree_remove(tree, &values[i], _compare) == &values[i]);
+    }
+    _check_order(tree, 0);
+    cbtree_destroy(tree);
+    CHECK(live_blocks == 0);
+}
+
+static void test_insert_no_memory(void)
+{
+    static int values[TEST_ITEM_COUNT];
+    auto tree = cbtree_create();
+    CHECK(tree != nullptr);
+    size_t inserted = 0;
+    /* 分配失败时插入返回false，已有的元素不受影响 */
+    alloc_failures_after = 4;
+    for (size_t i = 0; i < TEST_ITEM_COUNT; ++i) {
+        values[i] = (int)i;
+        if (cbtree_insert(tree, &values[i], &values[i], _compare)) {
+            ++inserted;
+        } else {
+            CHECK(cbtree_find(tree, &values[i], _compare) == nullptr);
+        }
+    }
+    alloc_failures_after = 0;
+    CHECK(inserted < TEST_ITEM_COUNT);
+    _check_order(tree, inserted);
+    for (size_t i = 0; i < inserted; ++i) {
+        CHECK(cbtree_find(tree, &values[i], _compare) == &values[i]);
+    }
+    cbtree_destroy(tree);
+    CHECK(live_blocks == 0);
+}
+
+/**
+ * 模拟整理内存: 修正指针时为每个节点分配新的位置并记录，全部修正完成后再复制和释放原来的节点
+ */
+typedef struct MoveContext
+{
+    void* from[TEST_ITEM_COUNT];
+    void* to[TEST_ITEM_COUNT];
+    size_t count;
+    int items[TEST_ITEM_COUNT]; /* 元素移动后的位置 */
+    void* target; /* 只修正指向该节点的指针时使用 */
+    size_t target_visits;
+} MoveContext;
+
+static void _node_mover(void** slot, void* ctx)
+{
+    auto move = (MoveContext*)ctx;
+    auto block = (TestBlock*)((char*)*slot - offsetof(TestBlock, align));
+    auto to = alloc_memory(block->size);
+    move->from[move->count] = *slot;
+    move->to[move->count++] = to;
+    *slot = to;
+}
+
+static void _item_mover(void** slot, void* ctx)
+{
+    auto move = (MoveContext*)ctx;
+    auto value = *(int*)*slot;
+    move->items[value] = value;
+    *slot = &move->items[value];
+}
+
+static int single_item = 0;
+
+static void _single_item_mover(void** slot, void* ctx)
+{
+    (void)ctx;
+    single_item = *(int*)*slot;
+    *slot = &single_item;
+}
+
+static void _move_finish(MoveContext* move)
+{
+    for (size_t i = 0; i < move->count; ++i) {
+        auto block = (TestBlock*)((char*)move->from[i] - offsetof(TestBlock, align));
+        memcpy(move->to[i], move->from[i], block->size);
+        free_memory(move->from[i]);
+    }
+    move->count = 0;
+}
+
+static void _node_recorder(void** slot, void* ctx)
+{
+    auto move = (MoveContext*)ctx;
+    move->from[move->count++] = *slot;
+}
+
+static void _target_checker(void** slot, void* ctx)
+{
+    auto move = (MoveContext*)ctx;
+    if (*slot == move->target)
+        ++move->target_visits;
+    _node_mover(slot, ctx);
+}
+
+static void test_relocate(void)
+{
+    static int values[TEST_ITEM_COUNT];
+    static MoveContext move;
+    auto tree = cbtree_create();
+    CHECK(tree != nullptr);
+    for (size_t i = 0; i < TEST_ITEM_COUNT; ++i) {
+        values[i] = (int)i;
+        CHECK(cbtree_insert(tree, &values[i], &values[i], _compare));
+    }
+    auto blocks = live_blocks;
+
+    /* 移动所有节点和元素，之后所有元素都在新的位置上，原来的节点已释放 */
+    move.count = 0;
+    cbtree_relocate(tree, _node_mover, _item_mover, &move);
+    CHECK(move.count + 1 == blocks);
+    _move_finish(&move);
+    CHECK(live_blocks == blocks);
+    _check_order(tree, TEST_ITEM_COUNT);
+    for (size_t i = 0; i < TEST_ITEM_COUNT; ++i) {
+        CHECK(cbtree_find(tree, &values[i], _compare) == &move.items[i]);
+    }
+
+    /* 只移动一个元素，相邻的元素不变 */
+    int key = 777, previous = 776, next = 778;
+    cbtree_relocate_item(tree, &key, _compare, _single_item_mover, nullptr);
+    CHECK(cbtree_find(tree, &key, _compare) == &single_item);
+    CHECK(cbtree_find(tree, &previous, _compare) == &move.items[776]);
+    CHECK(cbtree_find(tree, &next, _compare) == &move.items[778]);
+    move.items[777] = -1;
+
+    /* 逐个移动每个节点，每次只访问指向该节点的一个指针 */
+    static void* nodes[TEST_ITEM_COUNT];
+    move.count = 0;
+    cbtree_relocate(tree, _node_recorder, nullptr, &move);
+    auto node_count = move.count;
+    memcpy(nodes, move.from, node_count * sizeof(void*));
+    for (size_t i = 0; i < node_count; ++i) {
+        move.count = 0;
+        move.target = nodes[i];
+        move.target_visits = 0;
+        cbtree_relocate_node(tree, nodes[i], _compare, _target_checker, &move);
+        CHECK(move.count == 1);
+        CHECK(move.target_visits == 1);
+        _move_finish(&move);
+    }
+    CHECK(live_blocks == blocks);
+    _check_order(tree, TEST_ITEM_COUNT);
+    for (size_t i = 0; i < TEST_ITEM_COUNT; ++i) {
+        auto item = i == 777 ? &single_item : &move.items[i];
+        CHECK(cbtree_remove(tree, item, _compare) == item);
+    }
+    _check_order(tree, 0);
+    cbtree_destroy(tree);
+    CHECK(live_blocks == 0);
+}
+
+int main(void)
+{
+    srand(1);
+    test_insert_remove();
+    test_insert_no_memory();
+    test_relocate();
+    if (failures != 0) {
+        printf("cbtree_test: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("cbtree_test: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,364 @@
+/**
+  ******************************************************************************
+  * @encoding  utf-8
+  * @file      myfs_test.c
+  * @author    ZYX
+  * @brief     文件系统的行为测试: 事务回滚、提交/完成队列、整理内存、分层存储和导入导出
+  ******************************************************************************
+  */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "myfilesystem.h"
+
+/* 整理内存和分层存储测试中的文件数 */
+constexpr size_t TEST_FILE_COUNT = 400;
+/* 分层存储测试中每个文件的大小，超过换出的最小长度 */
+constexpr size_t TEST_FILE_SIZE = 4096;
+
+static int failures = 0;
+
+#define CHECK(condition)                                                                 \
+    do {                                                                                 \
+        if (!(condition)) {                                                              \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition);         \
+            ++failures;                                                                  \
+        }                                                                                \
+    } while (0)
+
+/* 测试用的宿主机临时目录 */
+static char host_root[] = "/tmp/myfs_test_XXXXXX";
+
+/**
+ * 读取文件并与expected比较
+ */
+static bool _file_equals(FileSystemHandle* handle, const char* name, const char* expected)
+{
+    auto size = strlen(expected) + 1;
+    auto buffer = (char*)malloc(size);
+    if (buffer == nullptr)
+        return false;
+    size_t length = 0;
+    auto error = filesystem_read_file(handle, name, buffer, size, &length);
+    auto equal = error == FS_OK && length == size - 1 && strcmp(buffer, expected) == 0;
+    free(buffer);
+    return equal;
+}
+
+static bool _exists(FileSystemHandle* handle, const char* name, FileSystemNodeType type)
+{
+    uint32_t seq = 0;
+    return filesystem_watch(handle, name, type, &seq, 0) == FS_OK;
+}
+
+/**
+ * 生成第index个文件的内容，长度为size - 1
+ */
+static void _fill_content(char* buffer, size_t size, size_t index)
+{
+    auto written = (size_t)snprintf(buffer, size, "file%zu:", index);
+    for (size_t i = written; i + 1 < size; ++i) {
+        buffer[i] = (char)('a' + (i * 7 + index) % 26);
+    }
+    buffer[size - 1] = '\0';
+}
+
+static void test_txn_rollback(FileSystemHandle* handle)
+{
+    CHECK(filesystem_mkdir(handle, "txn") == FS_OK);
+    CHECK(filesystem_cd(handle, "txn") == FS_OK);
+    CHECK(filesystem_create_file(handle, "keep", "old") == FS_OK);
+    CHECK(filesystem_create_file(handle, "gone", "still here") == FS_OK);
+
+    /* 最后一步失败，之前的修改、删除和创建全部回滚 */
+    FileSystemTxn* txn = nullptr;
+    CHECK(filesystem_txn_begin(handle, &txn) == FS_OK);
+    CHECK(filesystem_txn_add(txn, FS_RING_OP_ALTER_FILE, "keep", "new") == FS_OK);
+    CHECK(filesystem_txn_add(txn, FS_RING_OP_REMOVE_FILE, "gone", nullptr) == FS_OK);
+    CHECK(filesystem_txn_add(txn, FS_RING_OP_MKDIR, "made", nullptr) == FS_OK);
+    CHECK(filesystem_txn_add(txn, FS_RING_OP_CD, "made", nullptr) == FS_OK);
+    CHECK(filesystem_txn_add(txn, FS_RING_OP_CREATE_FILE, "inner", "x") == FS_OK);
+    CHECK(filesystem_txn_add(txn, FS_RING_OP_RMDIR, "missing", nullptr) == FS_OK);
+    size_t failed_index = 0;
+    CHECK(filesystem_txn_commit(txn, &failed_index) == FS_ERROR_NOT_EXIST);
+    CHECK(failed_index == 5);
+    CHECK(_file_equals(handle, "keep", "old"));
+    CHECK(_file_equals(handle, "gone", "still here"));
+    CHECK(!_exists(handle, "made", FS_NODE_DIRECTORY));
+
+    /* 全部成功时一起生效，cd不影响句柄的当前目录 */
+    CHECK(filesystem_txn_begin(handle, &txn) == FS_OK);
+    CHECK(filesystem_txn_add(txn, FS_RING_OP_ALTER_FILE, "keep", "new") == FS_OK);
+    CHECK(filesystem_txn_add(txn, FS_RING_OP_MKDIR, "made", nullptr) == FS_OK);
+    CHECK(filesystem_txn_add(txn, FS_RING_OP_CD, "made", nullptr) == FS_OK);
+    CHECK(filesystem_txn_add(txn, FS_RING_OP_CREATE_FILE, "inner", "x") == FS_OK);
+    CHECK(filesystem_txn_commit(txn, &failed_index) == FS_OK);
+    CHECK(_file_equals(handle, "keep", "new"));
+    CHECK(filesystem_cd(handle, "made") == FS_OK);
+    CHECK(_file_equals(handle, "inner", "x"));
+    CHECK(filesystem_cd(handle, "/") == FS_OK);
+}
+
+static void test_ring(FileSystemHandle* handle)
+{
+    CHECK(filesystem_mkdir(handle, "ring") == FS_OK);
+    CHECK(filesystem_cd(handle, "ring") == FS_OK);
+    FileSystemRing* ring = nullptr;
+    CHECK(filesystem_ring_register(handle, &ring) == FS_OK);
+    if (ring == nullptr)
+        return;
+
+    /* 提交后由同一个线程执行，完成事件按提交顺序返回，带回user_data和各自的错误 */
+    CHECK(filesystem_ring_submit(ring, FS_RING_OP_MKDIR, "dir", nullptr, 1) == FS_OK);
+    CHECK(filesystem_ring_submit(ring, FS_RING_OP_CD, "dir", nullptr, 2) == FS_OK);
+    CHECK(filesystem_ring_submit(ring, FS_RING_OP_CREATE_FILE, "file", "ring data", 3) == FS_OK);
+    CHECK(filesystem_ring_submit(ring, FS_RING_OP_CREATE_FILE, "file", "again", 4) == FS_OK);
+    FileSystemRingCompletion completion;
+    CHECK(filesystem_ring_reap(ring, &completion, false) == FS_ERROR_BUSY);
+    size_t applied = 0;
+    CHECK(filesystem_ring_apply(handle, FILESYSTEM_RING_ENTRIES, &applied) == FS_OK);
+    CHECK(applied == 4);
+    FileSystemError expected[] = {FS_OK, FS_OK, FS_OK, FS_ERROR_EXIST};
+    for (size_t i = 0; i < 4; ++i) {
+        CHECK(filesystem_ring_reap(ring, &completion, false) == FS_OK);
+        CHECK(completion.user_data == i + 1);
+        CHECK(completion.error == expected[i]);
+    }
+    CHECK(filesystem_ring_reap(ring, &completion, false) == FS_ERROR_BUSY);
+
+    /* 提交队列满时返回FS_ERROR_BUSY，执行后可以继续提交 */
+    size_t submitted = 0;
+    while (filesystem_ring_submit(ring, FS_RING_OP_NOP, "nop", nullptr, submitted) == FS_OK) {
+        ++submitted;
+    }
+    CHECK(submitted == FILESYSTEM_RING_ENTRIES);
+    CHECK(filesystem_ring_apply(handle, FILESYSTEM_RING_ENTRIES, &applied) == FS_OK);
+    for (size_t i = 0; i < submitted; ++i) {
+        CHECK(filesystem_ring_reap(ring, &completion, true) == FS_OK);
+        CHECK(completion.user_data == i);
+    }
+    filesystem_ring_unregister(ring);
+
+    CHECK(filesystem_cd(handle, "dir") == FS_OK);
+    CHECK(_file_equals(handle, "file", "ring data"));
+    CHECK(filesystem_cd(handle, "/") == FS_OK);
+}
+
+static void test_defrag(FileSystemHandle* handle)
+{
+    CHECK(filesystem_mkdir(handle, "defrag") == FS_OK);
+    CHECK(filesystem_cd(handle, "defrag") == FS_OK);
+    CHECK(filesystem_index_dir(handle, ".") == FS_OK);
+    CHECK(filesystem_trigram_index(handle, ".") == FS_OK);
+    char name[FILESYSTEM_NODE_NAME_SIZE];
+    char content[TEST_FILE_SIZE];
+    for (size_t i = 0; i < TEST_FILE_COUNT; ++i) {
+        snprintf(name, sizeof(name), "f%zu", i);
+        _fill_content(content, 16 + i % 512, i);
+        CHECK(filesystem_create_file(handle, name, content) == FS_OK);
+    }
+    /* 删除一半留下空洞，整理后剩下的文件内容、有序列出和搜索结果都不变 */
+    for (size_t i = 0; i < TEST_FILE_COUNT; i += 2) {
+        snprintf(name, sizeof(name), "f%zu", i);
+        CHECK(filesystem_remove_file(handle, name) == FS_OK);
+    }
+    auto before = filesystem_memory_usage(handle);
+    size_t reclaimed = 0;
+    CHECK(filesystem_defrag(handle, &reclaimed) == FS_OK);
+    CHECK(filesystem_memory_usage(handle) < before);
+    for (size_t i = 1; i < TEST_FILE_COUNT; i += 2) {
+        snprintf(name, sizeof(name), "f%zu", i);
+        _fill_content(content, 16 + i % 512, i);
+        CHECK(_file_equals(handle, name, content));
+    }
+    FileSystemDirEntry entries[TEST_FILE_COUNT];
+    size_t count = 0;
+    CHECK(filesystem_ls_sorted(handle, nullptr, nullptr, entries, TEST_FILE_COUNT, &count) == FS_OK);
+    CHECK(count == TEST_FILE_COUNT / 2);
+    for (size_t i = 1; i < count; ++i) {
+        CHECK(strcmp(entries[i - 1].name, entries[i].name) < 0);
+    }
+    FileSystemGrepMatch matches[2];
+    FileSystemGrepStats stats;
+    CHECK(filesystem_grep(handle, ".", "file123:", matches, 2, &count, &stats) == FS_OK);
+    CHECK(count == 1 && strcmp(matches[0].path, "f123") == 0);
+    CHECK(filesystem_grep(handle, ".", "file122:", matches, 2, &count, &stats) == FS_OK);
+    CHECK(count == 0);
+
+    /* 整理后仍然可以继续修改 */
+    CHECK(filesystem_alter_file(handle, "f1", "altered") == FS_OK);
+    CHECK(_file_equals(handle, "f1", "altered"));
+    CHECK(filesystem_create_file(handle, "f0", "recreated") == FS_OK);
+    CHECK(_file_equals(handle, "f0", "recreated"));
+    CHECK(filesystem_cd(handle, "/") == FS_OK);
+}
+
+static void test_tier(FileSystemHandle* handle)
+{
+    char backing_path[sizeof(host_root) + 16];
+    snprintf(backing_path, sizeof(backing_path), "%s/backing", host_root);
+    CHECK(filesystem_mkdir(handle, "tier") == FS_OK);
+    CHECK(filesystem_cd(handle, "tier") == FS_OK);
+
+    /* 水位设在当前用量之上，写入的内容超过水位后较早的文件被换出 */
+    FileSystemTierStats stats;
+    CHECK(filesystem_tier_stats(handle, &stats) == FS_OK);
+    auto high_water = stats.allocated + TEST_FILE_COUNT * TEST_FILE_SIZE / 4;
+    CHECK(filesystem_tier_enable(handle, backing_path, high_water, high_water / 4 * 3) == FS_OK);
+    char name[FILESYSTEM_NODE_NAME_SIZE];
+    char content[TEST_FILE_SIZE];
+    for (size_t i = 0; i < TEST_FILE_COUNT; ++i) {
+        snprintf(name, sizeof(name), "t%zu", i);
+        _fill_content(content, sizeof(content), i);
+        CHECK(filesystem_create_file(handle, name, content) == FS_OK);
+    }
+    CHECK(filesystem_tier_stats(handle, &stats) == FS_OK);
+    CHECK(stats.spills > 0);
+    CHECK(stats.backing_bytes > 0);
+
+    /* 读取换出的文件时从后备文件调回，内容不变 */
+    for (size_t i = 0; i < TEST_FILE_COUNT; ++i) {
+        snprintf(name, sizeof(name), "t%zu", i);
+        _fill_content(content, sizeof(content), i);
+        CHECK(_file_equals(handle, name, content));
+    }
+    CHECK(filesystem_tier_stats(handle, &stats) == FS_OK);
+    CHECK(stats.misses > 0);
+
+    /* 刚调回的文件留在共享内存中，再次读取时命中 */
+    auto hits = stats.hits;
+    CHECK(_file_equals(handle, name, content));
+    CHECK(filesystem_tier_stats(handle, &stats) == FS_OK);
+    CHECK(stats.hits > hits);
+    CHECK(filesystem_cd(handle, "/") == FS_OK);
+}
+
+/**
+ * 在宿主机上写入文件，返回是否成功
+ */
+static bool _host_write(const char* path, const char* content)
+{
+    auto file = fopen(path, "w");
+    if (file == nullptr)
+        return false;
+    auto length = strlen(content);
+    auto written = fwrite(content, 1, length, file);
+    return fclose(file) == 0 && written == length;
+}
+
+/**
+ * 读取宿主机上的文件并与expected比较
+ */
+static bool _host_equals(const char* path, const char* expected)
+{
+    auto file = fopen(path, "r");
+    if (file == nullptr)
+        return false;
+    auto length = strlen(expected);
+    auto buffer = (char*)malloc(length + 1);
+    auto read = buffer == nullptr ? 0 : fread(buffer, 1, length + 1, file);
+    auto equal = buffer != nullptr && read == length && memcmp(buffer, expected, length) == 0;
+    free(buffer);
+    fclose(file);
+    return equal;
+}
+
+static void test_import_export(FileSystemHandle* handle)
+{
+    char path[sizeof(host_root) + 64];
+    char large[TEST_FILE_SIZE];
+    _fill_content(large, sizeof(large), 7);
+    snprintf(path, sizeof(path), "%s/in", host_root);
+    CHECK(mkdir(path, 0700) == 0);
+    snprintf(path, sizeof(path), "%s/in/sub", host_root);
+    CHECK(mkdir(path, 0700) == 0);
+    snprintf(path, sizeof(path), "%s/in/a.txt", host_root);
+    CHECK(_host_write(path, "alpha"));
+    snprintf(path, sizeof(path), "%s/in/empty", host_root);
+    CHECK(_host_write(path, ""));
+    snprintf(path, sizeof(path), "%s/in/sub/large", host_root);
+    CHECK(_host_write(path, large));
+
+    FileSystemTransferStats stats;
+    snprintf(path, sizeof(path), "%s/in", host_root);
+    CHECK(filesystem_import(handle, path, "imported", &stats) == FS_OK);
+    CHECK(stats.files == 3);
+    CHECK(stats.bytes == strlen("alpha") + strlen(large));
+    CHECK(stats.skipped == 0);
+    CHECK(filesystem_import(handle, path, "imported", &stats) == FS_ERROR_EXIST);
+    CHECK(filesystem_cd(handle, "imported") == FS_OK);
+    CHECK(_file_equals(handle, "a.txt", "alpha"));
+    CHECK(_file_equals(handle, "empty", ""));
+    CHECK(filesystem_cd(handle, "sub") == FS_OK);
+    CHECK(_file_equals(handle, "large", large));
+    CHECK(filesystem_cd(handle, "/") == FS_OK);
+
+    /* 导出后与导入前的宿主机文件相同 */
+    snprintf(path, sizeof(path), "%s/out", host_root);
+    CHECK(filesystem_export(handle, "imported", path, &stats) == FS_OK);
+    CHECK(stats.files == 3);
+    snprintf(path, sizeof(path), "%s/out/a.txt", host_root);
+    CHECK(_host_equals(path, "alpha"));
+    snprintf(path, sizeof(path), "%s/out/empty", host_root);
+    CHECK(_host_equals(path, ""));
+    snprintf(path, sizeof(path), "%s/out/sub/large", host_root);
+    CHECK(_host_equals(path, large));
+}
+
+/**
+ * 递归删除宿主机上的目录
+ */
+static void _host_remove(const char* path)
+{
+    auto dir = opendir(path);
+    if (dir != nullptr) {
+        struct dirent* dirent;
+        while ((dirent = readdir(dir)) != nullptr) {
+            if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+                continue;
+            char child[FILESYSTEM_PWD_SIZE];
+            snprintf(child, sizeof(child), "%s/%s", path, dirent->d_name);
+            _host_remove(child);
+        }
+        closedir(dir);
+    }
+    remove(path);
+}
+
+int main(int argc, char* argv[])
+{
+    (void)argc;
+    if (mkdtemp(host_root) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+    /* 以测试程序自身的路径生成共享内存key，先删除上次异常退出时留下的共享内存 */
+    FileSystemHandle* handle = nullptr;
+    auto error = filesystem_open_sharded(argv[0], 0, 2, &handle);
+    if (error == FS_OK) {
+        filesystem_destroy(handle, true);
+        error = filesystem_open_sharded(argv[0], 0, 2, &handle);
+    }
+    if (error != FS_OK) {
+        printf("filesystem_open failed, %s!\n", filesystem_strerror(error));
+        _host_remove(host_root);
+        return 1;
+    }
+    test_txn_rollback(handle);
+    test_ring(handle);
+    test_defrag(handle);
+    test_tier(handle);
+    test_import_export(handle);
+    filesystem_destroy(handle, false);
+    _host_remove(host_root);
+    if (failures != 0) {
+        printf("myfs_test: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("myfs_test: all checks passed\n");
+    return 0;
+}